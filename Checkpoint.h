@@ -0,0 +1,86 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+
+// bytes written between checkpoints
+#define CHECKPOINT_INTERVAL (4 * 1024 * 1024)
+#define CHECKPOINT_MAGIC "cs118-tcp-checkpoint 1"
+
+// How far a download got, kept beside the file as <file>.ckpt so a
+// restarted receiver can ask for just the missing tail. offset is where
+// the contiguously written bytes end in the file; the file's length and
+// mtime on the server tell whether those bytes are still good.
+struct CheckpointState {
+    int64_t offset;
+    int64_t fileLength;
+    int64_t fileMtime;
+};
+
+// The file is only ever replaced whole (written aside and renamed), and
+// the caller syncs the data before saving, so a checkpoint never claims
+// bytes a crash could have lost.
+class Checkpoint {
+public:
+    Checkpoint() {
+        m_path[0] = '\0';
+        m_saved = 0;
+    }
+
+    // returns false if the name is too long to put a suffix on
+    bool setPath(const char* filename) {
+        int len = snprintf(m_path, sizeof(m_path), "%s.ckpt", filename);
+        return len < (int)sizeof(m_path);
+    }
+
+    const char* path() { return m_path; }
+
+    // returns false if there is no readable checkpoint
+    bool load(CheckpointState* state) {
+        FILE* f = fopen(m_path, "r");
+        if (!f)
+            return false;
+        long long offset, length, mtime;
+        bool ok = fscanf(f, CHECKPOINT_MAGIC " %lld %lld %lld", &offset, &length, &mtime) == 3 &&
+                  offset >= 0 && offset <= length;
+        fclose(f);
+        if (!ok)
+            return false;
+        state->offset = offset;
+        state->fileLength = length;
+        state->fileMtime = mtime;
+        m_saved = offset;
+        return true;
+    }
+
+    // whether the download has moved on far enough since the last save
+    bool due(int64_t offset) { return offset - m_saved >= CHECKPOINT_INTERVAL; }
+
+    bool save(const CheckpointState& state) {
+        char tmp[PATH_MAX + 8];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", m_path);
+        FILE* f = fopen(tmp, "w");
+        if (!f)
+            return false;
+        fprintf(f, CHECKPOINT_MAGIC " %lld %lld %lld\n",
+            (long long)state.offset, (long long)state.fileLength, (long long)state.fileMtime);
+        if (fclose(f) != 0 || rename(tmp, m_path) != 0) {
+            unlink(tmp);
+            return false;
+        }
+        m_saved = state.offset;
+        return true;
+    }
+
+    // the download finished, or the checkpoint no longer applies
+    void remove() { unlink(m_path); }
+
+private:
+    char m_path[PATH_MAX];
+    int64_t m_saved;
+};
+
+#endif
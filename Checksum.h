@@ -0,0 +1,158 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+// checksum algorithms a packet can be protected with
+#define CHECKSUM_LEGACY 0   // packet_hash(), only used by the legacy text format
+#define CHECKSUM_CRC32C 1   // Castagnoli CRC over header and payload
+#define CHECKSUM_NONE 2     // no checksum, if the receiver asks for it in the handshake
+
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78
+
+// All crc32c functions take and return a finished CRC, so a checksum over
+// several pieces can be built by passing each result to the next call:
+// crc32c(crc32c(0, a, n), b, m) == crc32c(0, ab, n + m).
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const char* data, size_t len);
+
+struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables() {
+        for (int i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; ++j)
+                crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+            table[0][i] = crc;
+        }
+        for (int i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k)
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+        }
+    }
+};
+
+inline const Crc32cTables&
+crc32c_tables() {
+    static Crc32cTables tables;
+    return tables;
+}
+
+// portable slicing-by-8: eight table lookups per 8 input bytes
+inline uint32_t
+crc32c_sw(uint32_t crc, const char* data, size_t len) {
+    const uint32_t (*t)[256] = crc32c_tables().table;
+    const unsigned char* p = (const unsigned char*)data;
+    crc = ~crc;
+
+    while (len && ((uintptr_t)p & 7)) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+              t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+              t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+// SSE4.2 crc32 instruction, one 8 byte word per instruction
+__attribute__((target("sse4.2")))
+inline uint32_t
+crc32c_hw(uint32_t crc, const char* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    crc = ~crc;
+
+    while (len && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        crc = _mm_crc32_u32(crc, word);
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return ~crc;
+}
+#endif
+
+// picks the fastest implementation the CPU we're running on supports
+inline crc32c_fn
+crc32c_select() {
+#ifdef CRC32C_HAVE_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        return crc32c_hw;
+#endif
+    return crc32c_sw;
+}
+
+inline uint32_t
+crc32c(uint32_t crc, const char* data, size_t len) {
+    static crc32c_fn fn = crc32c_select();
+    return fn(crc, data, len);
+}
+
+inline const char*
+checksum_name(int type) {
+    switch (type) {
+    case CHECKSUM_LEGACY:
+        return "legacy";
+    case CHECKSUM_CRC32C:
+        return "crc32c";
+    case CHECKSUM_NONE:
+        return "none";
+    }
+    return "unknown";
+}
+
+inline const char*
+crc32c_impl_name() {
+#ifdef CRC32C_HAVE_SSE42
+    if (crc32c_select() == crc32c_hw)
+        return "sse4.2";
+#endif
+    return "slicing-by-8";
+}
+
+#endif
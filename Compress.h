@@ -0,0 +1,520 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Packet.h"
+#include "FileSink.h"
+
+// Compression of the data stream, negotiated in the handshake (OPT_COMPRESS).
+// The file is cut into chunks of COMPRESS_CHUNK bytes and each chunk becomes
+// one frame:
+//
+//   u64 offset in the file   u32 length in the file   u32 length of data
+//   data: the chunk as an LZ4 block, or as is if that isn't any smaller
+//
+// A compressed transfer's sequence numbers count bytes of this stream of
+// frames rather than of the file. Frames say where they go, so the receiver
+// writes each one as it completes, and chunks compressed for one transfer
+// are reused by the next.
+#define COMPRESS_NONE 0
+#define COMPRESS_LZ4 1
+#define COMPRESS_CHUNK (64 * 1024)
+#define COMPRESS_FRAME_HEADER 16
+
+// LZ4 block format: matches are found through a hash of the next four bytes
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5     // a block always ends in at least this many literals
+#define LZ4_MATCH_LIMIT 12      // and no match starts this close to its end
+#define LZ4_MAX_OFFSET 65535
+
+inline uint32_t
+lz4_load32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// writes an LZ4 length continuation: 255s, then the remainder
+inline uint8_t*
+lz4_put_length(uint8_t* out, int len) {
+    while (len >= 255) {
+        *out++ = 255;
+        len -= 255;
+    }
+    *out++ = (uint8_t)len;
+    return out;
+}
+
+// Emits litLen literals followed by a match of matchLen at offset back, or
+// only the literals when matchLen is 0. Returns NULL if out would pass end.
+inline uint8_t*
+lz4_put_sequence(uint8_t* out, uint8_t* end, const uint8_t* literals, int litLen, int offset, int matchLen) {
+    if (out + 1 + litLen / 255 + 1 + litLen + 2 + matchLen / 255 + 1 > end)
+        return NULL;
+    uint8_t* token = out++;
+    *token = (uint8_t)((litLen >= 15 ? 15 : litLen) << 4);
+    if (litLen >= 15)
+        out = lz4_put_length(out, litLen - 15);
+    memcpy(out, literals, litLen);
+    out += litLen;
+    if (matchLen == 0)
+        return out;
+    *out++ = (uint8_t)(offset & 0xff);
+    *out++ = (uint8_t)(offset >> 8);
+    int ml = matchLen - LZ4_MIN_MATCH;
+    *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+    if (ml >= 15)
+        out = lz4_put_length(out, ml - 15);
+    return out;
+}
+
+// Greedy LZ4 block compressor. Returns the compressed length, or 0 if it
+// wouldn't fit in dstCap bytes.
+inline int
+lz4_compress(const char* src, int srcLen, char* dst, int dstCap) {
+    const uint8_t* in = (const uint8_t*)src;
+    uint8_t* out = (uint8_t*)dst;
+    uint8_t* end = out + dstCap;
+    int table[1 << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    int anchor = 0;
+    int pos = 0;
+    while (pos < srcLen - LZ4_MATCH_LIMIT) {
+        uint32_t seq = lz4_load32(in + pos);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+        int candidate = table[h];
+        table[h] = pos;
+        if (candidate >= pos || pos - candidate > LZ4_MAX_OFFSET || lz4_load32(in + candidate) != seq) {
+            // step faster through data that isn't matching
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+        while (pos > anchor && candidate > 0 && in[pos - 1] == in[candidate - 1]) {
+            pos--;
+            candidate--;
+        }
+        int len = LZ4_MIN_MATCH;
+        while (pos + len < srcLen - LZ4_LAST_LITERALS && in[pos + len] == in[candidate + len])
+            len++;
+        out = lz4_put_sequence(out, end, in + anchor, pos - anchor, pos - candidate, len);
+        if (!out)
+            return 0;
+        pos += len;
+        anchor = pos;
+    }
+    out = lz4_put_sequence(out, end, in + anchor, srcLen - anchor, 0, 0);
+    return out ? (int)(out - (uint8_t*)dst) : 0;
+}
+
+// Returns the decompressed length, or -1 if the block is malformed or
+// wouldn't fit in dstCap bytes.
+inline int
+lz4_decompress(const char* src, int srcLen, char* dst, int dstCap) {
+    const uint8_t* in = (const uint8_t*)src;
+    const uint8_t* inEnd = in + srcLen;
+    uint8_t* out = (uint8_t*)dst;
+    uint8_t* outEnd = out + dstCap;
+    while (in < inEnd) {
+        int token = *in++;
+        int litLen = token >> 4;
+        if (litLen == 15) {
+            int b;
+            do {
+                if (in >= inEnd)
+                    return -1;
+                b = *in++;
+                litLen += b;
+            } while (b == 255);
+        }
+        if (litLen > inEnd - in || litLen > outEnd - out)
+            return -1;
+        memcpy(out, in, litLen);
+        in += litLen;
+        out += litLen;
+        // the last sequence has no match
+        if (in == inEnd)
+            break;
+
+        if (inEnd - in < 2)
+            return -1;
+        int offset = in[0] | (in[1] << 8);
+        in += 2;
+        if (offset == 0 || offset > out - (uint8_t*)dst)
+            return -1;
+        int matchLen = token & 15;
+        if (matchLen == 15) {
+            int b;
+            do {
+                if (in >= inEnd)
+                    return -1;
+                b = *in++;
+                matchLen += b;
+            } while (b == 255);
+        }
+        matchLen += LZ4_MIN_MATCH;
+        if (matchLen > outEnd - out)
+            return -1;
+        const uint8_t* match = out - offset;
+        if (offset >= matchLen) {
+            memcpy(out, match, matchLen);
+        }
+        else {
+            // overlapping: the match repeats bytes it is producing
+            for (int i = 0; i < matchLen; ++i)
+                out[i] = match[i];
+        }
+        out += matchLen;
+    }
+    return (int)(out - (uint8_t*)dst);
+}
+
+inline int64_t
+cpu_time_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// What compressing chunks has cost and saved, over a worker's lifetime.
+struct CompressStats {
+    unsigned long chunks;       // compressed
+    unsigned long reused;       // served again without compressing
+    int64_t rawBytes;
+    int64_t packedBytes;        // frames, headers included
+    int64_t cpuUs;
+};
+
+inline void
+compress_stats_write_json(FILE* f, const CompressStats& stats) {
+    fprintf(f, "{\"chunks\": %lu, \"reused\": %lu, \"rawBytes\": %lld, \"packedBytes\": %lld, \"ratio\": %.2f, \"cpuUs\": %lld}",
+        stats.chunks, stats.reused, (long long)stats.rawBytes, (long long)stats.packedBytes,
+        stats.packedBytes > 0 ? (double)stats.rawBytes / stats.packedBytes : 0.0, (long long)stats.cpuUs);
+}
+
+// The frames of one file, each compressed the first time a transfer needs
+// it and kept for as long as the file's mapping is.
+class PackedImage {
+public:
+    PackedImage(const char* data, int64_t length) {
+        m_data = data;
+        m_length = length;
+        m_numChunks = (length + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+        m_frames = (char**)calloc(m_numChunks, sizeof(char*));
+        m_frameLens = (int*)calloc(m_numChunks, sizeof(int));
+        m_bytes = 0;
+    }
+
+    ~PackedImage() {
+        for (int64_t i = 0; i < m_numChunks; ++i)
+            free(m_frames[i]);
+        free(m_frames);
+        free(m_frameLens);
+    }
+
+    int64_t numChunks() { return m_numChunks; }
+    // frame bytes held
+    int64_t bytes() { return m_bytes; }
+
+    // bytes of the file chunk i covers
+    int rawLength(int64_t i) {
+        int64_t offset = i * COMPRESS_CHUNK;
+        return m_length - offset < COMPRESS_CHUNK ? (int)(m_length - offset) : COMPRESS_CHUNK;
+    }
+
+    // Returns chunk i's frame, compressing it first if no transfer has yet.
+    const char* frame(int64_t i, int* len, CompressStats* stats) {
+        if (m_frames[i]) {
+            stats->reused++;
+            *len = m_frameLens[i];
+            return m_frames[i];
+        }
+        int64_t start = cpu_time_us();
+        int64_t offset = i * COMPRESS_CHUNK;
+        int rawLen = rawLength(i);
+        char* frame = (char*)malloc(COMPRESS_FRAME_HEADER + rawLen);
+        int dataLen = lz4_compress(m_data + offset, rawLen, frame + COMPRESS_FRAME_HEADER, rawLen - 1);
+        if (dataLen == 0) {
+            memcpy(frame + COMPRESS_FRAME_HEADER, m_data + offset, rawLen);
+            dataLen = rawLen;
+        }
+        else {
+            frame = (char*)realloc(frame, COMPRESS_FRAME_HEADER + dataLen);
+        }
+        wire_put64(frame, 0, offset);
+        wire_put32(frame, 8, rawLen);
+        wire_put32(frame, 12, dataLen);
+        m_frames[i] = frame;
+        m_frameLens[i] = COMPRESS_FRAME_HEADER + dataLen;
+        m_bytes += m_frameLens[i];
+
+        stats->chunks++;
+        stats->rawBytes += rawLen;
+        stats->packedBytes += m_frameLens[i];
+        stats->cpuUs += cpu_time_us() - start;
+        *len = m_frameLens[i];
+        return frame;
+    }
+
+private:
+    const char* m_data;
+    int64_t m_length;
+    int64_t m_numChunks;
+    char** m_frames;
+    int* m_frameLens;
+    int64_t m_bytes;
+
+    PackedImage(const PackedImage&);
+    PackedImage& operator=(const PackedImage&);
+};
+
+// One transfer's stream: the frames of every chunk its byte range touches,
+// back to back. Frames are compressed as the sender reaches them, a chunk
+// at a time, so a big file costs nothing up front. Until the last one is
+// done the stream's length is only bounded: a frame is never longer than
+// its header plus the raw chunk.
+class PackedStream {
+public:
+    PackedStream(PackedImage* image, int64_t offset, int64_t length, CompressStats* stats) {
+        m_image = image;
+        m_stats = stats;
+        m_first = offset / COMPRESS_CHUNK;
+        int64_t last = length > 0 ? (offset + length - 1) / COMPRESS_CHUNK + 1 : m_first;
+        m_numFrames = last - m_first;
+        m_frames = (const char**)malloc((m_numFrames + 1) * sizeof(char*));
+        m_starts = (int64_t*)malloc((m_numFrames + 1) * sizeof(int64_t));
+        m_starts[0] = 0;
+        m_packed = 0;
+        m_pending = 0;
+        for (int64_t i = 0; i < m_numFrames; ++i)
+            m_pending += COMPRESS_FRAME_HEADER + image->rawLength(m_first + i);
+        m_last = 0;
+        m_buffer = NULL;
+        m_bufferLen = 0;
+    }
+
+    ~PackedStream() {
+        free(m_frames);
+        free(m_starts);
+        free(m_buffer);
+    }
+
+    // exact once every frame is done, an upper bound before that
+    int64_t length() { return m_starts[m_packed] + m_pending; }
+
+    // Compresses frames until the stream is built through end (or is
+    // whole), so length() is exact whenever the stream ends before end.
+    void prepare(int64_t end) {
+        while (m_packed < m_numFrames && m_starts[m_packed] < end) {
+            int len;
+            m_frames[m_packed] = m_image->frame(m_first + m_packed, &len, m_stats);
+            m_pending -= COMPRESS_FRAME_HEADER + m_image->rawLength(m_first + m_packed);
+            m_starts[m_packed + 1] = m_starts[m_packed] + len;
+            m_packed++;
+        }
+    }
+
+    // Returns len bytes of the stream at offset: straight out of a frame,
+    // or gathered into a buffer if they span frames. The pointer stays
+    // valid until the next read().
+    const char* read(int64_t offset, int len) {
+        if (len <= 0)
+            return "";
+        prepare(offset + len);
+        if (offset < 0 || offset + len > m_starts[m_packed])
+            return NULL;
+        int64_t i = find(offset);
+        if (offset + len <= m_starts[i + 1])
+            return m_frames[i] + (offset - m_starts[i]);
+
+        if (len > m_bufferLen) {
+            m_buffer = (char*)realloc(m_buffer, len);
+            m_bufferLen = len;
+        }
+        int done = 0;
+        while (done < len) {
+            int64_t at = offset + done;
+            int n = m_starts[i + 1] - at < len - done ? (int)(m_starts[i + 1] - at) : len - done;
+            memcpy(m_buffer + done, m_frames[i] + (at - m_starts[i]), n);
+            done += n;
+            i++;
+        }
+        return m_buffer;
+    }
+
+private:
+    PackedImage* m_image;
+    CompressStats* m_stats;
+    int64_t m_first;            // chunk of the first frame
+    int64_t m_numFrames;
+    const char** m_frames;
+    int64_t* m_starts;          // where each frame starts in the stream, and the end
+    int64_t m_packed;           // frames compressed so far
+    int64_t m_pending;          // most the rest can take up
+    int64_t m_last;             // frame of the last read, where the next usually is
+    char* m_buffer;
+    int m_bufferLen;
+
+    // the frame holding offset, which must be in the built part
+    int64_t find(int64_t offset) {
+        if (offset >= m_starts[m_last] && offset < m_starts[m_last + 1])
+            return m_last;
+        int64_t lo = 0;
+        int64_t hi = m_packed - 1;
+        while (lo < hi) {
+            int64_t mid = (lo + hi + 1) / 2;
+            if (m_starts[mid] <= offset)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        m_last = lo;
+        return lo;
+    }
+
+    PackedStream(const PackedStream&);
+    PackedStream& operator=(const PackedStream&);
+};
+
+// The receiver's end: takes the stream in order, puts each frame back
+// together, and writes the chunk it holds into the file. Frames are whole
+// chunks, so the ends of an unaligned range are cut off to leave the bytes
+// around it alone. The last history bytes of the stream are kept so FEC
+// can read back what it needs.
+class FrameDecoder {
+public:
+    FrameDecoder(int history = 0) {
+        m_frame = (char*)malloc(COMPRESS_FRAME_HEADER + COMPRESS_CHUNK);
+        m_raw = (char*)malloc(COMPRESS_CHUNK);
+        m_have = 0;
+        m_need = COMPRESS_FRAME_HEADER;
+        m_history = history;
+        m_ring = history > 0 ? (char*)malloc(history) : NULL;
+        m_streamPos = 0;
+        m_rangeStart = 0;
+        m_rangeEnd = -1;
+        m_rawEnd = -1;
+        m_rawBytes = 0;
+        m_cpuUs = 0;
+    }
+
+    ~FrameDecoder() {
+        free(m_frame);
+        free(m_raw);
+        free(m_ring);
+    }
+
+    // Takes the next len bytes of the stream. Returns false on a malformed
+    // frame or a failed write.
+    bool write(FileSink* sink, const char* data, int len) {
+        remember(data, len);
+        while (len > 0) {
+            int n = m_need - m_have < len ? m_need - m_have : len;
+            memcpy(m_frame + m_have, data, n);
+            m_have += n;
+            data += n;
+            len -= n;
+            if (m_have < m_need)
+                break;
+            if (m_need == COMPRESS_FRAME_HEADER) {
+                uint32_t rawLen = wire_get32(m_frame, 8);
+                uint32_t dataLen = wire_get32(m_frame, 12);
+                if (rawLen == 0 || rawLen > COMPRESS_CHUNK || dataLen == 0 || dataLen > rawLen)
+                    return false;
+                m_need = COMPRESS_FRAME_HEADER + dataLen;
+                continue;
+            }
+            if (!flush(sink))
+                return false;
+        }
+        return true;
+    }
+
+    // Writes only file bytes in [offset, offset + length); a length of 0
+    // runs to the end.
+    void clip(int64_t offset, int64_t length) {
+        m_rangeStart = offset;
+        m_rangeEnd = length > 0 ? offset + length : -1;
+    }
+
+    // the stream stopped partway through a frame
+    bool midFrame() { return m_have > 0; }
+    // where the last complete frame ends in the file, -1 before the first
+    int64_t rawEnd() { return m_rawEnd; }
+    int64_t rawBytes() { return m_rawBytes; }
+    int64_t cpuUs() { return m_cpuUs; }
+
+    // Reads len stream bytes at offset back into buf. Returns buf, or NULL
+    // if they are no longer in the history.
+    const char* read(int64_t offset, char* buf, int len) {
+        if (offset < m_streamPos - m_history || offset < 0 || offset + len > m_streamPos)
+            return NULL;
+        for (int i = 0; i < len; ++i)
+            buf[i] = m_ring[(offset + i) % m_history];
+        return buf;
+    }
+
+private:
+    char* m_frame;
+    char* m_raw;
+    int m_have;
+    int m_need;                 // bytes of the frame, or its header until that's in
+    int m_history;
+    char* m_ring;
+    int64_t m_streamPos;
+    int64_t m_rangeStart;
+    int64_t m_rangeEnd;         // -1 for the end of the file
+    int64_t m_rawEnd;
+    int64_t m_rawBytes;
+    int64_t m_cpuUs;
+
+    void remember(const char* data, int len) {
+        if (m_history > 0) {
+            int skip = len > m_history ? len - m_history : 0;
+            for (int i = skip; i < len; ++i)
+                m_ring[(m_streamPos + i) % m_history] = data[i];
+        }
+        m_streamPos += len;
+    }
+
+    bool flush(FileSink* sink) {
+        int64_t offset = (int64_t)wire_get64(m_frame, 0);
+        int rawLen = wire_get32(m_frame, 8);
+        int dataLen = wire_get32(m_frame, 12);
+        const char* raw = m_frame + COMPRESS_FRAME_HEADER;
+        if (dataLen < rawLen) {
+            int64_t start = cpu_time_us();
+            int n = lz4_decompress(raw, dataLen, m_raw, rawLen);
+            m_cpuUs += cpu_time_us() - start;
+            if (n != rawLen)
+                return false;
+            raw = m_raw;
+        }
+        if (offset < 0)
+            return false;
+        int64_t from = offset > m_rangeStart ? offset : m_rangeStart;
+        int64_t to = offset + rawLen;
+        if (m_rangeEnd >= 0 && to > m_rangeEnd)
+            to = m_rangeEnd;
+        if (to > from) {
+            if (!sink->write(from, raw + (from - offset), (int)(to - from)))
+                return false;
+            m_rawEnd = to;
+            m_rawBytes += to - from;
+        }
+        m_have = 0;
+        m_need = COMPRESS_FRAME_HEADER;
+        return true;
+    }
+
+    FrameDecoder(const FrameDecoder&);
+    FrameDecoder& operator=(const FrameDecoder&);
+};
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef CONGESTION_CONTROL_H
+#define CONGESTION_CONTROL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+// initial window, in segments (RFC 6928)
+#define INITIAL_CWND_SEGMENTS 10
+// keeps the window well clear of int overflow on long transfers
+#define MAX_CWND (1 << 30)
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+// Sender congestion window (all sizes in bytes). The base class implements
+// slow start and NewReno fast recovery; subclasses supply congestion
+// avoidance growth and the window reduction applied on loss.
+//
+// With SACK the sender paces retransmissions by its pipe estimate instead,
+// so recovery then starts at ssthresh and skips the dup-ACK inflation.
+class CongestionControl {
+public:
+    CongestionControl(int mss) {
+        m_mss = mss;
+        reset();
+    }
+
+    virtual ~CongestionControl() {}
+
+    virtual const char* name() = 0;
+
+    virtual void reset() {
+        m_cwnd = INITIAL_CWND_SEGMENTS * m_mss;
+        m_ssthresh = INT_MAX;
+        m_inRecovery = false;
+        m_sackRecovery = false;
+    }
+
+    // new data was cumulatively acknowledged
+    void onAck(int bytesAcked, int64_t now, int64_t srtt) {
+        if (m_inRecovery) {
+            // NewReno partial ACK: deflate by what was acked, keep one segment
+            if (!m_sackRecovery) {
+                m_cwnd -= bytesAcked;
+                if (m_cwnd < m_mss)
+                    m_cwnd = m_mss;
+                m_cwnd += m_mss;
+            }
+            return;
+        }
+        // slow start with appropriate byte counting (RFC 3465, L = 2), so a
+        // delayed ACK covering two segments still grows the window by two
+        if (m_cwnd < m_ssthresh)
+            m_cwnd += bytesAcked < 2 * m_mss ? bytesAcked : 2 * m_mss;
+        else
+            increase(bytesAcked, now, srtt);
+        if (m_cwnd > MAX_CWND)
+            m_cwnd = MAX_CWND;
+    }
+
+    // third duplicate ACK: fast retransmit and enter fast recovery
+    void enterRecovery(int flight, int64_t now, bool sack) {
+        m_ssthresh = reduce(flight, now);
+        m_inRecovery = true;
+        m_sackRecovery = sack;
+        m_cwnd = sack ? m_ssthresh : m_ssthresh + 3 * m_mss;
+    }
+
+    void onDupAck() {
+        if (m_inRecovery && !m_sackRecovery)
+            m_cwnd += m_mss;
+    }
+
+    // everything outstanding at the start of recovery has been acked
+    void exitRecovery() {
+        m_cwnd = m_ssthresh;
+        m_inRecovery = false;
+    }
+
+    void onTimeout(int flight, int64_t now) {
+        m_ssthresh = reduce(flight, now);
+        m_cwnd = m_mss;
+        m_inRecovery = false;
+    }
+
+    // path MTU discovery changed the segment size; the window keeps its bytes
+    void setMss(int mss) {
+        m_mss = mss;
+        if (m_cwnd < mss)
+            m_cwnd = mss;
+    }
+
+    int cwnd() { return m_cwnd; }
+    int ssthresh() { return m_ssthresh; }
+    bool inRecovery() { return m_inRecovery; }
+
+protected:
+    int m_mss;
+    int m_cwnd;
+    int m_ssthresh;
+    bool m_inRecovery;
+    bool m_sackRecovery;
+
+    // returns the new ssthresh after a loss with flight bytes outstanding
+    virtual int reduce(int flight, int64_t now) = 0;
+    // congestion avoidance growth
+    virtual void increase(int bytesAcked, int64_t now, int64_t srtt) = 0;
+};
+
+// Reno: halve on loss, one segment per RTT in congestion avoidance.
+class RenoCongestionControl : public CongestionControl {
+public:
+    RenoCongestionControl(int mss) : CongestionControl(mss) {
+        m_bytesAcked = 0;
+    }
+
+    const char* name() { return "reno"; }
+
+    void reset() {
+        CongestionControl::reset();
+        m_bytesAcked = 0;
+    }
+
+protected:
+    int m_bytesAcked;
+
+    int reduce(int flight, int64_t now) {
+        m_bytesAcked = 0;
+        int ssthresh = flight / 2;
+        return ssthresh > 2 * m_mss ? ssthresh : 2 * m_mss;
+    }
+
+    void increase(int bytesAcked, int64_t now, int64_t srtt) {
+        m_bytesAcked += bytesAcked;
+        if (m_bytesAcked >= m_cwnd) {
+            m_bytesAcked -= m_cwnd;
+            m_cwnd += m_mss;
+        }
+    }
+};
+
+// CUBIC (RFC 8312): window grows as a cubic function of the time since the
+// last loss, centred on the window size at that loss, and never slower than
+// Reno would.
+class CubicCongestionControl : public CongestionControl {
+public:
+    CubicCongestionControl(int mss) : CongestionControl(mss) {
+        resetCubic();
+    }
+
+    const char* name() { return "cubic"; }
+
+    void reset() {
+        CongestionControl::reset();
+        resetCubic();
+    }
+
+protected:
+    double m_wMax;          // segments
+    double m_wLastMax;      // segments
+    double m_k;             // seconds
+    int64_t m_epochStart;   // microseconds, 0 when no epoch is running
+    double m_wEst;          // Reno-friendly estimate, segments
+    double m_credit;        // fractional segments of growth not yet applied
+
+    void resetCubic() {
+        m_wMax = 0;
+        m_wLastMax = 0;
+        m_k = 0;
+        m_epochStart = 0;
+        m_wEst = 0;
+        m_credit = 0;
+    }
+
+    int reduce(int flight, int64_t now) {
+        double cwnd = (double)m_cwnd / m_mss;
+        // fast convergence: release bandwidth sooner when the window is shrinking
+        if (cwnd < m_wLastMax)
+            m_wMax = cwnd * (1 + CUBIC_BETA) / 2;
+        else
+            m_wMax = cwnd;
+        m_wLastMax = cwnd;
+        m_epochStart = 0;
+
+        int ssthresh = (int)(m_cwnd * CUBIC_BETA);
+        return ssthresh > 2 * m_mss ? ssthresh : 2 * m_mss;
+    }
+
+    void increase(int bytesAcked, int64_t now, int64_t srtt) {
+        double cwnd = (double)m_cwnd / m_mss;
+        double rtt = srtt > 0 ? srtt / 1e6 : 0.1;
+
+        if (m_epochStart == 0) {
+            m_epochStart = now;
+            m_credit = 0;
+            if (m_wMax < cwnd) {
+                m_wMax = cwnd;
+                m_k = 0;
+            }
+            else {
+                m_k = cbrt((m_wMax - cwnd) / CUBIC_C);
+            }
+            m_wEst = cwnd;
+        }
+
+        double t = (now - m_epochStart) / 1e6;
+        double target = CUBIC_C * pow(t + rtt - m_k, 3) + m_wMax;
+
+        double acked = (double)bytesAcked / m_mss;
+        m_wEst += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / cwnd;
+        if (m_wEst > target)
+            target = m_wEst;
+
+        // grow by (target - cwnd) / cwnd segments per acked segment
+        if (target > cwnd)
+            m_credit += (target - cwnd) / cwnd * acked;
+        else
+            m_credit += acked / (100 * cwnd);
+        if (m_credit >= 1) {
+            m_cwnd += (int)m_credit * m_mss;
+            m_credit -= (int)m_credit;
+        }
+    }
+};
+
+// Returns a new controller for the algorithm name, or NULL if unknown.
+inline CongestionControl*
+congestion_control_create(const char* name, int mss) {
+    if (strcmp(name, "reno") == 0)
+        return new RenoCongestionControl(mss);
+    if (strcmp(name, "cubic") == 0)
+        return new CubicCongestionControl(mss);
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef CONNECTION_TABLE_H
+#define CONNECTION_TABLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define CONN_TABLE_INITIAL_CAPACITY 64
+
+// Identifies a connection: the peer's address plus a connection id, which
+// stays 0 until the peers negotiate one.
+struct ConnKey {
+    uint32_t ip;        // network byte order
+    uint16_t port;      // host byte order
+    uint32_t connId;
+};
+
+inline bool
+conn_key_equal(const ConnKey& a, const ConnKey& b) {
+    return a.ip == b.ip && a.port == b.port && a.connId == b.connId;
+}
+
+inline uint32_t
+conn_key_hash(const ConnKey& key) {
+    // 64 bit mix (splitmix64 finaliser) folded to 32 bits
+    uint64_t h = ((uint64_t)key.ip << 32) ^ ((uint64_t)key.port << 16) ^ key.connId;
+    h ^= (uint64_t)key.connId << 48;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (uint32_t)h;
+}
+
+// Flat open-addressing hash map from ConnKey to V*. Slots live in one
+// array probed linearly; erase shifts the following entries back instead of
+// leaving tombstones, so lookups never degrade. The table doubles when it
+// gets half full. The table doesn't own the values.
+template <typename V>
+class ConnectionTable {
+public:
+    ConnectionTable() {
+        m_capacity = 0;
+        m_size = 0;
+        m_slots = NULL;
+        rehash(CONN_TABLE_INITIAL_CAPACITY);
+    }
+
+    ~ConnectionTable() {
+        free(m_slots);
+    }
+
+    V* find(const ConnKey& key) {
+        uint32_t mask = m_capacity - 1;
+        for (uint32_t i = conn_key_hash(key) & mask; m_slots[i].value; i = (i + 1) & mask) {
+            if (conn_key_equal(m_slots[i].key, key))
+                return m_slots[i].value;
+        }
+        return NULL;
+    }
+
+    // Adds value under key. Returns false if the key is already present.
+    bool insert(const ConnKey& key, V* value) {
+        if (2 * (m_size + 1) > m_capacity)
+            rehash(2 * m_capacity);
+        uint32_t mask = m_capacity - 1;
+        uint32_t i = conn_key_hash(key) & mask;
+        for (; m_slots[i].value; i = (i + 1) & mask) {
+            if (conn_key_equal(m_slots[i].key, key))
+                return false;
+        }
+        m_slots[i].key = key;
+        m_slots[i].value = value;
+        m_size++;
+        return true;
+    }
+
+    // Removes key. Returns the value it mapped to, or NULL.
+    V* erase(const ConnKey& key) {
+        uint32_t mask = m_capacity - 1;
+        uint32_t i = conn_key_hash(key) & mask;
+        for (; m_slots[i].value; i = (i + 1) & mask) {
+            if (conn_key_equal(m_slots[i].key, key))
+                break;
+        }
+        V* value = m_slots[i].value;
+        if (!value)
+            return NULL;
+
+        // backward shift: pull later entries of the probe run into the gap
+        uint32_t gap = i;
+        for (uint32_t j = (i + 1) & mask; m_slots[j].value; j = (j + 1) & mask) {
+            uint32_t home = conn_key_hash(m_slots[j].key) & mask;
+            // j may move to gap only if its home isn't in (gap, j]
+            if (((j - home) & mask) >= ((j - gap) & mask)) {
+                m_slots[gap] = m_slots[j];
+                gap = j;
+            }
+        }
+        m_slots[gap].value = NULL;
+        m_size--;
+        return value;
+    }
+
+    int size() { return m_size; }
+
+    // Calls fn(value, arg) for every entry. fn must not modify the table.
+    void forEach(void (*fn)(V*, void*), void* arg) {
+        for (uint32_t i = 0; i < m_capacity; ++i) {
+            if (m_slots[i].value)
+                fn(m_slots[i].value, arg);
+        }
+    }
+
+private:
+    struct Slot {
+        ConnKey key;
+        V* value;       // NULL when the slot is empty
+    };
+
+    Slot* m_slots;
+    uint32_t m_capacity;   // always a power of two
+    int m_size;
+
+    void rehash(uint32_t capacity) {
+        Slot* old = m_slots;
+        uint32_t oldCapacity = m_capacity;
+        m_slots = (Slot*)calloc(capacity, sizeof(Slot));
+        m_capacity = capacity;
+        m_size = 0;
+        for (uint32_t i = 0; i < oldCapacity; ++i) {
+            if (old[i].value)
+                insert(old[i].key, old[i].value);
+        }
+        free(old);
+    }
+
+    ConnectionTable(const ConnectionTable&);
+    ConnectionTable& operator=(const ConnectionTable&);
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef DELAYED_ACK_H
+#define DELAYED_ACK_H
+
+#include <stdint.h>
+
+// defaults: ACK every second segment, or 5 ms after the first unacked one
+#define ACK_EVERY_DEFAULT 2
+#define ACK_DELAY_DEFAULT (5 * 1000L)
+
+// Delayed ACK policy (RFC 1122/5681 style). In-order segments are
+// acknowledged cumulatively once every m_every segments, or when the delay
+// timer runs out, whichever comes first. Callers ACK straight away for
+// anything that matters to loss recovery: out-of-order data, a filled hole,
+// or the end of the file. Times are in microseconds.
+class DelayedAck {
+public:
+    DelayedAck(int every = ACK_EVERY_DEFAULT, int64_t delay = ACK_DELAY_DEFAULT) {
+        m_every = every > 0 ? every : 1;
+        m_delay = delay;
+        m_pending = 0;
+        m_deadline = 0;
+        m_segments = 0;
+        m_acks = 0;
+    }
+
+    // An in-order segment arrived at now. Returns true if it should be
+    // acknowledged right away; otherwise the ACK waits for deadline().
+    bool onSegment(int64_t now) {
+        m_segments++;
+        m_pending++;
+        if (m_pending >= m_every || m_delay <= 0)
+            return true;
+        if (m_deadline == 0)
+            m_deadline = now + m_delay;
+        return false;
+    }
+
+    // an ACK went out, covering everything received so far
+    void onAckSent() {
+        m_pending = 0;
+        m_deadline = 0;
+        m_acks++;
+    }
+
+    bool pending() { return m_pending > 0; }
+    // when the held-back ACK is due, or 0 if nothing is held back
+    int64_t deadline() { return m_deadline; }
+    bool expired(int64_t now) { return m_deadline != 0 && now >= m_deadline; }
+
+    long segments() { return m_segments; }
+    long acks() { return m_acks; }
+
+private:
+    int m_every;
+    int64_t m_delay;
+    int m_pending;
+    int64_t m_deadline;
+    long m_segments;
+    long m_acks;
+};
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "RttEstimator.h"
+
+// bits returned by EventLoop::wait()
+#define EVENT_READABLE 1
+#define EVENT_TIMER 2
+#define EVENT_CONTROL 4     // a local control socket, such as the stats socket
+
+#define EVENT_LOOP_MAX_EVENTS 8
+
+// Sleeps in epoll until a watched socket becomes readable or the armed
+// deadline passes. The deadline is a one-shot CLOCK_MONOTONIC timerfd in
+// now_us() time, so it is immune to wall clock jumps.
+class EventLoop {
+public:
+    EventLoop() {
+        m_epfd = -1;
+        m_timerfd = -1;
+        m_deadline = 0;
+    }
+
+    ~EventLoop() {
+        close();
+    }
+
+    bool open() {
+        m_epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (m_epfd < 0)
+            return false;
+        m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (m_timerfd < 0) {
+            close();
+            return false;
+        }
+        return add(m_timerfd, EVENT_TIMER);
+    }
+
+    void close() {
+        if (m_timerfd >= 0)
+            ::close(m_timerfd);
+        if (m_epfd >= 0)
+            ::close(m_epfd);
+        m_timerfd = -1;
+        m_epfd = -1;
+        m_deadline = 0;
+    }
+
+    // watches fd for incoming data, reported as the given EVENT_* bit
+    bool add(int fd, int event = EVENT_READABLE) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = event;
+        return epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+
+    // Switches fd between waiting for data and waiting for room to write,
+    // which is reported as the same EVENT_* bit.
+    bool modify(int fd, int event, bool writable) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = writable ? EPOLLOUT : EPOLLIN;
+        ev.data.u32 = event;
+        return epoll_ctl(m_epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+    }
+
+    void remove(int fd) {
+        epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+
+    // Arms the timer for an absolute now_us() time; 0 disarms it. A deadline
+    // already in the past fires straight away.
+    bool setDeadline(int64_t deadline) {
+        if (deadline == m_deadline)
+            return true;
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        if (deadline > 0) {
+            spec.it_value.tv_sec = deadline / 1000000;
+            spec.it_value.tv_nsec = (deadline % 1000000) * 1000;
+        }
+        if (timerfd_settime(m_timerfd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+            return false;
+        m_deadline = deadline;
+        return true;
+    }
+
+    // Blocks until something happens. Returns a mask of EVENT_* bits, or -1
+    // on error; an interrupted wait returns 0.
+    int wait() {
+        struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+        int n = epoll_wait(m_epfd, events, EVENT_LOOP_MAX_EVENTS, -1);
+        if (n < 0)
+            return errno == EINTR ? 0 : -1;
+
+        int mask = 0;
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.u32 == EVENT_TIMER) {
+                uint64_t expirations;
+                if (read(m_timerfd, &expirations, sizeof(expirations)) > 0) {
+                    // one-shot: the timer is disarmed now
+                    m_deadline = 0;
+                    mask |= EVENT_TIMER;
+                }
+            }
+            else {
+                mask |= events[i].data.u32;
+            }
+        }
+        return mask;
+    }
+
+private:
+    int m_epfd;
+    int m_timerfd;
+    int64_t m_deadline;
+
+    EventLoop(const EventLoop&);
+    EventLoop& operator=(const EventLoop&);
+};
+
+#endif
@@ -0,0 +1,217 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Packet.h"
+#include "FileSink.h"
+#include "ReorderBuffer.h"
+
+// Forward error correction with XOR parity. The sender groups consecutive
+// new data segments of equal length into blocks of up to k and follows
+// each block with a REPAIR packet:
+//
+//   seq    = ISN + offset of the block's first segment
+//   window = number of segments in the block
+//   data   = XOR of their payloads, as long as each of them
+//
+// so the receiver can rebuild any one lost segment of a block without
+// waiting a round trip for the retransmission; two or more losses in a
+// block fall back to SACK and timeouts as before. k is negotiated in the
+// handshake (OPT_FEC), so the overhead is one packet in k + 1.
+#define FEC_MAX_BLOCK 64
+// the server won't send more than one repair per this many segments
+#define FEC_MIN_BLOCK_DEFAULT 4
+// repairs the receiver holds while their blocks are still incomplete
+#define FEC_PENDING_REPAIRS 16
+
+// dst ^= src, a word at a time
+inline void
+fec_xor(char* dst, const char* src, int len) {
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; ++i)
+        dst[i] ^= src[i];
+}
+
+// Builds the parity of the block being sent.
+class FecEncoder {
+public:
+    FecEncoder(int blockSegments) {
+        m_blockSegments = blockSegments;
+        m_start = 0;
+        m_count = 0;
+        m_len = 0;
+    }
+
+    int blockSegments() { return m_blockSegments; }
+
+    // whether a segment may join the open block; if not, send the repair first
+    bool fits(int64_t seqNum, int len) {
+        return m_count == 0 || (len == m_len && seqNum == m_start + (int64_t)m_count * m_len);
+    }
+
+    void add(int64_t seqNum, const char* data, int len) {
+        if (m_count == 0) {
+            m_start = seqNum;
+            m_len = len;
+            memcpy(m_parity, data, len);
+        }
+        else {
+            fec_xor(m_parity, data, len);
+        }
+        m_count++;
+    }
+
+    bool pending() { return m_count > 0; }
+    bool full() { return m_count >= m_blockSegments; }
+
+    int64_t start() { return m_start; }
+    int count() { return m_count; }
+    int len() { return m_len; }
+    const char* parity() { return m_parity; }
+
+    // the repair has gone out; the next segment opens a new block
+    void reset() { m_count = 0; }
+
+private:
+    int m_blockSegments;
+    int64_t m_start;
+    int m_count;
+    int m_len;
+    char m_parity[MAX_DATA_LEN];
+
+    FecEncoder(const FecEncoder&);
+    FecEncoder& operator=(const FecEncoder&);
+};
+
+struct FecRepair {
+    int64_t start;
+    int count;
+    int len;
+    bool used;
+};
+
+// Repairs the receiver has yet to use. A segment of a block counts as
+// received if it's below the cumulative ACK point (and so already written,
+// where it is read back from) or sits whole in the reorder buffer.
+class FecDecoder {
+public:
+    FecDecoder(int numRepairs = FEC_PENDING_REPAIRS) {
+        m_numRepairs = numRepairs;
+        m_repairs = (FecRepair*)calloc(numRepairs, sizeof(FecRepair));
+        m_slab = (char*)malloc((size_t)numRepairs * MAX_DATA_LEN);
+        m_recovered = 0;
+    }
+
+    ~FecDecoder() {
+        free(m_repairs);
+        free(m_slab);
+    }
+
+    // Keeps a repair, replacing the one for the oldest block if all slots
+    // are taken. Returns false for a malformed repair.
+    bool add(int64_t start, int count, const char* parity, int len) {
+        if (count <= 0 || count > FEC_MAX_BLOCK || len <= 0 || len > MAX_DATA_LEN)
+            return false;
+        int slot = -1;
+        for (int i = 0; i < m_numRepairs; ++i) {
+            if (m_repairs[i].used && m_repairs[i].start == start)
+                return true;
+            if (!m_repairs[i].used && slot < 0)
+                slot = i;
+        }
+        if (slot < 0) {
+            slot = 0;
+            for (int i = 1; i < m_numRepairs; ++i) {
+                if (m_repairs[i].start < m_repairs[slot].start)
+                    slot = i;
+            }
+        }
+        FecRepair& repair = m_repairs[slot];
+        repair.start = start;
+        repair.count = count;
+        repair.len = len;
+        repair.used = true;
+        memcpy(m_slab + (size_t)slot * MAX_DATA_LEN, parity, len);
+        return true;
+    }
+
+    // Rebuilds a segment some repair now has everything else for, into
+    // buf (MAX_DATA_LEN bytes). written reads back what went out in order:
+    // a FileSink, or a FrameDecoder when the stream is compressed. Repairs
+    // whose blocks are complete are dropped along the way. Returns false if
+    // there is nothing to rebuild.
+    template <typename Written>
+    bool recover(int64_t expectedSeqNum, ReorderBuffer& reorderBuffer, Written& written,
+                 int64_t* seqNum, char* buf, int* len) {
+        for (int i = 0; i < m_numRepairs; ++i) {
+            FecRepair& repair = m_repairs[i];
+            if (!repair.used)
+                continue;
+            int64_t end = repair.start + (int64_t)repair.count * repair.len;
+            if (end <= expectedSeqNum) {
+                repair.used = false;
+                continue;
+            }
+            int missing = -1;
+            int numMissing = 0;
+            for (int j = 0; j < repair.count && numMissing < 2; ++j) {
+                int64_t offset = repair.start + (int64_t)j * repair.len;
+                if (offset + repair.len > expectedSeqNum && !reorderBuffer.find(offset, repair.len)) {
+                    missing = j;
+                    numMissing++;
+                }
+            }
+            if (numMissing == 0)
+                repair.used = false;
+            if (numMissing != 1)
+                continue;
+
+            // the rest of the block is here, so the parity gives the missing one
+            memcpy(buf, m_slab + (size_t)i * MAX_DATA_LEN, repair.len);
+            bool complete = true;
+            for (int j = 0; j < repair.count && complete; ++j) {
+                if (j == missing)
+                    continue;
+                int64_t offset = repair.start + (int64_t)j * repair.len;
+                const char* data = offset + repair.len <= expectedSeqNum ? written.read(offset, m_scratch, repair.len)
+                                                                        : reorderBuffer.find(offset, repair.len);
+                if (data)
+                    fec_xor(buf, data, repair.len);
+                else
+                    complete = false;
+            }
+            repair.used = false;
+            if (!complete)
+                continue;
+            *seqNum = repair.start + (int64_t)missing * repair.len;
+            *len = repair.len;
+            m_recovered++;
+            return true;
+        }
+        return false;
+    }
+
+    long recovered() { return m_recovered; }
+
+private:
+    FecRepair* m_repairs;
+    char* m_slab;
+    int m_numRepairs;
+    long m_recovered;
+    char m_scratch[MAX_DATA_LEN];
+
+    FecDecoder(const FecDecoder&);
+    FecDecoder& operator=(const FecDecoder&);
+};
+
+#endif
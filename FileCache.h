@@ -0,0 +1,273 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Compress.h"
+
+#define FILE_CACHE_BUCKETS 64
+// mapped bytes a worker keeps around for files nobody is downloading
+#define FILE_CACHE_BUDGET_DEFAULT (256LL * 1024 * 1024)
+
+// One read-only mapping of a file, shared by every transfer serving it.
+// Identified by path and by what stat says about the file, so a replaced
+// or rewritten file gets a fresh mapping.
+struct MappedFile {
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime;          // nanoseconds
+    int64_t length;
+    char* map;
+    int refs;
+    bool cached;            // still in the cache; once not, freed on the last release
+    PackedImage* packed;    // compressed chunks, once a transfer asks for them
+    MappedFile* hashNext;
+    MappedFile* lruPrev;    // towards most recently used
+    MappedFile* lruNext;
+};
+
+struct FileCacheStats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;    // the file changed under a cached mapping
+};
+
+inline uint32_t
+file_cache_hash(const char* path) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (const char* c = path; *c; ++c) {
+        h ^= (unsigned char)*c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Reference-counted mappings of the files being served, kept after their
+// last transfer finishes so popular files are mapped once rather than per
+// request. Idle mappings are evicted least recently used first once their
+// total size, with the compressed chunks kept beside them, goes over the
+// budget; mappings in use are never evicted, and
+// a file larger than the whole budget is mapped but never kept. Each
+// worker process has its own cache; they share the page cache underneath.
+class FileCache {
+public:
+    FileCache(int64_t budget = FILE_CACHE_BUDGET_DEFAULT) {
+        m_budget = budget;
+        m_bytes = 0;
+        m_packedBytes = 0;
+        m_entries = 0;
+        memset(m_buckets, 0, sizeof(m_buckets));
+        m_lruHead = NULL;
+        m_lruTail = NULL;
+        memset(&m_stats, 0, sizeof(m_stats));
+    }
+
+    ~FileCache() {
+        while (m_lruTail)
+            detach(m_lruTail);
+    }
+
+    // Returns a mapping of path with a reference taken, or NULL if the file
+    // can't be opened or mapped (a directory, an empty file, a pipe...).
+    MappedFile* acquire(const char* path) {
+        if (strlen(path) >= PATH_MAX)
+            return NULL;
+        MappedFile* file = find(path);
+        if (file) {
+            struct stat st;
+            if (stat(path, &st) == 0 && matches(file, st)) {
+                m_stats.hits++;
+                file->refs++;
+                touch(file);
+                return file;
+            }
+            m_stats.invalidations++;
+            detach(file);
+        }
+
+        m_stats.misses++;
+        file = map(path);
+        if (!file)
+            return NULL;
+        file->refs = 1;
+        if (m_budget > 0 && file->length <= m_budget) {
+            insert(file);
+            trim();
+        }
+        return file;
+    }
+
+    void release(MappedFile* file) {
+        if (--file->refs > 0)
+            return;
+        if (!file->cached)
+            unmap(file);
+        else
+            trim();
+    }
+
+    // Counts frames a transfer just compressed for file against the budget.
+    // Their mapping stays, being in use, but idle ones may go to make room.
+    void charge(MappedFile* file, int64_t bytes) {
+        if (!file->cached || bytes == 0)
+            return;
+        m_bytes += bytes;
+        m_packedBytes += bytes;
+        trim();
+    }
+
+    const FileCacheStats& stats() { return m_stats; }
+    int entries() { return m_entries; }
+    int64_t bytes() { return m_bytes; }
+
+    void writeJson(FILE* f) {
+        fprintf(f, "{\"hits\": %lu, \"misses\": %lu, \"evictions\": %lu, \"invalidations\": %lu, \"entries\": %d, \"bytes\": %lld, \"packedBytes\": %lld, \"budget\": %lld}",
+            m_stats.hits, m_stats.misses, m_stats.evictions, m_stats.invalidations, m_entries,
+            (long long)m_bytes, (long long)m_packedBytes, (long long)m_budget);
+    }
+
+private:
+    int64_t m_budget;
+    int64_t m_bytes;            // mapped and compressed bytes of cached files
+    int64_t m_packedBytes;      // the compressed part
+    int m_entries;
+    MappedFile* m_buckets[FILE_CACHE_BUCKETS];
+    MappedFile* m_lruHead;
+    MappedFile* m_lruTail;
+    FileCacheStats m_stats;
+
+    static bool matches(MappedFile* file, const struct stat& st) {
+        return file->dev == st.st_dev && file->ino == st.st_ino && file->length == st.st_size &&
+               file->mtime == (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+
+    static MappedFile* map(const char* path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return NULL;
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            close(fd);
+            return NULL;
+        }
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // the mapping outlives the descriptor
+        close(fd);
+        if (map == MAP_FAILED)
+            return NULL;
+
+        MappedFile* file = (MappedFile*)malloc(sizeof(MappedFile));
+        snprintf(file->path, sizeof(file->path), "%s", path);
+        file->dev = st.st_dev;
+        file->ino = st.st_ino;
+        file->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        file->length = st.st_size;
+        file->map = (char*)map;
+        file->refs = 0;
+        file->cached = false;
+        file->packed = NULL;
+        file->hashNext = NULL;
+        file->lruPrev = NULL;
+        file->lruNext = NULL;
+        return file;
+    }
+
+    static void unmap(MappedFile* file) {
+        delete file->packed;
+        munmap(file->map, file->length);
+        free(file);
+    }
+
+    MappedFile* find(const char* path) {
+        for (MappedFile* file = m_buckets[file_cache_hash(path) % FILE_CACHE_BUCKETS]; file; file = file->hashNext) {
+            if (strcmp(file->path, path) == 0)
+                return file;
+        }
+        return NULL;
+    }
+
+    void insert(MappedFile* file) {
+        MappedFile*& bucket = m_buckets[file_cache_hash(file->path) % FILE_CACHE_BUCKETS];
+        file->hashNext = bucket;
+        bucket = file;
+        file->lruPrev = NULL;
+        file->lruNext = m_lruHead;
+        if (m_lruHead)
+            m_lruHead->lruPrev = file;
+        else
+            m_lruTail = file;
+        m_lruHead = file;
+        file->cached = true;
+        m_bytes += file->length;
+        m_entries++;
+    }
+
+    // moves a hit to the front of the LRU list
+    void touch(MappedFile* file) {
+        if (file == m_lruHead)
+            return;
+        file->lruPrev->lruNext = file->lruNext;
+        if (file->lruNext)
+            file->lruNext->lruPrev = file->lruPrev;
+        else
+            m_lruTail = file->lruPrev;
+        file->lruPrev = NULL;
+        file->lruNext = m_lruHead;
+        m_lruHead->lruPrev = file;
+        m_lruHead = file;
+    }
+
+    // Takes a mapping out of the cache, freeing it unless transfers still
+    // hold it.
+    void detach(MappedFile* file) {
+        MappedFile** link = &m_buckets[file_cache_hash(file->path) % FILE_CACHE_BUCKETS];
+        while (*link != file)
+            link = &(*link)->hashNext;
+        *link = file->hashNext;
+        if (file->lruPrev)
+            file->lruPrev->lruNext = file->lruNext;
+        else
+            m_lruHead = file->lruNext;
+        if (file->lruNext)
+            file->lruNext->lruPrev = file->lruPrev;
+        else
+            m_lruTail = file->lruPrev;
+        file->cached = false;
+        int64_t packed = file->packed ? file->packed->bytes() : 0;
+        m_bytes -= file->length + packed;
+        m_packedBytes -= packed;
+        m_entries--;
+        if (file->refs == 0)
+            unmap(file);
+    }
+
+    // evicts idle mappings, and the frames compressed from them, oldest
+    // first, until the cache fits its budget
+    void trim() {
+        MappedFile* file = m_lruTail;
+        while (file && m_bytes > m_budget) {
+            MappedFile* prev = file->lruPrev;
+            if (file->refs == 0) {
+                m_stats.evictions++;
+                detach(file);
+            }
+            file = prev;
+        }
+    }
+
+    FileCache(const FileCache&);
+    FileCache& operator=(const FileCache&);
+};
+
+#endif
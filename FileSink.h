@@ -0,0 +1,97 @@
+#ifndef FILE_SINK_H
+#define FILE_SINK_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Output file written incrementally with pwrite at each segment's offset,
+// so the receiver never holds more than a packet of file data in memory.
+// What has been written can be read back, for FEC to rebuild a segment.
+// Offsets are relative to a base, so a flow carrying part of the file can
+// write its range in place.
+class FileSink {
+public:
+    FileSink() {
+        m_fd = -1;
+        m_base = 0;
+        m_bytesWritten = 0;
+    }
+
+    ~FileSink() {
+        close();
+    }
+
+    // Creates path, truncating it unless other flows share it or only part
+    // of it is being (re)written. Returns false if it can't be opened.
+    bool open(const char* path, bool truncate = true) {
+        close();
+        m_fd = ::open(path, O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+        m_bytesWritten = 0;
+        return m_fd >= 0;
+    }
+
+    // returns false on a write error
+    bool write(int64_t offset, const char* data, int dataLen) {
+        offset += m_base;
+        while (dataLen > 0) {
+            ssize_t n = pwrite(m_fd, data, dataLen, offset);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += n;
+            dataLen -= n;
+            offset += n;
+            m_bytesWritten += n;
+        }
+        return true;
+    }
+
+    // Reads dataLen bytes written earlier into buf. Returns buf, or NULL
+    // if they couldn't all be read.
+    const char* read(int64_t offset, char* buf, int dataLen) {
+        offset += m_base;
+        int done = 0;
+        while (done < dataLen) {
+            ssize_t n = pread(m_fd, buf + done, dataLen - done, offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return NULL;
+            done += n;
+        }
+        return buf;
+    }
+
+    // gets what has been written onto the disk, before a checkpoint says so
+    bool sync() { return fdatasync(m_fd) == 0; }
+
+    // returns false if flushing the file failed
+    bool close() {
+        if (m_fd < 0)
+            return true;
+        int err = ::close(m_fd);
+        m_fd = -1;
+        return err == 0;
+    }
+
+    // where offset 0 of this flow lands in the file
+    void setBase(int64_t base) { m_base = base; }
+    int64_t base() { return m_base; }
+
+    bool isOpen() { return m_fd >= 0; }
+    int64_t bytesWritten() { return m_bytesWritten; }
+
+private:
+    int m_fd;
+    int64_t m_base;
+    int64_t m_bytesWritten;
+
+    FileSink(const FileSink&);
+    FileSink& operator=(const FileSink&);
+};
+
+#endif
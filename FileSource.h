@@ -0,0 +1,252 @@
+#ifndef FILE_SOURCE_H
+#define FILE_SOURCE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "FileCache.h"
+
+// bytes fetched per pread when the file can't be mapped
+#define FILE_READAHEAD (256 * 1024)
+
+// Read-only view of a file being served. The file is mmap'd so segments are
+// encoded straight out of the page cache; files that can't be mapped are
+// streamed with pread through a read-ahead buffer instead. Opening is O(1)
+// in the file size and offsets are 64 bit. The view can be narrowed to a
+// byte range, for flows that carry only part of the file. Opened through a
+// FileCache, the mapping is shared with other transfers of the same file,
+// and so are the compressed chunks of a compressed view.
+class FileSource {
+public:
+    FileSource() {
+        m_fd = -1;
+        m_length = 0;
+        m_mtime = 0;
+        m_dev = 0;
+        m_ino = 0;
+        m_path = NULL;
+        m_base = 0;
+        m_size = 0;
+        m_map = NULL;
+        m_cache = NULL;
+        m_cached = NULL;
+        m_packed = NULL;
+        m_buffer = NULL;
+        m_bufferStart = 0;
+        m_bufferLen = 0;
+        m_open = false;
+    }
+
+    ~FileSource() {
+        close();
+    }
+
+    // Returns false if the file can't be opened. Files the cache can't map
+    // are opened directly.
+    bool open(const char* path, FileCache* cache) {
+        close();
+        MappedFile* file = cache->acquire(path);
+        if (!file)
+            return open(path);
+        m_cache = cache;
+        m_cached = file;
+        m_map = file->map;
+        m_length = file->length;
+        m_mtime = file->mtime;
+        m_dev = file->dev;
+        m_ino = file->ino;
+        m_path = strdup(path);
+        m_base = 0;
+        m_size = m_length;
+        m_open = true;
+        return true;
+    }
+
+    // returns false if the file can't be opened
+    bool open(const char* path) {
+        close();
+        m_fd = ::open(path, O_RDONLY);
+        if (m_fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(m_fd, &st) < 0 || S_ISDIR(st.st_mode)) {
+            close();
+            return false;
+        }
+        m_length = st.st_size;
+        m_mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        m_dev = st.st_dev;
+        m_ino = st.st_ino;
+        m_path = strdup(path);
+        m_base = 0;
+        m_size = m_length;
+
+        if (m_length > 0) {
+            void* map = mmap(NULL, m_length, PROT_READ, MAP_PRIVATE, m_fd, 0);
+            if (map != MAP_FAILED) {
+                m_map = (char*)map;
+                madvise(m_map, m_length, MADV_SEQUENTIAL);
+                // the mapping outlives the descriptor; don't hold one per transfer
+                ::close(m_fd);
+                m_fd = -1;
+            }
+        }
+        if (!m_map) {
+            posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            m_buffer = (char*)malloc(FILE_READAHEAD);
+        }
+        m_open = true;
+        return true;
+    }
+
+    void close() {
+        delete m_packed;
+        if (m_cached)
+            m_cache->release(m_cached);
+        else if (m_map)
+            munmap(m_map, m_length);
+        if (m_fd >= 0)
+            ::close(m_fd);
+        free(m_buffer);
+        free(m_path);
+        m_fd = -1;
+        m_length = 0;
+        m_mtime = 0;
+        m_dev = 0;
+        m_ino = 0;
+        m_path = NULL;
+        m_base = 0;
+        m_size = 0;
+        m_map = NULL;
+        m_cache = NULL;
+        m_cached = NULL;
+        m_packed = NULL;
+        m_buffer = NULL;
+        m_bufferStart = 0;
+        m_bufferLen = 0;
+        m_open = false;
+    }
+
+    // Narrows the view to [offset, offset + length) of the file, clamped to
+    // the file. length() and read() offsets are then relative to offset.
+    void setRange(int64_t offset, int64_t length) {
+        if (offset < 0)
+            offset = 0;
+        if (offset > m_length)
+            offset = m_length;
+        if (length < 0)
+            length = 0;
+        if (length > m_length - offset)
+            length = m_length - offset;
+        m_base = offset;
+        m_size = length;
+    }
+
+    // Switches the view to the stream of compressed frames covering its
+    // range (Compress.h); length() and read() then work in stream bytes.
+    // Nothing is compressed yet: prepare() and read() do that as they go.
+    // Returns false, leaving the view as it was, for a file that isn't
+    // served from a shared mapping.
+    bool compress(CompressStats* stats) {
+        if (!m_cached || m_packed)
+            return false;
+        if (!m_cached->packed)
+            m_cached->packed = new PackedImage(m_map, m_length);
+        m_packed = new PackedStream(m_cached->packed, m_base, m_size, stats);
+        return true;
+    }
+
+    // Compresses the stream far enough that length() is exact if it ends
+    // before end, charging the new frames to the cache. Does nothing for a
+    // view that isn't compressed.
+    void prepare(int64_t end) {
+        if (!m_packed)
+            return;
+        int64_t before = m_cached->packed->bytes();
+        m_packed->prepare(end);
+        m_cache->charge(m_cached, m_cached->packed->bytes() - before);
+    }
+
+    // Whether the file was truncated or rewritten in place since it was
+    // opened. A mapping doesn't survive that: reads past the new end fault,
+    // and the rest may be a mix of old and new. A file replaced by rename
+    // is another file, and the view keeps reading the old one.
+    bool changed() {
+        struct stat st;
+        if (!m_path || stat(m_path, &st) < 0 || st.st_dev != m_dev || st.st_ino != m_ino)
+            return false;
+        return st.st_size != m_length || (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec != m_mtime;
+    }
+
+    bool isOpen() { return m_open; }
+    bool compressed() { return m_packed != NULL; }
+    // compressed, only an upper bound until prepare() reaches the end
+    int64_t length() { return m_packed ? m_packed->length() : m_size; }
+    // of the range, whether or not it is compressed
+    int64_t rawLength() { return m_size; }
+    // where the view starts in the file
+    int64_t base() { return m_base; }
+    int64_t fileLength() { return m_length; }
+    // nanoseconds; with the length, tells a resuming receiver the file is unchanged
+    int64_t mtime() { return m_mtime; }
+
+    // Returns a pointer to len bytes starting at offset, or NULL on a read
+    // error. len must not exceed FILE_READAHEAD. The pointer stays valid
+    // until the next read() or close().
+    const char* read(int64_t offset, int len) {
+        if (len <= 0)
+            return "";
+        if (m_packed) {
+            prepare(offset + len);
+            return m_packed->read(offset, len);
+        }
+        offset += m_base;
+        if (m_map)
+            return m_map + offset;
+
+        if (offset < m_bufferStart || offset + len > m_bufferStart + m_bufferLen) {
+            m_bufferStart = offset;
+            m_bufferLen = 0;
+            while (m_bufferLen < FILE_READAHEAD) {
+                ssize_t n = pread(m_fd, m_buffer + m_bufferLen, FILE_READAHEAD - m_bufferLen, offset + m_bufferLen);
+                if (n < 0)
+                    return NULL;
+                if (n == 0)
+                    break;
+                m_bufferLen += n;
+            }
+            if (len > m_bufferLen)
+                return NULL;
+        }
+        return m_buffer + (offset - m_bufferStart);
+    }
+
+private:
+    int m_fd;
+    int64_t m_length;       // of the whole file
+    int64_t m_mtime;
+    dev_t m_dev;
+    ino_t m_ino;
+    char* m_path;           // to check the file against, see changed()
+    int64_t m_base;
+    int64_t m_size;         // of the view
+    char* m_map;
+    FileCache* m_cache;
+    MappedFile* m_cached;   // set when the mapping belongs to m_cache
+    PackedStream* m_packed; // set once the view is compressed
+    char* m_buffer;
+    int64_t m_bufferStart;
+    int m_bufferLen;
+    bool m_open;
+
+    FileSource(const FileSource&);
+    FileSource& operator=(const FileSource&);
+};
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include "Packet.h"
+
+// Connection setup, layered on the REQUEST exchange:
+//
+//   receiver                                server
+//   REQUEST  "file\0" + options      ->
+//                                    <-     ACCEPT  seq = server ISN, chosen options
+//   ACK      ack = server ISN        ->
+//                                    <-     DATA    seq = server ISN + offset
+//
+// The receiver picks the connection id and its own ISN; every later packet
+// of the transfer carries the connection id, and both ends drop anything
+// that doesn't match. Options are (type, length, value) triples with
+// multi-byte values in network byte order. Unknown options are skipped.
+#define OPT_MSS 1           // u16, largest payload the sender may use
+#define OPT_WSCALE 2        // u8, shift applied to the advertised window
+#define OPT_SACK 3          // empty, ACKs carry SACK blocks
+#define OPT_CHECKSUM 4      // u8 list, checksum types in order of preference
+#define OPT_CONN_ID 5       // u32
+#define OPT_ISN 6           // u64, the receiver's ISN (echoed in ACCEPT)
+#define OPT_FEC 7           // u8, data segments per FEC repair packet (Fec.h)
+#define OPT_STRIPE 8        // u8 index, u8 count: this flow carries stripe index of count
+#define OPT_RANGE 9         // u64 offset, u64 length: the part of the file wanted (length 0: to
+                            // the end), and in ACCEPT the part this flow carries
+#define OPT_FILE_INFO 10    // u64 length, u64 mtime (ns) of the whole file, in ACCEPT
+#define OPT_COMPRESS 11     // u8 COMPRESS_* method for the data stream
+
+#define MAX_WINDOW_SCALE 14
+#define MAX_CHECKSUM_OPTIONS 4
+#define MAX_OPTIONS_LEN 96
+// parallel flows one receiver may split a file into
+#define MAX_STRIPES 64
+// ISNs stay well clear of the sign bit so offsets can't wrap
+#define ISN_MASK ((1ULL << 62) - 1)
+
+struct HandshakeOptions {
+    uint32_t connId;
+    int64_t isn;
+    int mss;                // 0 if absent
+    int wscale;             // -1 if absent
+    bool sack;
+    int numChecksums;
+    int checksums[MAX_CHECKSUM_OPTIONS];
+    int fecBlock;           // 0 if absent: no FEC
+    int stripe;
+    int stripes;            // 0 if absent: the whole file in one flow
+    bool range;
+    int64_t rangeOffset;
+    int64_t rangeLength;
+    int compress;           // COMPRESS_*, COMPRESS_NONE without compression
+    bool fileInfo;
+    int64_t fileLength;
+    int64_t fileMtime;
+};
+
+inline void
+handshake_options_init(HandshakeOptions* opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->wscale = -1;
+}
+
+// Random bits for connection ids and ISNs; falls back to rand() if the
+// kernel can't supply them.
+inline uint64_t
+handshake_random() {
+    uint64_t value;
+    if (getrandom(&value, sizeof(value), GRND_NONBLOCK) == sizeof(value))
+        return value;
+    return ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+}
+
+// nonzero, so it can't collide with peers that don't handshake
+inline uint32_t
+handshake_conn_id() {
+    uint32_t connId;
+    do {
+        connId = (uint32_t)handshake_random();
+    } while (connId == 0);
+    return connId;
+}
+
+inline int64_t
+handshake_isn() {
+    return (int64_t)(handshake_random() & ISN_MASK);
+}
+
+// smallest shift that lets window fit the 16 bit header field
+inline int
+window_scale_for(int64_t window) {
+    int shift = 0;
+    while (shift < MAX_WINDOW_SCALE && (window >> shift) > WIRE_MAX_WINDOW)
+        shift++;
+    return shift;
+}
+
+// Writes the options into buf. Returns the number of bytes written, or -1
+// if buf is too small.
+inline int
+handshake_options_encode(char* buf, int bufLen, const HandshakeOptions* opts) {
+    char tmp[MAX_OPTIONS_LEN];
+    int len = 0;
+    tmp[len++] = OPT_CONN_ID;
+    tmp[len++] = 4;
+    wire_put32(tmp, len, opts->connId);
+    len += 4;
+    tmp[len++] = OPT_ISN;
+    tmp[len++] = 8;
+    wire_put64(tmp, len, opts->isn);
+    len += 8;
+    if (opts->mss > 0) {
+        tmp[len++] = OPT_MSS;
+        tmp[len++] = 2;
+        wire_put16(tmp, len, opts->mss);
+        len += 2;
+    }
+    if (opts->wscale >= 0) {
+        tmp[len++] = OPT_WSCALE;
+        tmp[len++] = 1;
+        tmp[len++] = (char)opts->wscale;
+    }
+    if (opts->sack) {
+        tmp[len++] = OPT_SACK;
+        tmp[len++] = 0;
+    }
+    if (opts->numChecksums > 0) {
+        tmp[len++] = OPT_CHECKSUM;
+        tmp[len++] = opts->numChecksums;
+        for (int i = 0; i < opts->numChecksums; ++i)
+            tmp[len++] = (char)opts->checksums[i];
+    }
+    if (opts->fecBlock > 0) {
+        tmp[len++] = OPT_FEC;
+        tmp[len++] = 1;
+        tmp[len++] = (char)opts->fecBlock;
+    }
+    if (opts->compress > 0) {
+        tmp[len++] = OPT_COMPRESS;
+        tmp[len++] = 1;
+        tmp[len++] = (char)opts->compress;
+    }
+    if (opts->stripes > 0) {
+        tmp[len++] = OPT_STRIPE;
+        tmp[len++] = 2;
+        tmp[len++] = (char)opts->stripe;
+        tmp[len++] = (char)opts->stripes;
+    }
+    if (opts->range) {
+        tmp[len++] = OPT_RANGE;
+        tmp[len++] = 16;
+        wire_put64(tmp, len, opts->rangeOffset);
+        wire_put64(tmp, len + 8, opts->rangeLength);
+        len += 16;
+    }
+    if (opts->fileInfo) {
+        tmp[len++] = OPT_FILE_INFO;
+        tmp[len++] = 16;
+        wire_put64(tmp, len, opts->fileLength);
+        wire_put64(tmp, len + 8, opts->fileMtime);
+        len += 16;
+    }
+    if (len > bufLen)
+        return -1;
+    memcpy(buf, tmp, len);
+    return len;
+}
+
+// Parses options written by handshake_options_encode(). Returns false if
+// they are truncated or lack a connection id or ISN.
+inline bool
+handshake_options_decode(const char* data, int dataLen, HandshakeOptions* opts) {
+    handshake_options_init(opts);
+    bool haveConnId = false;
+    bool haveIsn = false;
+    int off = 0;
+    while (off + 2 <= dataLen) {
+        int type = (unsigned char)data[off];
+        int len = (unsigned char)data[off + 1];
+        const char* value = data + off + 2;
+        if (off + 2 + len > dataLen)
+            return false;
+        switch (type) {
+        case OPT_MSS:
+            if (len == 2)
+                opts->mss = wire_get16(value, 0);
+            break;
+        case OPT_WSCALE:
+            if (len == 1 && (unsigned char)value[0] <= MAX_WINDOW_SCALE)
+                opts->wscale = (unsigned char)value[0];
+            break;
+        case OPT_SACK:
+            opts->sack = true;
+            break;
+        case OPT_CHECKSUM:
+            for (int i = 0; i < len && opts->numChecksums < MAX_CHECKSUM_OPTIONS; ++i)
+                opts->checksums[opts->numChecksums++] = (unsigned char)value[i];
+            break;
+        case OPT_FEC:
+            if (len == 1)
+                opts->fecBlock = (unsigned char)value[0];
+            break;
+        case OPT_COMPRESS:
+            if (len == 1)
+                opts->compress = (unsigned char)value[0];
+            break;
+        case OPT_STRIPE:
+            if (len == 2 && (unsigned char)value[1] <= MAX_STRIPES && (unsigned char)value[0] < (unsigned char)value[1]) {
+                opts->stripe = (unsigned char)value[0];
+                opts->stripes = (unsigned char)value[1];
+            }
+            break;
+        case OPT_RANGE:
+            if (len == 16) {
+                opts->range = true;
+                opts->rangeOffset = (int64_t)wire_get64(value, 0);
+                opts->rangeLength = (int64_t)wire_get64(value, 8);
+            }
+            break;
+        case OPT_FILE_INFO:
+            if (len == 16) {
+                opts->fileInfo = true;
+                opts->fileLength = (int64_t)wire_get64(value, 0);
+                opts->fileMtime = (int64_t)wire_get64(value, 8);
+            }
+            break;
+        case OPT_CONN_ID:
+            if (len == 4) {
+                opts->connId = wire_get32(value, 0);
+                haveConnId = true;
+            }
+            break;
+        case OPT_ISN:
+            if (len == 8) {
+                opts->isn = (int64_t)(wire_get64(value, 0) & ISN_MASK);
+                haveIsn = true;
+            }
+            break;
+        }
+        off += 2 + len;
+    }
+    return haveConnId && haveIsn && opts->connId != 0;
+}
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+
+// Per-packet logging. Off unless -v turns it on: a printf for every
+// segment and ACK costs more than sending them.
+inline bool&
+verbose_logging() {
+    static bool verbose = false;
+    return verbose;
+}
+
+#define LOG(...) do { if (verbose_logging()) printf(__VA_ARGS__); } while (0)
+
+#endif
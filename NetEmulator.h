@@ -0,0 +1,352 @@
+#ifndef NET_EMULATOR_H
+#define NET_EMULATOR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "UdpBatch.h"
+
+// packets the emulated link can hold, in its delay line and rate queue
+#define NETEM_LIMIT_DEFAULT 256
+// how long a reordered packet is held back unless reorder_gap says otherwise
+#define NETEM_REORDER_GAP_DEFAULT 1000
+
+// Impairments applied to datagrams as they come off the socket, before the
+// protocol sees them. Everything is off by default. Probabilities are per
+// packet; times are in microseconds and rates in bytes per second.
+struct NetEmulatorConfig {
+    uint64_t seed;
+    double loss;            // Bernoulli loss
+    // Gilbert-Elliott loss: p = P(good -> bad), r = P(bad -> good), and
+    // the loss probability in each state. Used instead of loss when p > 0.
+    double geP;
+    double geR;
+    double geLossGood;
+    double geLossBad;
+    double corrupt;         // flips one random bit
+    double duplicate;
+    double reorder;         // held back reorderGap so later packets overtake it
+    int64_t reorderGap;
+    int64_t delay;
+    int64_t jitter;         // delay varies uniformly by +-jitter
+    int64_t rate;           // bottleneck bandwidth, 0 for unlimited
+    int limit;              // packets queued before tail drop
+};
+
+inline void
+net_emulator_config_init(NetEmulatorConfig* config) {
+    memset(config, 0, sizeof(*config));
+    config->seed = 1;
+    config->geLossBad = 1;
+    config->reorderGap = NETEM_REORDER_GAP_DEFAULT;
+    config->limit = NETEM_LIMIT_DEFAULT;
+}
+
+// Parses a comma separated list such as "loss=0.1,delay=20,jitter=5,seed=7"
+// on top of what config already holds. Times are given in milliseconds and
+// rate in Mbit/s. Returns false on an unknown key or a bad value.
+inline bool
+net_emulator_config_parse(NetEmulatorConfig* config, const char* spec) {
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (char* tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        char* eq = strchr(tok, '=');
+        if (!eq)
+            return false;
+        *eq = '\0';
+        const char* key = tok;
+        char* end;
+        double value = strtod(eq + 1, &end);
+        if (end == eq + 1 || *end != '\0' || value < 0)
+            return false;
+
+        if (strcmp(key, "seed") == 0)
+            config->seed = strtoull(eq + 1, NULL, 10);
+        else if (strcmp(key, "loss") == 0)
+            config->loss = value;
+        else if (strcmp(key, "ge_p") == 0)
+            config->geP = value;
+        else if (strcmp(key, "ge_r") == 0)
+            config->geR = value;
+        else if (strcmp(key, "ge_good") == 0)
+            config->geLossGood = value;
+        else if (strcmp(key, "ge_bad") == 0)
+            config->geLossBad = value;
+        else if (strcmp(key, "corrupt") == 0)
+            config->corrupt = value;
+        else if (strcmp(key, "dup") == 0)
+            config->duplicate = value;
+        else if (strcmp(key, "reorder") == 0)
+            config->reorder = value;
+        else if (strcmp(key, "reorder_gap") == 0)
+            config->reorderGap = (int64_t)(value * 1000);
+        else if (strcmp(key, "delay") == 0)
+            config->delay = (int64_t)(value * 1000);
+        else if (strcmp(key, "jitter") == 0)
+            config->jitter = (int64_t)(value * 1000);
+        else if (strcmp(key, "rate") == 0)
+            config->rate = (int64_t)(value * 1000000 / 8);
+        else if (strcmp(key, "limit") == 0)
+            config->limit = (int)value;
+        else
+            return false;
+    }
+    return config->limit > 0;
+}
+
+struct NetEmulatorStats {
+    unsigned long received;
+    unsigned long delivered;
+    unsigned long lost;
+    unsigned long queueDrops;
+    unsigned long corrupted;
+    unsigned long duplicated;
+    unsigned long reordered;
+};
+
+// Seedable impairment layer between the socket and the protocol. A batch
+// from RecvBatch goes through pass(), which returns the datagrams due for
+// delivery by now; the rest wait in a queue ordered by delivery time, and
+// deadline() says when the next one is due. With nothing configured pass()
+// hands the batch straight through without copying.
+//
+// Every random decision comes from one generator seeded from the config,
+// so the same packet sequence meets the same fate on every run.
+class NetEmulator {
+public:
+    NetEmulator() {
+        net_emulator_config_init(&m_config);
+        m_enabled = false;
+        m_slab = NULL;
+        m_slots = NULL;
+        m_heap = NULL;
+        m_freeList = NULL;
+        m_ready = NULL;
+        m_numFree = 0;
+        m_heapSize = 0;
+        m_numReady = 0;
+        m_passthrough = NULL;
+        m_order = 0;
+        m_linkFree = 0;
+        m_bad = false;
+        m_rng = 0;
+        memset(&m_stats, 0, sizeof(m_stats));
+    }
+
+    ~NetEmulator() {
+        free(m_slab);
+        free(m_slots);
+        free(m_heap);
+        free(m_freeList);
+        free(m_ready);
+    }
+
+    void configure(const NetEmulatorConfig& config) {
+        m_config = config;
+        m_rng = config.seed;
+        m_enabled = config.loss > 0 || config.geP > 0 || config.corrupt > 0 || config.duplicate > 0 ||
+                    config.reorder > 0 || config.delay > 0 || config.jitter > 0 || config.rate > 0;
+        if (!m_enabled)
+            return;
+
+        int limit = config.limit;
+        m_slab = (char*)realloc(m_slab, (size_t)limit * FRAME_LEN);
+        m_slots = (Slot*)realloc(m_slots, limit * sizeof(Slot));
+        m_heap = (int*)realloc(m_heap, limit * sizeof(int));
+        m_freeList = (int*)realloc(m_freeList, limit * sizeof(int));
+        m_ready = (RecvSegment*)realloc(m_ready, limit * sizeof(RecvSegment));
+        for (int i = 0; i < limit; ++i)
+            m_freeList[i] = limit - 1 - i;
+        m_numFree = limit;
+        m_heapSize = 0;
+        m_numReady = 0;
+    }
+
+    bool enabled() { return m_enabled; }
+
+    // Takes numSegments fresh datagrams from in (numSegments may be 0) and
+    // returns how many are due by now. They stay valid until the next
+    // pass() or the next in.recv(), whichever comes first.
+    int pass(RecvBatch& in, int numSegments, int64_t now) {
+        if (!m_enabled) {
+            m_passthrough = &in;
+            return numSegments;
+        }
+        m_passthrough = NULL;
+
+        // slots handed out last time are free again
+        for (int i = 0; i < m_numReady; ++i)
+            m_freeList[m_numFree++] = (m_ready[i].data - m_slab) / FRAME_LEN;
+        m_numReady = 0;
+
+        for (int i = 0; i < numSegments; ++i) {
+            RecvSegment& seg = in.segment(i);
+            m_stats.received++;
+            if (lose()) {
+                m_stats.lost++;
+                continue;
+            }
+            enqueue(seg, now);
+            if (m_config.duplicate > 0 && uniform() < m_config.duplicate) {
+                m_stats.duplicated++;
+                enqueue(seg, now);
+            }
+        }
+
+        while (m_heapSize > 0 && m_slots[m_heap[0]].deliverAt <= now) {
+            int index = popHeap();
+            Slot& slot = m_slots[index];
+            RecvSegment& seg = m_ready[m_numReady++];
+            seg.data = m_slab + (size_t)index * FRAME_LEN;
+            seg.len = slot.len;
+            seg.from = &slot.from;
+            m_stats.delivered++;
+        }
+        return m_numReady;
+    }
+
+    RecvSegment& segment(int i) {
+        return m_passthrough ? m_passthrough->segment(i) : m_ready[i];
+    }
+
+    // when the next queued datagram is due, or 0 if none is waiting
+    int64_t deadline() {
+        return m_heapSize > 0 ? m_slots[m_heap[0]].deliverAt : 0;
+    }
+
+    NetEmulatorStats& stats() { return m_stats; }
+
+    void printStats(const char* label) {
+        if (!m_enabled)
+            return;
+        printf("%s: received %lu, delivered %lu, lost %lu, queue drops %lu, corrupted %lu, duplicated %lu, reordered %lu (seed %llu)\n",
+            label, m_stats.received, m_stats.delivered, m_stats.lost, m_stats.queueDrops,
+            m_stats.corrupted, m_stats.duplicated, m_stats.reordered, (unsigned long long)m_config.seed);
+    }
+
+private:
+    struct Slot {
+        int64_t deliverAt;
+        uint64_t order;     // breaks ties in arrival order
+        int len;
+        struct sockaddr_in from;
+    };
+
+    NetEmulatorConfig m_config;
+    bool m_enabled;
+    char* m_slab;
+    Slot* m_slots;
+    int* m_heap;            // slot indices, earliest delivery first
+    int m_heapSize;
+    int* m_freeList;
+    int m_numFree;
+    RecvSegment* m_ready;
+    int m_numReady;
+    RecvBatch* m_passthrough;
+    uint64_t m_order;
+    int64_t m_linkFree;     // when the rate-limited link finishes its backlog
+    bool m_bad;             // Gilbert-Elliott state
+    uint64_t m_rng;
+    NetEmulatorStats m_stats;
+
+    // splitmix64
+    uint64_t next64() {
+        uint64_t z = (m_rng += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // uniform in [0, 1)
+    double uniform() {
+        return (next64() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    bool lose() {
+        if (m_config.geP <= 0)
+            return m_config.loss > 0 && uniform() < m_config.loss;
+        // step the two-state chain, then lose with that state's probability
+        if (m_bad ? uniform() < m_config.geR : uniform() < m_config.geP)
+            m_bad = !m_bad;
+        double p = m_bad ? m_config.geLossBad : m_config.geLossGood;
+        return p > 0 && uniform() < p;
+    }
+
+    void enqueue(const RecvSegment& seg, int64_t now) {
+        if (m_numFree == 0 || seg.len > FRAME_LEN) {
+            m_stats.queueDrops++;
+            return;
+        }
+        int index = m_freeList[--m_numFree];
+        Slot& slot = m_slots[index];
+        char* data = m_slab + (size_t)index * FRAME_LEN;
+        memcpy(data, seg.data, seg.len);
+        slot.len = seg.len;
+        slot.from = *seg.from;
+        slot.order = m_order++;
+
+        if (m_config.corrupt > 0 && seg.len > 0 && uniform() < m_config.corrupt) {
+            uint64_t bit = next64() % ((uint64_t)seg.len * 8);
+            data[bit / 8] ^= (char)(1 << (bit % 8));
+            m_stats.corrupted++;
+        }
+
+        // serialization at the bottleneck, then propagation delay
+        int64_t t = now;
+        if (m_config.rate > 0) {
+            if (m_linkFree < now)
+                m_linkFree = now;
+            m_linkFree += (int64_t)seg.len * 1000000 / m_config.rate;
+            t = m_linkFree;
+        }
+        t += m_config.delay;
+        if (m_config.jitter > 0)
+            t += (int64_t)((2 * uniform() - 1) * m_config.jitter);
+        if (m_config.reorder > 0 && uniform() < m_config.reorder) {
+            t += m_config.reorderGap;
+            m_stats.reordered++;
+        }
+        slot.deliverAt = t > now ? t : now;
+        pushHeap(index);
+    }
+
+    bool before(int a, int b) {
+        if (m_slots[a].deliverAt != m_slots[b].deliverAt)
+            return m_slots[a].deliverAt < m_slots[b].deliverAt;
+        return m_slots[a].order < m_slots[b].order;
+    }
+
+    void pushHeap(int index) {
+        int i = m_heapSize++;
+        while (i > 0 && before(index, m_heap[(i - 1) / 2])) {
+            m_heap[i] = m_heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        m_heap[i] = index;
+    }
+
+    int popHeap() {
+        int top = m_heap[0];
+        int last = m_heap[--m_heapSize];
+        int i = 0;
+        while (2 * i + 1 < m_heapSize) {
+            int child = 2 * i + 1;
+            if (child + 1 < m_heapSize && before(m_heap[child + 1], m_heap[child]))
+                child++;
+            if (!before(m_heap[child], last))
+                break;
+            m_heap[i] = m_heap[child];
+            i = child;
+        }
+        m_heap[i] = last;
+        return top;
+    }
+
+    NetEmulator(const NetEmulator&);
+    NetEmulator& operator=(const NetEmulator&);
+};
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// pacing rate as a multiple of cwnd / srtt, as Linux does: ahead of the
+// window in slow start so it can still double each round trip
+#define PACE_GAIN_SLOW_START 2.0
+#define PACE_GAIN_AVOIDANCE 1.2
+// a bucket holds this much sending time, but never less than two segments
+#define PACE_BURST_US 1000
+#define PACE_MIN_BURST_SEGMENTS 2
+// bytes a connection may send per turn while waiting on the global bucket
+#define PACE_QUANTUM_SEGMENTS 2
+
+// Token bucket in bytes. A rate of 0 means unlimited. A full bucket lets
+// any one send through, even one larger than the burst (a path MTU probe),
+// and tokens can go negative when a send is forced through (a
+// retransmission, say); the debt is paid off before anything else passes.
+class TokenBucket {
+public:
+    TokenBucket() {
+        m_rate = 0;
+        m_burst = 0;
+        m_tokens = 0;
+        m_last = 0;
+    }
+
+    // bytesPerSec == 0 lifts the limit; a bucket starts out full
+    void setRate(int64_t bytesPerSec, int64_t burst, int64_t now) {
+        refill(now);
+        if (m_rate == 0)
+            m_tokens = burst;
+        m_rate = bytesPerSec / 1e6;
+        m_burst = burst;
+        if (m_tokens > m_burst)
+            m_tokens = m_burst;
+    }
+
+    bool unlimited() { return m_rate == 0; }
+    int64_t rate() { return (int64_t)(m_rate * 1e6); }
+
+    bool available(int len, int64_t now) {
+        if (m_rate == 0)
+            return true;
+        refill(now);
+        return m_tokens >= needed(len);
+    }
+
+    void consume(int len, int64_t now) {
+        if (m_rate == 0)
+            return;
+        refill(now);
+        m_tokens -= len;
+    }
+
+    // when len bytes will have accumulated
+    int64_t readyAt(int len, int64_t now) {
+        if (m_rate == 0)
+            return now;
+        refill(now);
+        if (m_tokens >= needed(len))
+            return now;
+        return now + (int64_t)((needed(len) - m_tokens) / m_rate) + 1;
+    }
+
+private:
+    double m_rate;          // bytes per microsecond
+    double m_burst;
+    double m_tokens;
+    int64_t m_last;
+
+    double needed(int len) { return len < m_burst ? len : m_burst; }
+
+    void refill(int64_t now) {
+        if (now > m_last) {
+            m_tokens += (now - m_last) * m_rate;
+            if (m_tokens > m_burst)
+                m_tokens = m_burst;
+        }
+        m_last = now;
+    }
+};
+
+// Rate that spreads a window over one smoothed RTT, in bytes per second;
+// 0 (unpaced) until there is an RTT to spread it over.
+inline int64_t
+pacing_rate(int cwnd, int ssthresh, int64_t srtt) {
+    if (srtt <= 0)
+        return 0;
+    double gain = cwnd < ssthresh ? PACE_GAIN_SLOW_START : PACE_GAIN_AVOIDANCE;
+    return (int64_t)(gain * cwnd * 1e6 / srtt);
+}
+
+// bucket depth for a rate: about PACE_BURST_US worth, at least two segments
+inline int64_t
+pacing_burst(int64_t rate, int mss) {
+    int64_t burst = rate * PACE_BURST_US / 1000000;
+    return burst > PACE_MIN_BURST_SEGMENTS * mss ? burst : PACE_MIN_BURST_SEGMENTS * mss;
+}
+
+// Round-robin queue of connections waiting on a shared bucket. V must have
+// V* paceNext and V* pacePrev members, and queued() relies on them being
+// NULL while the value is out of the queue. The queue doesn't own values.
+template <typename V>
+class PaceQueue {
+public:
+    PaceQueue() {
+        m_head = NULL;
+        m_tail = NULL;
+        m_size = 0;
+    }
+
+    bool empty() { return m_head == NULL; }
+    int size() { return m_size; }
+    V* front() { return m_head; }
+
+    bool queued(V* value) { return value->pacePrev || m_head == value; }
+
+    void push(V* value) {
+        if (queued(value))
+            return;
+        value->paceNext = NULL;
+        value->pacePrev = m_tail;
+        if (m_tail)
+            m_tail->paceNext = value;
+        else
+            m_head = value;
+        m_tail = value;
+        m_size++;
+    }
+
+    void remove(V* value) {
+        if (!queued(value))
+            return;
+        if (value->pacePrev)
+            value->pacePrev->paceNext = value->paceNext;
+        else
+            m_head = value->paceNext;
+        if (value->paceNext)
+            value->paceNext->pacePrev = value->pacePrev;
+        else
+            m_tail = value->pacePrev;
+        value->paceNext = NULL;
+        value->pacePrev = NULL;
+        m_size--;
+    }
+
+    V* pop() {
+        V* value = m_head;
+        if (value)
+            remove(value);
+        return value;
+    }
+
+private:
+    V* m_head;
+    V* m_tail;
+    int m_size;
+};
+
+#endif
@@ -2,7 +2,13 @@
 #define RDT_H
 
 #include <string.h>
-#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <utility>
+
+#include "Checksum.h"
 
 #define DELIM ','
 #define DATA_PACKET (-1)
@@ -10,140 +16,595 @@
 #define EOF_ACK (-3)
 #define REQUEST_PACKET (-4)
 #define NOT_FOUND_PACKET (-5)
+#define ACCEPT_PACKET (-6)
+#define REPAIR_PACKET (-7)      // FEC parity over a block of data segments (Fec.h)
+// segment size for peers that don't negotiate one
 #define DATA_LEN 1000
 #define INITIAL_SEQ_NUM 0
-#define WINDOW_SIZE 1453
+// receive window assumed for legacy peers, which don't advertise one
+#define DEFAULT_RWND (64 * DATA_LEN)
 #define TIMEOUT (175)
+// every frame buffer is large enough for any datagram we send or receive,
+// up to a 9000 byte jumbo frame
+#define FRAME_LEN 9216
+
+// wire formats
+#define WIRE_LEGACY 0   // "seq,ack,checksum,data" ASCII header
+#define WIRE_BINARY 1   // packed header below
+
+// Binary header, multi-byte fields in network byte order:
+//
+//   0        1        2        3
+//  +--------+--------+--------+--------+
+//  | magic  |version |  type  | flags  |
+//  +--------+--------+--------+--------+
+//  |  payload length | receive window  |
+//  +-----------------+-----------------+
+//  |           connection id           |
+//  |      sequence number (64 bit)     |
+//  |                                   |
+//  |        ack number (64 bit)        |
+//  |                                   |
+//  |             checksum              |
+//  +-----------------------------------+
+//
+// The low bits of flags name the checksum (CHECKSUM_CRC32C or
+// CHECKSUM_NONE). A CRC32C covers the header (with the checksum field
+// zeroed) followed by the whole payload. The window is only meaningful on
+// ACKs and is scaled by the shift agreed in the handshake.
+//
+// The magic byte can never start a legacy packet (those begin with a digit
+// or '-'), so the receiving side can tell the two formats apart.
+#define WIRE_MAGIC 0xA5
+#define WIRE_VERSION 2
+#define WIRE_HEADER_LEN 32
+
+#define WIRE_OFF_MAGIC 0
+#define WIRE_OFF_VERSION 1
+#define WIRE_OFF_TYPE 2
+#define WIRE_OFF_FLAGS 3
+#define WIRE_OFF_LENGTH 4
+#define WIRE_OFF_WINDOW 6
+#define WIRE_OFF_CONN_ID 8
+#define WIRE_OFF_SEQ 12
+#define WIRE_OFF_ACK 20
+#define WIRE_OFF_CHECKSUM 28
+
+#define WIRE_FLAG_CHECKSUM_MASK 0x03
+#define WIRE_MAX_WINDOW 0xffff
+
+// longest legacy header: two 20 character 64 bit numbers, an 11 character
+// checksum and three delimiters
+#define LEGACY_MAX_HEADER_LEN 54
+#define MAX_HEADER_LEN LEGACY_MAX_HEADER_LEN
+#define MAX_PACKET_LEN (MAX_HEADER_LEN + DATA_LEN)
+
+// IPv4 and UDP headers in front of every datagram
+#define IP_UDP_OVERHEAD 28
+// largest datagram we build, a jumbo frame; segment sizes are negotiated
+// and path MTU discovery trims them from there
+#define MAX_MTU 9000
+#define MAX_DATA_LEN (MAX_MTU - IP_UDP_OVERHEAD - WIRE_HEADER_LEN)
+
+// explicit packet types carried in the binary header
+#define TYPE_ACK 0
+#define TYPE_DATA (-DATA_PACKET)
+#define TYPE_EOF (-EOF_PACKET)
+#define TYPE_EOF_ACK (-EOF_ACK)
+#define TYPE_REQUEST (-REQUEST_PACKET)
+#define TYPE_NOT_FOUND (-NOT_FOUND_PACKET)
+#define TYPE_ACCEPT (-ACCEPT_PACKET)
+#define TYPE_REPAIR (-REPAIR_PACKET)
+
+// A REQUEST is always sent in the legacy format so old servers can read it.
+// Old receivers put -1 in its sequence number; a non-negative value is a set
+// of capability bits instead.
+#define REQUEST_FLAG_BINARY (1 << 0)
+#define REQUEST_FLAG_SACK (1 << 1)     // selective repeat, ACKs carry SACK blocks
+#define REQUEST_FLAG_HANDSHAKE (1 << 2) // options follow the file name; answer with ACCEPT
+
+struct WireHeader {
+    int type;
+    int flags;
+    int length;
+    int window;
+    uint32_t connId;
+    int64_t seqNum;
+    int64_t ackNum;
+    int checksum;
+};
+
+inline void
+wire_put32(char* buf, int offset, uint32_t value) {
+    value = htonl(value);
+    memcpy(buf + offset, &value, sizeof(value));
+}
+
+inline uint32_t
+wire_get32(const char* buf, int offset) {
+    uint32_t value;
+    memcpy(&value, buf + offset, sizeof(value));
+    return ntohl(value);
+}
+
+inline void
+wire_put16(char* buf, int offset, uint16_t value) {
+    value = htons(value);
+    memcpy(buf + offset, &value, sizeof(value));
+}
+
+inline uint16_t
+wire_get16(const char* buf, int offset) {
+    uint16_t value;
+    memcpy(&value, buf + offset, sizeof(value));
+    return ntohs(value);
+}
+
+inline void
+wire_put64(char* buf, int offset, uint64_t value) {
+    wire_put32(buf, offset, (uint32_t)(value >> 32));
+    wire_put32(buf, offset + 4, (uint32_t)value);
+}
+
+inline uint64_t
+wire_get64(const char* buf, int offset) {
+    return ((uint64_t)wire_get32(buf, offset) << 32) | wire_get32(buf, offset + 4);
+}
+
+inline int
+wire_type_from_ack(int64_t ackNum) {
+    return ackNum >= 0 ? TYPE_ACK : (int)-ackNum;
+}
+
+inline int64_t
+wire_ack_from_type(int type, int64_t ackNum) {
+    return type == TYPE_ACK ? ackNum : -type;
+}
+
+// Writes a binary header into buf. Returns the header length, or -1 if buf
+// is too small.
+inline int
+wire_encode_header(char* buf, int bufLen, const WireHeader* hdr) {
+    if (bufLen < WIRE_HEADER_LEN)
+        return -1;
+    buf[WIRE_OFF_MAGIC] = (char)WIRE_MAGIC;
+    buf[WIRE_OFF_VERSION] = WIRE_VERSION;
+    buf[WIRE_OFF_TYPE] = (char)hdr->type;
+    buf[WIRE_OFF_FLAGS] = (char)hdr->flags;
+    wire_put16(buf, WIRE_OFF_LENGTH, hdr->length);
+    wire_put16(buf, WIRE_OFF_WINDOW, hdr->window);
+    wire_put32(buf, WIRE_OFF_CONN_ID, hdr->connId);
+    wire_put64(buf, WIRE_OFF_SEQ, hdr->seqNum);
+    wire_put64(buf, WIRE_OFF_ACK, hdr->type == TYPE_ACK ? hdr->ackNum : 0);
+    wire_put32(buf, WIRE_OFF_CHECKSUM, hdr->checksum);
+    return WIRE_HEADER_LEN;
+}
+
+// Writes a legacy "seq,ack,checksum," header into buf. Returns the header
+// length, or -1 if buf is too small.
+inline int
+wire_encode_legacy_header(char* buf, int bufLen, const WireHeader* hdr) {
+    char tmp[LEGACY_MAX_HEADER_LEN + 1];
+    int n = snprintf(tmp, sizeof(tmp), "%lld%c%lld%c%d%c",
+        (long long)hdr->seqNum, DELIM,
+        (long long)wire_ack_from_type(hdr->type, hdr->ackNum), DELIM,
+        hdr->checksum, DELIM);
+    if (n < 0 || n > bufLen)
+        return -1;
+    memcpy(buf, tmp, n);
+    return n;
+}
+
+inline bool
+wire_is_binary(const char* buf, int len) {
+    return len > 0 && (unsigned char)buf[WIRE_OFF_MAGIC] == WIRE_MAGIC;
+}
+
+// Parses the header at the front of buf in either format. On success fills
+// hdr and returns the header length; returns -1 for a malformed packet.
+inline int
+wire_decode_header(const char* buf, int len, WireHeader* hdr) {
+    if (wire_is_binary(buf, len)) {
+        if (len < WIRE_HEADER_LEN || buf[WIRE_OFF_VERSION] != WIRE_VERSION)
+            return -1;
+        hdr->type = (unsigned char)buf[WIRE_OFF_TYPE];
+        hdr->flags = (unsigned char)buf[WIRE_OFF_FLAGS];
+        hdr->length = wire_get16(buf, WIRE_OFF_LENGTH);
+        hdr->window = wire_get16(buf, WIRE_OFF_WINDOW);
+        hdr->connId = wire_get32(buf, WIRE_OFF_CONN_ID);
+        hdr->seqNum = (int64_t)wire_get64(buf, WIRE_OFF_SEQ);
+        hdr->ackNum = wire_ack_from_type(hdr->type, (int64_t)wire_get64(buf, WIRE_OFF_ACK));
+        hdr->checksum = wire_get32(buf, WIRE_OFF_CHECKSUM);
+        if (hdr->type > TYPE_REPAIR || hdr->length > len - WIRE_HEADER_LEN || (hdr->type == TYPE_ACK && hdr->ackNum < 0))
+            return -1;
+        return WIRE_HEADER_LEN;
+    }
+
+    int64_t fields[3];
+    const char* p = buf;
+    const char* end = buf + len;
+    for (int i = 0; i < 3; ++i) {
+        const char* delim = (const char*)memchr(p, DELIM, end - p);
+        if (!delim || delim == p)
+            return -1;
+        uint64_t value = 0;
+        bool negative = (*p == '-');
+        if (delim - p > 20)
+            return -1;
+        for (const char* c = negative ? p + 1 : p; c < delim; ++c) {
+            if (*c < '0' || *c > '9')
+                return -1;
+            value = value * 10 + (*c - '0');
+        }
+        fields[i] = negative ? -(int64_t)value : (int64_t)value;
+        p = delim + 1;
+    }
+    hdr->seqNum = fields[0];
+    hdr->ackNum = fields[1];
+    hdr->checksum = (int)fields[2];
+    hdr->type = wire_type_from_ack(hdr->ackNum);
+    hdr->flags = 0;
+    hdr->window = 0;
+    hdr->connId = 0;
+    hdr->length = end - p;
+    return p - buf;
+}
+
+// Checksum used by the legacy text format: covers the sequence number, ack
+// number and every sizeof(int)'th payload byte. Kept bit-for-bit compatible
+// with old peers, which only know 32 bit offsets; binary packets use
+// packet_checksum() instead.
+inline int
+packet_hash(int seqNum, int ackNum, const char* data, int dataLen)
+{
+    int size = dataLen + dataLen % (sizeof (int));
+
+    int hashValue = seqNum ^ (ackNum<<1);
+
+    // bytes past the end of the payload count as zero padding
+    for (int i = 0; i < size; i += sizeof(int)) {
+        int byte = i < dataLen ? (int)data[i] : 0;
+        hashValue = (hashValue >> 1) ^ (byte << 1);
+    }
+    return hashValue;
+}
+
+// Checksum of a packet in the given wire format. For binary packets this is
+// the CRC32C of the encoded header with a zero checksum field, continued
+// over the payload in place, or 0 for CHECKSUM_NONE.
+inline int
+packet_checksum(int wireFormat, int flags, int window, uint32_t connId, int64_t seqNum, int64_t ackNum, const char* data, int dataLen)
+{
+    if (wireFormat != WIRE_BINARY)
+        return packet_hash((int)seqNum, (int)ackNum, data, dataLen);
+
+    switch (flags & WIRE_FLAG_CHECKSUM_MASK) {
+    case CHECKSUM_NONE:
+        return 0;
+    case CHECKSUM_CRC32C:
+        break;
+    default:
+        // never matches, so the packet reads as corrupt
+        return -1;
+    }
+
+    WireHeader hdr;
+    hdr.type = wire_type_from_ack(ackNum);
+    hdr.flags = flags;
+    hdr.length = dataLen;
+    hdr.window = window;
+    hdr.connId = connId;
+    hdr.seqNum = seqNum;
+    hdr.ackNum = ackNum;
+    hdr.checksum = 0;
+    char header[WIRE_HEADER_LEN];
+    wire_encode_header(header, sizeof(header), &hdr);
+    return crc32c(crc32c(0, header, sizeof(header)), data, dataLen);
+}
+
+// Non-owning view of a packet that reads the header and payload straight
+// out of a receive buffer. The buffer must outlive the view.
+class PacketView {
+public:
+    PacketView() {
+        m_seqNum = 0;
+        m_ackNum = 0;
+        m_checksum = 0;
+        m_data = NULL;
+        m_dataLen = 0;
+        m_wireFormat = WIRE_LEGACY;
+        m_flags = 0;
+        m_window = 0;
+        m_connId = 0;
+        m_valid = false;
+    }
+
+    // returns false for a malformed packet, which then also reports corrupt
+    bool parse(const char* packetData, int len) {
+        WireHeader hdr;
+        int headerLen = wire_decode_header(packetData, len, &hdr);
+        m_wireFormat = wire_is_binary(packetData, len) ? WIRE_BINARY : WIRE_LEGACY;
+        m_valid = (headerLen >= 0);
+        if (!m_valid) {
+            m_seqNum = 0;
+            m_ackNum = 0;
+            m_checksum = 0;
+            m_dataLen = 0;
+            m_data = NULL;
+            m_flags = 0;
+            m_window = 0;
+            m_connId = 0;
+            return false;
+        }
+
+        m_flags = hdr.flags;
+        m_window = hdr.window;
+        m_connId = hdr.connId;
+        m_seqNum = hdr.seqNum;
+        m_ackNum = hdr.ackNum;
+        m_checksum = hdr.checksum;
+        m_dataLen = hdr.length;
+        m_data = packetData + headerLen;
+        return true;
+    }
+
+    bool isEOF() const { return m_ackNum == EOF_PACKET; }
+    bool isACK() const { return m_ackNum >= 0; }
+    bool isRequest() const { return m_ackNum == REQUEST_PACKET; }
+    bool isNotFound() const { return m_ackNum == NOT_FOUND_PACKET; }
+    bool isAccept() const { return m_ackNum == ACCEPT_PACKET; }
+    bool isRepair() const { return m_ackNum == REPAIR_PACKET; }
+    bool isData() const { return (m_ackNum == DATA_PACKET) || (m_ackNum == EOF_PACKET); }
+    bool isEOF_ACK() const { return m_ackNum == EOF_ACK; }
+    bool isCorrupt() const {
+        return !m_valid || packet_checksum(m_wireFormat, m_flags, m_window, m_connId, m_seqNum, m_ackNum, m_data, m_dataLen) != m_checksum;
+    }
 
-#define PROBABILITY_PACKET_LOST (0.15)
-#define PROBABILITY_PACKET_CORRUPT (0.15)
+    void setSeqNum(int64_t seqNum) { m_seqNum = seqNum; }
+    void setAckNum(int64_t ackNum) { m_ackNum = ackNum; }
 
+    int64_t getSeqNum() const { return m_seqNum; }
+    int64_t getAckNum() const { return m_ackNum; }
+    const char* getData() const { return m_data; }
+    int getDataLen() const { return m_dataLen; }
+    int getWireFormat() const { return m_wireFormat; }
+    int getChecksum() const { return m_checksum; }
+    int getFlags() const { return m_flags; }
+    // CHECKSUM_LEGACY for the text format
+    int getChecksumType() const { return m_wireFormat == WIRE_BINARY ? (m_flags & WIRE_FLAG_CHECKSUM_MASK) : CHECKSUM_LEGACY; }
+    // the window field of an ACK, still to be scaled by the agreed shift
+    int getWindow() const { return m_window; }
+    // 0 outside a handshaked connection
+    uint32_t getConnId() const { return m_connId; }
+
+private:
+    int64_t m_seqNum;
+    int64_t m_ackNum;
+    int m_checksum;
+    const char* m_data;
+    int m_dataLen;
+    int m_wireFormat;
+    int m_flags;
+    int m_window;
+    uint32_t m_connId;
+    bool m_valid;
+};
+
+// Encodes a packet straight into buf without building a Packet, so callers
+// can serialize payload that lives elsewhere (e.g. file contents) with a
+// single copy. Returns the number of bytes written, or -1 if buf is too small.
+inline int
+packet_encode(char* buf, int bufLen, int wireFormat, int64_t seqNum, int64_t ackNum, const char* data, int dataLen,
+              int window = 0, uint32_t connId = 0, int checksumType = CHECKSUM_CRC32C) {
+    WireHeader hdr;
+    hdr.type = wire_type_from_ack(ackNum);
+    hdr.flags = checksumType & WIRE_FLAG_CHECKSUM_MASK;
+    hdr.window = window;
+    hdr.connId = connId;
+    hdr.length = dataLen;
+    hdr.seqNum = seqNum;
+    hdr.ackNum = ackNum;
+
+    if (wireFormat == WIRE_BINARY) {
+        // checksum the finished frame in place, then patch the field in
+        hdr.checksum = 0;
+        if (wire_encode_header(buf, bufLen, &hdr) < 0 || WIRE_HEADER_LEN + dataLen > bufLen)
+            return -1;
+        memcpy(buf + WIRE_HEADER_LEN, data, dataLen);
+        if (checksumType == CHECKSUM_CRC32C)
+            wire_put32(buf, WIRE_OFF_CHECKSUM, crc32c(0, buf, WIRE_HEADER_LEN + dataLen));
+        return WIRE_HEADER_LEN + dataLen;
+    }
+
+    hdr.checksum = packet_hash((int)seqNum, (int)ackNum, data, dataLen);
+    int headerLen = wire_encode_legacy_header(buf, bufLen, &hdr);
+    if (headerLen < 0 || headerLen + dataLen > bufLen)
+        return -1;
+
+    memcpy(buf + headerLen, data, dataLen);
+    return headerLen + dataLen;
+}
+
+// Heap allocation counters for packet payloads, so the steady state of the
+// send and receive paths can be checked for zero allocations.
+struct AllocStats {
+    unsigned long mallocs;
+    unsigned long frees;
+    unsigned long bytes;
+};
+
+inline AllocStats&
+alloc_stats() {
+    static AllocStats stats;
+    return stats;
+}
+
+inline void*
+counted_malloc(size_t len) {
+    AllocStats& stats = alloc_stats();
+    stats.mallocs++;
+    stats.bytes += len;
+    return malloc(len);
+}
+
+inline void
+counted_free(void* p) {
+    if (p)
+        alloc_stats().frees++;
+    free(p);
+}
+
+inline void
+print_alloc_stats(const char* label) {
+    AllocStats& stats = alloc_stats();
+    printf("%s: %lu mallocs (%lu bytes), %lu frees\n", label, stats.mallocs, stats.bytes, stats.frees);
+}
+
+// Owning packet. Payload copies are counted in alloc_stats(); packets
+// without payload (ACKs, control packets) never allocate, and moving a
+// Packet transfers its payload instead of copying it. Binary packets built
+// here are always CRC32C protected.
 class Packet {
 public:
     ~Packet() {
-        free(m_data);
+        counted_free(m_data);
     }
 
-    Packet(int seqNum, int ackNum, char* data, int dataLen) {
+    Packet(int64_t seqNum, int64_t ackNum, const char* data, int dataLen, uint32_t connId = 0) {
         m_seqNum = seqNum;
         m_ackNum = ackNum;
-        m_dataLen = dataLen;
-        m_data = (char*)malloc(dataLen);
-        for (int i = 0; i < dataLen; ++i) {
-            m_data[i] = data[i];
-        }
+        m_wireFormat = WIRE_LEGACY;
+        m_flags = CHECKSUM_CRC32C;
+        m_window = 0;
+        m_connId = connId;
+        m_valid = true;
+        copyData(data, dataLen);
         m_checksum = hash();
     }
 
     Packet(const Packet &pkt) {
         m_seqNum = pkt.m_seqNum;
         m_ackNum = pkt.m_ackNum;
-        m_dataLen = pkt.m_dataLen;
-        m_data = (char*)malloc(pkt.m_dataLen);
-        for (int i = 0; i < pkt.m_dataLen; ++i) {
-            m_data[i] = pkt.m_data[i];
-        }
+        m_wireFormat = pkt.m_wireFormat;
+        m_flags = pkt.m_flags;
+        m_window = pkt.m_window;
+        m_connId = pkt.m_connId;
+        m_valid = pkt.m_valid;
+        copyData(pkt.m_data, pkt.m_dataLen);
         m_checksum = hash();
     }
 
-    Packet(char* packetData, int len) {
-        char* c1 = strchr(packetData, DELIM);
-        char* c2 = strchr(c1+1, DELIM);
-        char* c3 = strchr(c2+1, DELIM);
-
-        std::string seqNumStr(packetData, c1 - packetData);
-        std::string ackNumStr(c1 + 1, (c2 - c1) - 1);
-        std::string checksumStr(c2 + 1, (c3 - c2) - 1);
-
-        int seqNum = atoi(seqNumStr.c_str());
-        int ackNum = atoi(ackNumStr.c_str());
-        int checksum = atoi(checksumStr.c_str());
-
-        m_seqNum = seqNum;
-        m_ackNum = ackNum; 
-        m_checksum = checksum;
-        m_dataLen = len - (seqNumStr.length() + ackNumStr.length() + checksumStr.length() + 3);     
-        m_data = (char*)malloc(m_dataLen);
-
-        for (char* i = c3 + 1; i < packetData + len; ++i) {
-            m_data[i - (c3 + 1)] = (*i);
-        }
+    Packet(Packet&& pkt) {
+        m_seqNum = pkt.m_seqNum;
+        m_ackNum = pkt.m_ackNum;
+        m_checksum = pkt.m_checksum;
+        m_wireFormat = pkt.m_wireFormat;
+        m_flags = pkt.m_flags;
+        m_window = pkt.m_window;
+        m_connId = pkt.m_connId;
+        m_valid = pkt.m_valid;
+        m_data = pkt.m_data;
+        m_dataLen = pkt.m_dataLen;
+        pkt.m_data = NULL;
+        pkt.m_dataLen = 0;
     }
 
-    // remember to free string after calling
-    char* serialize(int* len) {
-        std::string headerInfo;
-        headerInfo += to_string(m_seqNum);
-        headerInfo += ',';
-        headerInfo += to_string(m_ackNum);
-        headerInfo += ',';
-        headerInfo += to_string(m_checksum);
-        headerInfo += ',';
+    // takes an owning copy of a packet parsed in place
+    explicit Packet(const PacketView& view) {
+        m_seqNum = view.getSeqNum();
+        m_ackNum = view.getAckNum();
+        m_wireFormat = view.getWireFormat();
+        m_flags = view.getFlags();
+        m_window = view.getWindow();
+        m_connId = view.getConnId();
+        m_valid = !view.isCorrupt();
+        copyData(view.getData(), view.getDataLen());
+        m_checksum = hash();
+    }
 
-        *len = headerInfo.length() + m_dataLen;
-        char* str = (char*)malloc(*len);
+    // parses a packet received off the wire, in either format
+    Packet(const char* packetData, int len) {
+        PacketView view;
+        m_valid = view.parse(packetData, len);
+        m_seqNum = view.getSeqNum();
+        m_ackNum = view.getAckNum();
+        m_wireFormat = view.getWireFormat();
+        m_flags = view.getFlags();
+        m_window = view.getWindow();
+        m_connId = view.getConnId();
+        copyData(view.getData(), view.getDataLen());
+        // keep the checksum from the wire so isCorrupt() can check it
+        m_checksum = m_valid ? view.getChecksum() : 0;
+    }
 
-        for (int i = 0; i < headerInfo.length(); ++i) {
-            str[i] = headerInfo[i];
-        }
-        for (int i = 0; i < m_dataLen; ++i) {
-            str[i + headerInfo.length()] = m_data[i];
-        }
+    Packet& operator=(Packet pkt) {
+        std::swap(m_seqNum, pkt.m_seqNum);
+        std::swap(m_ackNum, pkt.m_ackNum);
+        std::swap(m_checksum, pkt.m_checksum);
+        std::swap(m_wireFormat, pkt.m_wireFormat);
+        std::swap(m_flags, pkt.m_flags);
+        std::swap(m_window, pkt.m_window);
+        std::swap(m_connId, pkt.m_connId);
+        std::swap(m_valid, pkt.m_valid);
+        std::swap(m_data, pkt.m_data);
+        std::swap(m_dataLen, pkt.m_dataLen);
+        return *this;
+    }
 
-        return str;
+    // Encodes the packet into buf in the given wire format. Returns the
+    // number of bytes written, or -1 if buf is too small.
+    int serialize(char* buf, int bufLen, int wireFormat) const {
+        return packet_encode(buf, bufLen, wireFormat, m_seqNum, m_ackNum, m_data, m_dataLen, m_window, m_connId, CHECKSUM_CRC32C);
     }
 
-    bool isEOF() { return m_ackNum == EOF_PACKET; }
-    bool isACK() { return m_ackNum >= 0; }
-    bool isRequest() { return m_ackNum == REQUEST_PACKET; }
-    bool isNotFound() { return m_ackNum == NOT_FOUND_PACKET; }
-    bool isData() { return (m_ackNum == DATA_PACKET) || (m_ackNum == EOF_PACKET); }
-    bool isEOF_ACK() { return m_ackNum == EOF_ACK; }
-    bool isCorrupt() { return hash() != m_checksum; }
+    bool isEOF() const { return m_ackNum == EOF_PACKET; }
+    bool isACK() const { return m_ackNum >= 0; }
+    bool isRequest() const { return m_ackNum == REQUEST_PACKET; }
+    bool isNotFound() const { return m_ackNum == NOT_FOUND_PACKET; }
+    bool isAccept() const { return m_ackNum == ACCEPT_PACKET; }
+    bool isRepair() const { return m_ackNum == REPAIR_PACKET; }
+    bool isData() const { return (m_ackNum == DATA_PACKET) || (m_ackNum == EOF_PACKET); }
+    bool isEOF_ACK() const { return m_ackNum == EOF_ACK; }
+    bool isCorrupt() const { return !m_valid || hash() != m_checksum; }
 
-    void setSeqNum(int seqNum) { m_seqNum = seqNum; }
-    void setAckNum(int ackNum) { m_ackNum = ackNum; }
+    void setSeqNum(int64_t seqNum) { m_seqNum = seqNum; }
+    void setAckNum(int64_t ackNum) { m_ackNum = ackNum; }
+    void setConnId(uint32_t connId) { m_connId = connId; }
 
-    int getSeqNum() { return m_seqNum; }
-    int getAckNum() { return m_ackNum; }
+    int64_t getSeqNum() const { return m_seqNum; }
+    int64_t getAckNum() const { return m_ackNum; }
     char* getData() { return m_data; }
-    int getDataLen() { return m_dataLen; }
+    const char* getData() const { return m_data; }
+    int getDataLen() const { return m_dataLen; }
+    int getWireFormat() const { return m_wireFormat; }
+    int getWindow() const { return m_window; }
+    uint32_t getConnId() const { return m_connId; }
 
 private:
-    int m_seqNum;
-    int m_ackNum;
+    int64_t m_seqNum;
+    int64_t m_ackNum;
     int m_checksum;
     char* m_data;
     int m_dataLen;
+    int m_wireFormat;
+    int m_flags;
+    int m_window;
+    uint32_t m_connId;
+    bool m_valid;
 
-    // because ubuntu 12.04 doesn't work with to_string
-    template <typename T>
-    std::string to_string(T value)
-    {
-        std::ostringstream os ;
-        os << value ;
-        return os.str() ;
+    void copyData(const char* data, int dataLen) {
+        m_dataLen = dataLen;
+        m_data = NULL;
+        if (dataLen > 0) {
+            m_data = (char*)counted_malloc(dataLen);
+            memcpy(m_data, data, dataLen);
+        }
     }
 
-    std::size_t hash() 
+    int hash() const
     {
-        int size = m_dataLen + m_dataLen % (sizeof (int));
-        char* paddedData = (char*)malloc(size);
-        for (int i = 0; i < m_dataLen; ++i) {
-            paddedData[i] = m_data[i];
-        }
-        for (int i = 0; i < m_dataLen % (sizeof (int)); ++i) {
-            paddedData[i + m_dataLen] = 0;
-        }
-
-        int hashValue = m_seqNum ^ (m_ackNum<<1);
-
-        for (int i = 0; i < size; i += sizeof(int)) {
-            hashValue = (hashValue >> 1) ^ ((((int)paddedData[i])) << 1);
-        }
-        free(paddedData);
-        return hashValue;
+        return packet_checksum(m_wireFormat, m_flags, m_window, m_connId, m_seqNum, m_ackNum, m_data, m_dataLen);
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,200 @@
+#ifndef PATH_MTU_H
+#define PATH_MTU_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <linux/errqueue.h>
+
+#include "Packet.h"
+
+// segment size to fall back to, a 1200 byte datagram as in RFC 8899; paths
+// that can't carry that aren't worth optimizing for
+#define PMTU_BASE_MSS (1200 - IP_UDP_OVERHEAD - WIRE_HEADER_LEN)
+// stop searching once the window between known good and known bad is this small
+#define PMTU_SEARCH_STEP 64
+// a probe size is given up on after this many losses
+#define PMTU_MAX_PROBES 3
+// back-to-back timeouts before large segments are suspected of vanishing
+#define PMTU_BLACKHOLE_TIMEOUTS 3
+
+// largest segment that fits a datagram of mtu bytes
+inline int
+mss_for_mtu(int mtu) {
+    int mss = mtu - IP_UDP_OVERHEAD - WIRE_HEADER_LEN;
+    return mss < MAX_DATA_LEN ? mss : MAX_DATA_LEN;
+}
+
+// MTU of the route to dest as the kernel knows it: the interface MTU, or
+// less if an ICMP report already lowered it. Returns 0 if it can't tell.
+inline int
+route_mtu(const struct sockaddr_in& dest) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+        return 0;
+    int mtu = 0;
+    socklen_t len = sizeof(mtu);
+    if (connect(sockfd, (const struct sockaddr*)&dest, sizeof(dest)) < 0 ||
+        getsockopt(sockfd, IPPROTO_IP, IP_MTU, &mtu, &len) < 0)
+        mtu = 0;
+    close(sockfd);
+    return mtu;
+}
+
+// Sends everything with DF set, without letting the kernel's cached path
+// MTU shrink our datagrams behind our back, and queues ICMP reports on the
+// socket's error queue for path_error_recv().
+inline bool
+path_mtu_enable(int sockfd) {
+    int mode = IP_PMTUDISC_PROBE;
+    int on = 1;
+    return setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode)) == 0 &&
+           setsockopt(sockfd, IPPROTO_IP, IP_RECVERR, &on, sizeof(on)) == 0;
+}
+
+// Takes one report off the socket's error queue. Returns false once it is
+// empty. dest is where the failed datagram was headed; mtu is the next-hop
+// MTU for a "fragmentation needed" report and 0 for any other error.
+inline bool
+path_error_recv(int sockfd, struct sockaddr_in* dest, int* mtu) {
+    char data[64];
+    char control[256];
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = dest;
+    msg.msg_namelen = sizeof(*dest);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        return false;
+
+    *mtu = 0;
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != IPPROTO_IP || cm->cmsg_type != IP_RECVERR)
+            continue;
+        struct sock_extended_err err;
+        memcpy(&err, CMSG_DATA(cm), sizeof(err));
+        if (err.ee_origin == SO_EE_ORIGIN_ICMP && err.ee_type == ICMP_DEST_UNREACH && err.ee_code == ICMP_FRAG_NEEDED)
+            *mtu = err.ee_info;
+        else if (err.ee_origin == SO_EE_ORIGIN_LOCAL && err.ee_errno == EMSGSIZE)
+            *mtu = err.ee_info;
+    }
+    return true;
+}
+
+// Packetization layer path MTU discovery for one transfer, in the spirit of
+// RFC 4821 / 8899, in payload bytes. The segment size starts at the largest
+// both ends agreed to. An ICMP "fragmentation needed" report, or repeated
+// timeouts that look like a black hole for large datagrams, lower it; after
+// that, segments of a larger size are sent as probes and a binary search
+// settles on the largest one that gets through.
+class PathMtu {
+public:
+    PathMtu(int mss = DATA_LEN) {
+        reset(mss);
+    }
+
+    // starts over with mss as both the segment size and the ceiling
+    void reset(int mss) {
+        m_mss = mss;
+        m_ceiling = mss;
+        m_probeSize = 0;
+        m_probeSeq = 0;
+        m_probeFailures = 0;
+        m_timeouts = 0;
+    }
+
+    // Size of the probe to send next, or 0 if none is due. Probes carry
+    // real data and must be sent at exactly this size.
+    int nextProbe() {
+        if (m_probeSize > 0 || m_ceiling - m_mss < PMTU_SEARCH_STEP)
+            return 0;
+        return (m_mss + m_ceiling + 1) / 2;
+    }
+
+    void onProbeSent(int64_t seqNum, int size) {
+        m_probeSeq = seqNum;
+        m_probeSize = size;
+    }
+
+    bool probing() { return m_probeSize > 0; }
+    int64_t probeSeq() { return m_probeSeq; }
+    int64_t probeEnd() { return m_probeSeq + m_probeSize; }
+
+    // The probe was acknowledged, so the path carries that size. Returns
+    // true if the segment size went up.
+    bool onProbeAcked() {
+        if (m_probeSize == 0)
+            return false;
+        m_mss = m_probeSize;
+        m_probeSize = 0;
+        m_probeFailures = 0;
+        return true;
+    }
+
+    // The probe was lost; after a few losses its size is written off.
+    void onProbeLost() {
+        if (m_probeSize == 0)
+            return;
+        if (++m_probeFailures >= PMTU_MAX_PROBES) {
+            m_ceiling = m_probeSize - 1;
+            m_probeFailures = 0;
+        }
+        m_probeSize = 0;
+    }
+
+    // A router reported it can only forward mtu byte datagrams. Returns
+    // true if the segment size went down.
+    bool onIcmp(int mtu) {
+        int mss = mss_for_mtu(mtu);
+        if (mss < PMTU_BASE_MSS)
+            mss = PMTU_BASE_MSS;
+        if (mss >= m_ceiling)
+            return false;
+        m_ceiling = mss;
+        m_probeSize = 0;
+        if (m_mss <= mss)
+            return false;
+        m_mss = mss;
+        return true;
+    }
+
+    // Retransmission timeout. Returns true if the segment size dropped to
+    // the base because large segments seem to be disappearing.
+    bool onTimeout() {
+        onProbeLost();
+        if (++m_timeouts < PMTU_BLACKHOLE_TIMEOUTS || m_mss <= PMTU_BASE_MSS)
+            return false;
+        // the ceiling stays: if large segments really are lost, probing
+        // will find out and bring it down
+        m_mss = PMTU_BASE_MSS;
+        m_timeouts = 0;
+        return true;
+    }
+
+    // something was delivered, so the timeouts weren't a black hole
+    void onProgress() { m_timeouts = 0; }
+
+    int mss() { return m_mss; }
+    int ceiling() { return m_ceiling; }
+
+private:
+    int m_mss;
+    int m_ceiling;          // largest size not yet known to fail
+    int m_probeSize;        // 0 when no probe is out
+    int64_t m_probeSeq;
+    int m_probeFailures;
+    int m_timeouts;
+};
+
+#endif
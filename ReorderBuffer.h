@@ -0,0 +1,206 @@
+#ifndef REORDER_BUFFER_H
+#define REORDER_BUFFER_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Packet.h"
+#include "Sack.h"
+
+// default number of early segments the receiver will hold on to
+#define REORDER_SLOTS 64
+
+struct ReorderSlot {
+    int64_t seqNum;
+    int dataLen;
+    bool eof;
+};
+
+// Bounded buffer for data segments that arrive ahead of the next expected
+// sequence number. Payload is copied into a fixed slab allocated up front,
+// one slot of slotLen bytes per segment, so memory use doesn't depend on
+// the file size. The slots in use are kept in sequence order, so finding a
+// segment is a binary search and draining the buffer in order takes each
+// one off the front; segment sizes change with the path MTU, so slots
+// can't simply be indexed by sequence number.
+class ReorderBuffer {
+public:
+    ReorderBuffer(int numSlots = REORDER_SLOTS, int slotLen = DATA_LEN) {
+        m_numSlots = numSlots;
+        m_slotLen = slotLen;
+        m_segmentLen = slotLen;
+        m_slab = (char*)malloc((size_t)numSlots * slotLen);
+        m_slots = (ReorderSlot*)calloc(numSlots, sizeof(ReorderSlot));
+        m_order = (int*)malloc(numSlots * sizeof(int));
+        m_free = (int*)malloc(numSlots * sizeof(int));
+        for (int i = 0; i < numSlots; ++i)
+            m_free[i] = numSlots - 1 - i;
+        m_numFree = numSlots;
+        m_head = 0;
+        m_count = 0;
+        m_newest = -1;
+    }
+
+    ~ReorderBuffer() {
+        free(m_slab);
+        free(m_slots);
+        free(m_order);
+        free(m_free);
+    }
+
+    // Buffers an early segment. Returns false if it was dropped because it
+    // is already buffered, too long, or the buffer is full.
+    bool insert(int64_t seqNum, const char* data, int dataLen, bool eof) {
+        if (dataLen > m_slotLen || m_numFree == 0)
+            return false;
+        int pos = lowerBound(seqNum);
+        if (pos < m_head + m_count && at(pos).seqNum == seqNum)
+            return false;
+        if (m_head + m_count == m_numSlots) {
+            memmove(m_order, m_order + m_head, m_count * sizeof(int));
+            pos -= m_head;
+            m_head = 0;
+        }
+        memmove(m_order + pos + 1, m_order + pos, (m_head + m_count - pos) * sizeof(int));
+
+        int i = m_free[--m_numFree];
+        ReorderSlot& slot = m_slots[i];
+        slot.seqNum = seqNum;
+        slot.dataLen = dataLen;
+        slot.eof = eof;
+        memcpy(m_slab + (size_t)i * m_slotLen, data, dataLen);
+        m_order[pos] = i;
+        m_count++;
+        m_newest = seqNum;
+        return true;
+    }
+
+    // Removes the buffered segment that continues the stream at
+    // expectedSeqNum, trimmed to start there. Segments wholly below
+    // expectedSeqNum are discarded along the way. The returned data stays
+    // valid until the next insert().
+    bool pop(int64_t expectedSeqNum, const char** data, int* dataLen, bool* eof) {
+        while (m_count > 0) {
+            int i = m_order[m_head];
+            ReorderSlot& slot = m_slots[i];
+            if (slot.seqNum > expectedSeqNum)
+                return false;
+            m_free[m_numFree++] = i;
+            m_count--;
+            m_head = m_count > 0 ? m_head + 1 : 0;
+            int64_t end = slot.seqNum + slot.dataLen;
+            if (end > expectedSeqNum || (slot.eof && end == expectedSeqNum)) {
+                *data = m_slab + (size_t)i * m_slotLen + (expectedSeqNum - slot.seqNum);
+                *dataLen = end - expectedSeqNum;
+                *eof = slot.eof;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The buffered segment that starts at seqNum and is dataLen long, or
+    // NULL. Valid until the next insert().
+    const char* find(int64_t seqNum, int dataLen) {
+        int pos = lowerBound(seqNum);
+        if (pos == m_head + m_count || at(pos).seqNum != seqNum || at(pos).dataLen != dataLen)
+            return NULL;
+        return m_slab + (size_t)m_order[pos] * m_slotLen;
+    }
+
+    // Describes the buffered data as merged [start, end) ranges for
+    // advertising in SACK blocks: first the one holding the segment that
+    // arrived last, as RFC 2018 asks, then the rest lowest first. Only the
+    // segments in the blocks reported are looked at. Returns the number of
+    // blocks.
+    int sackBlocks(SackBlock* blocks, int maxBlocks) {
+        if (maxBlocks <= 0)
+            return 0;
+        int end = m_head + m_count;
+        int numBlocks = 0;
+        SackBlock newest = { 0, -1 };
+        int pos = lowerBound(m_newest);
+        if (pos < end && at(pos).seqNum == m_newest && at(pos).dataLen > 0) {
+            newest.start = m_newest;
+            newest.end = m_newest + at(pos).dataLen;
+            // a slot further down can't reach past its seqNum plus a slot
+            for (int i = pos - 1; i >= m_head && at(i).seqNum + m_slotLen >= newest.start; --i) {
+                if (at(i).dataLen > 0 && at(i).seqNum + at(i).dataLen >= newest.start) {
+                    newest.start = at(i).seqNum;
+                    if (at(i).seqNum + at(i).dataLen > newest.end)
+                        newest.end = at(i).seqNum + at(i).dataLen;
+                }
+            }
+            for (int i = pos + 1; i < end && at(i).seqNum <= newest.end; ++i) {
+                if (at(i).seqNum + at(i).dataLen > newest.end)
+                    newest.end = at(i).seqNum + at(i).dataLen;
+            }
+            blocks[numBlocks++] = newest;
+        }
+
+        for (int i = m_head; i < end; ++i) {
+            const ReorderSlot& slot = at(i);
+            // empty, or already in the first block
+            if (slot.dataLen == 0 || (slot.seqNum >= newest.start && slot.seqNum <= newest.end))
+                continue;
+            SackBlock range = { slot.seqNum, slot.seqNum + slot.dataLen };
+            // extend the block this loop started last, never the first one
+            bool extending = numBlocks > (newest.end < 0 ? 0 : 1);
+            if (extending && range.start <= blocks[numBlocks - 1].end) {
+                if (range.end > blocks[numBlocks - 1].end)
+                    blocks[numBlocks - 1].end = range.end;
+                continue;
+            }
+            if (numBlocks == maxBlocks)
+                break;
+            blocks[numBlocks++] = range;
+        }
+        return numBlocks;
+    }
+
+    int size() { return m_count; }
+    int capacity() { return m_numSlots; }
+
+    // the sender settled on segments of len bytes, at most a slot
+    void setSegmentLen(int len) {
+        m_segmentLen = len < m_slotLen ? len : m_slotLen;
+    }
+
+    // Bytes past the cumulative ACK the receiver can take: a segment per
+    // slot, plus the in-order segment that goes straight to disk.
+    int64_t window() { return (int64_t)(m_numSlots + 1) * m_segmentLen; }
+
+private:
+    char* m_slab;
+    ReorderSlot* m_slots;
+    int* m_order;           // slots in use by sequence number, from m_head
+    int* m_free;            // stack of unused slots
+    int m_numFree;
+    int m_numSlots;
+    int m_slotLen;
+    int m_segmentLen;
+    int m_head;
+    int m_count;
+    int64_t m_newest;       // seqNum of the segment inserted last
+
+    const ReorderSlot& at(int pos) { return m_slots[m_order[pos]]; }
+
+    // position in m_order of the first slot at or after seqNum
+    int lowerBound(int64_t seqNum) {
+        int lo = m_head;
+        int hi = m_head + m_count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (at(mid).seqNum < seqNum)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    ReorderBuffer(const ReorderBuffer&);
+    ReorderBuffer& operator=(const ReorderBuffer&);
+};
+
+#endif
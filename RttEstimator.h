@@ -0,0 +1,175 @@
+#ifndef RTT_ESTIMATOR_H
+#define RTT_ESTIMATOR_H
+
+#include <stdint.h>
+#include <time.h>
+
+// retransmission timeout bounds, in microseconds. The floor is Linux's:
+// well clear of the receiver's delayed ACK timer and of scheduling delay,
+// so a quiet loopback path doesn't time out before its ACKs come back.
+#define RTO_MIN_DEFAULT (200 * 1000L)
+#define RTO_MAX_DEFAULT (60 * 1000 * 1000L)
+// clock granularity term in the RTO, per RFC 6298
+#define RTO_GRANULARITY (1000L)
+#define RTT_TIMED_SEGMENTS 256
+
+// monotonic clock, so timers don't jump with the wall clock
+inline int64_t
+now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct TimedSegment {
+    int64_t seqNum;
+    int64_t end;
+    int64_t sentAt;
+    bool retransmitted;
+};
+
+// Per-connection RTT estimator (Jacobson/Karels, RFC 6298). Every segment
+// is stamped with its send time; when a cumulative ACK covers it, the
+// elapsed time becomes an RTT sample unless the segment was ever
+// retransmitted (Karn's rule). Each timeout doubles the RTO; the backoff is
+// dropped again on the next valid sample or once the peer makes forward
+// progress, since under heavy loss valid samples can be rare. All times are
+// in microseconds.
+class RttEstimator {
+public:
+    RttEstimator(int64_t initialRto, int64_t minRto = RTO_MIN_DEFAULT, int64_t maxRto = RTO_MAX_DEFAULT) {
+        m_initialRto = initialRto;
+        m_minRto = minRto;
+        m_maxRto = maxRto;
+        reset();
+    }
+
+    void reset() {
+        m_srtt = 0;
+        m_rttvar = 0;
+        m_lastRtt = 0;
+        m_rto = clamp(m_initialRto);
+        m_backoff = 0;
+        m_numTimed = 0;
+        m_numSamples = 0;
+    }
+
+    void setBounds(int64_t minRto, int64_t maxRto) {
+        m_minRto = minRto;
+        m_maxRto = maxRto;
+        m_rto = clamp(m_rto);
+    }
+
+    // records that [seqNum, end) went out at sentAt
+    void onSend(int64_t seqNum, int64_t end, int64_t sentAt, bool retransmit) {
+        if (retransmit) {
+            for (int i = 0; i < m_numTimed; ++i) {
+                if (m_timed[i].seqNum < end && seqNum < m_timed[i].end)
+                    m_timed[i].retransmitted = true;
+            }
+        }
+        if (m_numTimed == RTT_TIMED_SEGMENTS)
+            removeTimed(0);
+        TimedSegment& seg = m_timed[m_numTimed++];
+        seg.seqNum = seqNum;
+        seg.end = end;
+        seg.sentAt = sentAt;
+        seg.retransmitted = retransmit;
+    }
+
+    // Handles a cumulative ACK. Returns true if it produced an RTT sample.
+    bool onAck(int64_t ackNum, int64_t now) {
+        int64_t newest = -1;
+        bool ambiguous = false;
+        int i = 0;
+        while (i < m_numTimed) {
+            if (m_timed[i].end > ackNum) {
+                i++;
+                continue;
+            }
+            if (m_timed[i].retransmitted)
+                ambiguous = true;
+            else if (m_timed[i].sentAt > newest)
+                newest = m_timed[i].sentAt;
+            removeTimed(i);
+        }
+        if (newest < 0 || ambiguous)
+            return false;
+        sample(now - newest);
+        return true;
+    }
+
+    void sample(int64_t rtt) {
+        if (rtt < 0)
+            return;
+        if (m_numSamples == 0) {
+            m_srtt = rtt;
+            m_rttvar = rtt / 2;
+        }
+        else {
+            int64_t delta = m_srtt > rtt ? m_srtt - rtt : rtt - m_srtt;
+            m_rttvar = (3 * m_rttvar + delta) / 4;
+            m_srtt = (7 * m_srtt + rtt) / 8;
+        }
+        m_lastRtt = rtt;
+        m_numSamples++;
+        m_backoff = 0;
+        m_rto = baseRto();
+    }
+
+    // the peer acknowledged new data: collapse any backoff
+    void onProgress() {
+        if (m_backoff == 0)
+            return;
+        m_backoff = 0;
+        m_rto = baseRto();
+    }
+
+    // exponential backoff after a retransmission timeout
+    void onTimeout() {
+        m_backoff++;
+        m_rto = clamp(m_rto * 2);
+    }
+
+    int64_t rto() { return m_rto; }
+    int64_t srtt() { return m_srtt; }
+    int64_t rttvar() { return m_rttvar; }
+    int64_t lastRtt() { return m_lastRtt; }
+    int backoff() { return m_backoff; }
+    long numSamples() { return m_numSamples; }
+
+private:
+    int64_t m_initialRto;
+    int64_t m_minRto;
+    int64_t m_maxRto;
+    int64_t m_srtt;
+    int64_t m_rttvar;
+    int64_t m_lastRtt;
+    int64_t m_rto;
+    int m_backoff;
+    long m_numSamples;
+    TimedSegment m_timed[RTT_TIMED_SEGMENTS];
+    int m_numTimed;
+
+    // RTO implied by the current estimate, without backoff
+    int64_t baseRto() {
+        if (m_numSamples == 0)
+            return clamp(m_initialRto);
+        int64_t variance = 4 * m_rttvar > RTO_GRANULARITY ? 4 * m_rttvar : RTO_GRANULARITY;
+        return clamp(m_srtt + variance);
+    }
+
+    int64_t clamp(int64_t rto) {
+        if (rto < m_minRto)
+            return m_minRto;
+        if (rto > m_maxRto)
+            return m_maxRto;
+        return rto;
+    }
+
+    void removeTimed(int i) {
+        m_timed[i] = m_timed[--m_numTimed];
+    }
+};
+
+#endif
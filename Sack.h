@@ -0,0 +1,154 @@
+#ifndef SACK_H
+#define SACK_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "Packet.h"
+
+// SACK blocks ride in the payload of an ACK as (start, end) pairs of 64 bit
+// sequence numbers in network byte order, the block holding the latest
+// arrival first. Each block covers [start, end) bytes the receiver holds
+// above the cumulative ACK.
+#define MAX_SACK_BLOCKS 4
+#define SACK_BLOCK_LEN 16
+#define SACK_SCOREBOARD_RANGES 32
+
+struct SackBlock {
+    int64_t start;
+    int64_t end;
+};
+
+// Writes up to MAX_SACK_BLOCKS blocks into buf. Returns the number of bytes
+// written.
+inline int
+sack_encode(char* buf, int bufLen, const SackBlock* blocks, int numBlocks) {
+    int len = 0;
+    for (int i = 0; i < numBlocks && i < MAX_SACK_BLOCKS && len + SACK_BLOCK_LEN <= bufLen; ++i) {
+        wire_put64(buf, len, blocks[i].start);
+        wire_put64(buf, len + 8, blocks[i].end);
+        len += SACK_BLOCK_LEN;
+    }
+    return len;
+}
+
+// Parses the SACK blocks in an ACK payload. Returns the number of blocks.
+inline int
+sack_decode(const char* data, int dataLen, SackBlock* blocks, int maxBlocks) {
+    int numBlocks = 0;
+    for (int off = 0; off + SACK_BLOCK_LEN <= dataLen && numBlocks < maxBlocks; off += SACK_BLOCK_LEN) {
+        blocks[numBlocks].start = (int64_t)wire_get64(data, off);
+        blocks[numBlocks].end = (int64_t)wire_get64(data, off + 8);
+        if (blocks[numBlocks].end > blocks[numBlocks].start)
+            numBlocks++;
+    }
+    return numBlocks;
+}
+
+// Sender-side record of which bytes above the cumulative ACK the receiver
+// has reported holding. Kept as a small sorted array of disjoint ranges;
+// anything between them is a hole that still needs retransmitting.
+class SackScoreboard {
+public:
+    SackScoreboard() {
+        clear();
+    }
+
+    void clear() {
+        m_numRanges = 0;
+    }
+
+    void add(int64_t start, int64_t end) {
+        if (end <= start)
+            return;
+
+        // merge with every range it touches, then insert in order
+        int i = 0;
+        while (i < m_numRanges) {
+            if (m_ranges[i].end < start || m_ranges[i].start > end) {
+                i++;
+                continue;
+            }
+            if (m_ranges[i].start < start)
+                start = m_ranges[i].start;
+            if (m_ranges[i].end > end)
+                end = m_ranges[i].end;
+            remove(i);
+        }
+        if (m_numRanges == SACK_SCOREBOARD_RANGES)
+            return;
+
+        int pos = 0;
+        while (pos < m_numRanges && m_ranges[pos].start < start)
+            pos++;
+        memmove(&m_ranges[pos + 1], &m_ranges[pos], (m_numRanges - pos) * sizeof(SackBlock));
+        m_ranges[pos].start = start;
+        m_ranges[pos].end = end;
+        m_numRanges++;
+    }
+
+    // forgets everything below the new cumulative ACK
+    void advance(int64_t ackNum) {
+        while (m_numRanges > 0 && m_ranges[0].end <= ackNum)
+            remove(0);
+        if (m_numRanges > 0 && m_ranges[0].start < ackNum)
+            m_ranges[0].start = ackNum;
+    }
+
+    // Finds the first un-SACKed range in [from, limit). Returns false if
+    // everything there has been SACKed.
+    bool nextHole(int64_t from, int64_t limit, int64_t* holeStart, int64_t* holeEnd) {
+        for (int i = 0; i < m_numRanges && from < limit; ++i) {
+            if (m_ranges[i].end <= from)
+                continue;
+            if (m_ranges[i].start > from) {
+                *holeStart = from;
+                *holeEnd = m_ranges[i].start < limit ? m_ranges[i].start : limit;
+                return true;
+            }
+            from = m_ranges[i].end;
+        }
+        if (from >= limit)
+            return false;
+        *holeStart = from;
+        *holeEnd = limit;
+        return true;
+    }
+
+    // number of SACKed bytes in [from, to)
+    int64_t sackedBytes(int64_t from, int64_t to) {
+        int64_t bytes = 0;
+        for (int i = 0; i < m_numRanges; ++i) {
+            int64_t start = m_ranges[i].start > from ? m_ranges[i].start : from;
+            int64_t end = m_ranges[i].end < to ? m_ranges[i].end : to;
+            if (end > start)
+                bytes += end - start;
+        }
+        return bytes;
+    }
+
+    bool isSacked(int64_t seqNum) {
+        for (int i = 0; i < m_numRanges; ++i) {
+            if (m_ranges[i].start <= seqNum && seqNum < m_ranges[i].end)
+                return true;
+        }
+        return false;
+    }
+
+    // end of the highest SACKed range, or 0 if nothing is SACKed
+    int64_t highest() { return m_numRanges > 0 ? m_ranges[m_numRanges - 1].end : 0; }
+
+    int numRanges() { return m_numRanges; }
+
+private:
+    SackBlock m_ranges[SACK_SCOREBOARD_RANGES];
+    int m_numRanges;
+
+    void remove(int i) {
+        memmove(&m_ranges[i], &m_ranges[i + 1], (m_numRanges - i - 1) * sizeof(SackBlock));
+        m_numRanges--;
+    }
+};
+
+#endif
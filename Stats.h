@@ -0,0 +1,368 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "EventLoop.h"
+
+// values up to 2^(HIST_BUCKETS - 1), plenty for microseconds or bytes
+#define HIST_BUCKETS 48
+// how long a stats client gets to send its command
+#define STATS_COMMAND_TIMEOUT_US (100 * 1000)
+// how long a client may go without taking any of its reply
+#define STATS_CLIENT_TIMEOUT_US (5 * 1000 * 1000)
+// clients served at once; more are turned away
+#define STATS_MAX_CLIENTS 8
+#define STATS_COMMAND_LEN 64
+
+// Power of two histogram: bucket 0 holds 0, bucket i holds [2^(i-1), 2^i).
+// Recording is a shift and an increment; percentiles are estimates.
+class Histogram {
+public:
+    Histogram() {
+        memset(m_buckets, 0, sizeof(m_buckets));
+        m_count = 0;
+        m_sum = 0;
+        m_min = 0;
+        m_max = 0;
+    }
+
+    void record(int64_t value) {
+        if (value < 0)
+            value = 0;
+        int bucket = value == 0 ? 0 : 64 - __builtin_clzll((uint64_t)value);
+        if (bucket >= HIST_BUCKETS)
+            bucket = HIST_BUCKETS - 1;
+        m_buckets[bucket]++;
+        if (m_count == 0 || value < m_min)
+            m_min = value;
+        if (value > m_max)
+            m_max = value;
+        m_count++;
+        m_sum += value;
+    }
+
+    void merge(const Histogram& other) {
+        if (other.m_count == 0)
+            return;
+        for (int i = 0; i < HIST_BUCKETS; ++i)
+            m_buckets[i] += other.m_buckets[i];
+        if (m_count == 0 || other.m_min < m_min)
+            m_min = other.m_min;
+        if (other.m_max > m_max)
+            m_max = other.m_max;
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+    }
+
+    unsigned long count() const { return m_count; }
+
+    // interpolated linearly within the bucket the rank falls in
+    int64_t percentile(double p) const {
+        if (m_count == 0)
+            return 0;
+        unsigned long rank = (unsigned long)(p * m_count);
+        unsigned long seen = 0;
+        for (int i = 0; i < HIST_BUCKETS; ++i) {
+            if (seen + m_buckets[i] > rank) {
+                int64_t lower = i == 0 ? 0 : (int64_t)1 << (i - 1);
+                int64_t upper = i == 0 ? 0 : (int64_t)1 << i;
+                if (lower < m_min)
+                    lower = m_min;
+                if (upper > m_max)
+                    upper = m_max;
+                return lower + (int64_t)((upper - lower) * (double)(rank - seen) / m_buckets[i]);
+            }
+            seen += m_buckets[i];
+        }
+        return m_max;
+    }
+
+    void writeJson(FILE* f) const {
+        fprintf(f, "{\"count\": %lu, \"min\": %lld, \"mean\": %lld, \"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"max\": %lld}",
+            m_count, (long long)m_min, (long long)(m_count ? m_sum / (int64_t)m_count : 0),
+            (long long)percentile(0.5), (long long)percentile(0.9), (long long)percentile(0.99), (long long)m_max);
+    }
+
+private:
+    unsigned long m_buckets[HIST_BUCKETS];
+    unsigned long m_count;
+    int64_t m_sum;
+    int64_t m_min;
+    int64_t m_max;
+};
+
+// Counters for one transfer. Each worker is a single-threaded process that
+// owns its connections outright, so these are plain fields: nothing is
+// shared and nothing needs a lock or an atomic.
+struct ConnStats {
+    unsigned long segmentsSent;
+    unsigned long retransmits;
+    unsigned long bytesSent;
+    unsigned long bytesAcked;
+    unsigned long acks;
+    unsigned long dupAcks;
+    unsigned long fastRetransmits;
+    unsigned long timeouts;
+    unsigned long paceWaits;    // times the pacer held a segment back
+    unsigned long repairsSent;  // FEC repair packets
+    Histogram rtt;          // microseconds, one per RTT sample
+    Histogram cwnd;         // bytes, sampled on every ACK that moves the window
+};
+
+inline void
+conn_stats_init(ConnStats* stats) {
+    // value-initialized: counters zeroed, histograms emptied
+    *stats = ConnStats();
+}
+
+inline void
+conn_stats_merge(ConnStats* into, const ConnStats& from) {
+    into->segmentsSent += from.segmentsSent;
+    into->retransmits += from.retransmits;
+    into->bytesSent += from.bytesSent;
+    into->bytesAcked += from.bytesAcked;
+    into->acks += from.acks;
+    into->dupAcks += from.dupAcks;
+    into->fastRetransmits += from.fastRetransmits;
+    into->timeouts += from.timeouts;
+    into->paceWaits += from.paceWaits;
+    into->repairsSent += from.repairsSent;
+    into->rtt.merge(from.rtt);
+    into->cwnd.merge(from.cwnd);
+}
+
+// writes the counters as the body of a JSON object, without the braces
+inline void
+conn_stats_write_json(FILE* f, const ConnStats& stats) {
+    fprintf(f, "\"segmentsSent\": %lu, \"retransmits\": %lu, \"bytesSent\": %lu, \"bytesAcked\": %lu, "
+               "\"acks\": %lu, \"dupAcks\": %lu, \"fastRetransmits\": %lu, \"timeouts\": %lu, \"paceWaits\": %lu, \"repairsSent\": %lu, \"rttUs\": ",
+        stats.segmentsSent, stats.retransmits, stats.bytesSent, stats.bytesAcked,
+        stats.acks, stats.dupAcks, stats.fastRetransmits, stats.timeouts, stats.paceWaits, stats.repairsSent);
+    stats.rtt.writeJson(f);
+    fprintf(f, ", \"cwndBytes\": ");
+    stats.cwnd.writeJson(f);
+}
+
+// One stats client: reading its command, then sending the reply.
+struct StatsClient {
+    int fd;                         // -1 for a free entry
+    char cmd[STATS_COMMAND_LEN];
+    int cmdLen;
+    bool ready;                     // the command is in, or won't come
+    char* reply;                    // set once the reply is written
+    size_t replyLen;
+    size_t sent;
+    int64_t deadline;
+};
+
+// Listening UNIX stream socket for stats clients. A client connects, may
+// send a one-word command, and reads the reply until the server closes
+// the connection:
+//
+//   echo stats | socat - UNIX-CONNECT:/tmp/server.sock
+//
+// Everything is non-blocking and driven from the worker's event loop as
+// EVENT_CONTROL, so an idle or slow client never holds up the transfers:
+// replies are written into memory and sent as the client takes them.
+class StatsSocket {
+public:
+    StatsSocket() {
+        m_fd = -1;
+        m_path[0] = '\0';
+        m_loop = NULL;
+        for (int i = 0; i < STATS_MAX_CLIENTS; ++i)
+            m_clients[i].fd = -1;
+        m_current = -1;
+    }
+
+    ~StatsSocket() {
+        for (int i = 0; i < STATS_MAX_CLIENTS; ++i)
+            drop(&m_clients[i]);
+        if (m_fd >= 0) {
+            close(m_fd);
+            unlink(m_path);
+        }
+    }
+
+    // Replaces any stale socket left at path by an earlier run, and
+    // watches it on loop.
+    bool open(const char* path, EventLoop* loop) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path))
+            return false;
+        strcpy(addr.sun_path, path);
+        m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_fd < 0)
+            return false;
+        unlink(path);
+        if (bind(m_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(m_fd, 8) < 0 ||
+            !loop->add(m_fd, EVENT_CONTROL)) {
+            close(m_fd);
+            m_fd = -1;
+            return false;
+        }
+        snprintf(m_path, sizeof(m_path), "%s", path);
+        m_loop = loop;
+        return true;
+    }
+
+    int fd() { return m_fd; }
+
+    // When a client's command wait or reply runs out of time, 0 if none.
+    int64_t deadline() {
+        int64_t deadline = 0;
+        for (int i = 0; i < STATS_MAX_CLIENTS; ++i) {
+            if (m_clients[i].fd >= 0 && (!deadline || m_clients[i].deadline < deadline))
+                deadline = m_clients[i].deadline;
+        }
+        return deadline;
+    }
+
+    // Accepts waiting clients, reads what commands have arrived, sends
+    // what replies the clients will take, and drops the finished and the
+    // timed out. Never blocks.
+    void service(int64_t now) {
+        int fd;
+        while (m_fd >= 0 && (fd = accept4(m_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            StatsClient* client = freeClient();
+            if (!client || !m_loop->add(fd, EVENT_CONTROL)) {
+                close(fd);
+                continue;
+            }
+            client->fd = fd;
+            client->cmdLen = 0;
+            client->ready = false;
+            client->reply = NULL;
+            client->replyLen = 0;
+            client->sent = 0;
+            client->deadline = now + STATS_COMMAND_TIMEOUT_US;
+        }
+
+        for (int i = 0; i < STATS_MAX_CLIENTS; ++i) {
+            StatsClient* client = &m_clients[i];
+            if (client->fd < 0)
+                continue;
+            if (client->reply) {
+                send(client, now);
+                continue;
+            }
+            if (!client->ready)
+                readCommand(client, now);
+        }
+    }
+
+    // Takes the next client whose command is in, or who sent none in time,
+    // and copies the command to cmd (empty for none). Returns a stream to
+    // write the reply into and hand to reply(), or NULL once no client is
+    // waiting for one.
+    FILE* nextRequest(char* cmd, int cmdLen) {
+        for (int i = 0; i < STATS_MAX_CLIENTS; ++i) {
+            StatsClient* client = &m_clients[i];
+            if (client->fd < 0 || !client->ready || client->reply)
+                continue;
+            snprintf(cmd, cmdLen, "%s", client->cmd);
+            FILE* f = open_memstream(&client->reply, &client->replyLen);
+            if (!f) {
+                drop(client);
+                continue;
+            }
+            m_current = i;
+            return f;
+        }
+        return NULL;
+    }
+
+    // Sends the reply written to f as the client takes it.
+    void reply(FILE* f, int64_t now) {
+        StatsClient* client = &m_clients[m_current];
+        m_current = -1;
+        if (fclose(f) != 0 || !client->reply) {
+            drop(client);
+            return;
+        }
+        client->deadline = now + STATS_CLIENT_TIMEOUT_US;
+        m_loop->modify(client->fd, EVENT_CONTROL, true);
+        send(client, now);
+    }
+
+private:
+    int m_fd;
+    char m_path[108];
+    EventLoop* m_loop;
+    StatsClient m_clients[STATS_MAX_CLIENTS];
+    int m_current;      // client whose reply is being written
+
+    StatsClient* freeClient() {
+        for (int i = 0; i < STATS_MAX_CLIENTS; ++i) {
+            if (m_clients[i].fd < 0)
+                return &m_clients[i];
+        }
+        return NULL;
+    }
+
+    // The command ends at a newline, when the client stops sending, or
+    // when its time is up.
+    void readCommand(StatsClient* client, int64_t now) {
+        while (!client->ready) {
+            int room = STATS_COMMAND_LEN - 1 - client->cmdLen;
+            ssize_t n = room > 0 ? recv(client->fd, client->cmd + client->cmdLen, room, 0) : 0;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (now >= client->deadline)
+                    break;
+                return;
+            }
+            if (n <= 0)
+                break;
+            client->cmdLen += n;
+            client->cmd[client->cmdLen] = '\0';
+            if (strchr(client->cmd, '\n'))
+                break;
+        }
+        client->cmd[client->cmdLen] = '\0';
+        client->cmd[strcspn(client->cmd, " \r\n")] = '\0';
+        client->ready = true;
+    }
+
+    void send(StatsClient* client, int64_t now) {
+        while (client->sent < client->replyLen) {
+            ssize_t n = ::send(client->fd, client->reply + client->sent, client->replyLen - client->sent, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (now >= client->deadline)
+                    break;
+                return;
+            }
+            if (n <= 0)
+                break;
+            client->sent += n;
+            client->deadline = now + STATS_CLIENT_TIMEOUT_US;
+        }
+        drop(client);
+    }
+
+    void drop(StatsClient* client) {
+        if (client->fd < 0)
+            return;
+        m_loop->remove(client->fd);
+        close(client->fd);
+        free(client->reply);
+        client->fd = -1;
+        client->reply = NULL;
+    }
+
+    StatsSocket(const StatsSocket&);
+    StatsSocket& operator=(const StatsSocket&);
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef TIMER_HEAP_H
+#define TIMER_HEAP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Binary min-heap of per-connection deadlines, so the event loop can sleep
+// until the earliest one without scanning every connection. V must have an
+// int64_t deadline and an int heapIndex member; heapIndex is -1 while the
+// value isn't scheduled. The heap doesn't own the values.
+template <typename V>
+class TimerHeap {
+public:
+    TimerHeap() {
+        m_items = NULL;
+        m_size = 0;
+        m_capacity = 0;
+    }
+
+    ~TimerHeap() {
+        free(m_items);
+    }
+
+    // Schedules value for deadline, moving it if it is already scheduled.
+    void schedule(V* value, int64_t deadline) {
+        value->deadline = deadline;
+        if (value->heapIndex < 0) {
+            if (m_size == m_capacity) {
+                m_capacity = m_capacity ? 2 * m_capacity : 64;
+                m_items = (V**)realloc(m_items, m_capacity * sizeof(V*));
+            }
+            value->heapIndex = m_size;
+            m_items[m_size++] = value;
+        }
+        siftUp(value->heapIndex);
+        siftDown(value->heapIndex);
+    }
+
+    void cancel(V* value) {
+        int i = value->heapIndex;
+        if (i < 0)
+            return;
+        value->heapIndex = -1;
+        m_size--;
+        if (i == m_size)
+            return;
+        m_items[i] = m_items[m_size];
+        m_items[i]->heapIndex = i;
+        siftUp(i);
+        siftDown(i);
+    }
+
+    // earliest scheduled value, or NULL
+    V* top() { return m_size > 0 ? m_items[0] : NULL; }
+    int size() { return m_size; }
+
+private:
+    V** m_items;
+    int m_size;
+    int m_capacity;
+
+    void swap(int i, int j) {
+        V* tmp = m_items[i];
+        m_items[i] = m_items[j];
+        m_items[j] = tmp;
+        m_items[i]->heapIndex = i;
+        m_items[j]->heapIndex = j;
+    }
+
+    void siftUp(int i) {
+        while (i > 0) {
+            int parent = (i - 1) / 2;
+            if (m_items[parent]->deadline <= m_items[i]->deadline)
+                break;
+            swap(i, parent);
+            i = parent;
+        }
+    }
+
+    void siftDown(int i) {
+        while (1) {
+            int smallest = i;
+            int left = 2 * i + 1;
+            int right = left + 1;
+            if (left < m_size && m_items[left]->deadline < m_items[smallest]->deadline)
+                smallest = left;
+            if (right < m_size && m_items[right]->deadline < m_items[smallest]->deadline)
+                smallest = right;
+            if (smallest == i)
+                break;
+            swap(i, smallest);
+            i = smallest;
+        }
+    }
+
+    TimerHeap(const TimerHeap&);
+    TimerHeap& operator=(const TimerHeap&);
+};
+
+#endif
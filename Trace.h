@@ -0,0 +1,159 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// events kept before the oldest are overwritten
+#define TRACE_RING_DEFAULT (64 * 1024)
+
+// event types, with what a, b and c hold
+#define TRACE_CONNECTION_STARTED 1  // a = file length
+#define TRACE_CONNECTION_CLOSED 2
+#define TRACE_PACKET_SENT 3         // a = sequence number, b = payload length; flags = TRACE_FLAG_*
+#define TRACE_PACKET_RECEIVED 4     // a = sequence number, b = payload length; flags = TRACE_FLAG_*
+#define TRACE_PACKET_LOST 5         // a = sequence number; flags = TRACE_LOST_*
+#define TRACE_RTT_UPDATED 6         // a = latest RTT, b = smoothed RTT, c = RTT variance (microseconds)
+#define TRACE_CWND_UPDATED 7        // a = cwnd, b = ssthresh, c = bytes in flight
+#define TRACE_CONGESTION_STATE 8    // flags = TRACE_STATE_*
+
+#define TRACE_FLAG_ACK 1            // an ACK rather than data; a is the ACK number
+#define TRACE_FLAG_RETRANSMIT 2
+#define TRACE_FLAG_EOF 4
+#define TRACE_FLAG_REPAIRED 8       // rebuilt from FEC rather than received
+
+#define TRACE_LOST_TIMEOUT 0
+#define TRACE_LOST_DUP_ACKS 1
+
+#define TRACE_STATE_SLOW_START 0
+#define TRACE_STATE_AVOIDANCE 1
+#define TRACE_STATE_RECOVERY 2
+
+struct TraceEvent {
+    int64_t time;           // now_us()
+    uint32_t connId;
+    uint16_t type;
+    uint16_t flags;
+    int64_t a;
+    int64_t b;
+    int64_t c;
+};
+
+// Fixed-size ring of binary trace events. Recording is a struct copy, so
+// tracing can stay on at full rate; once the ring is full the oldest events
+// are overwritten. Events are exported as qlog (draft-ietf-quic-qlog-main-
+// schema) JSON, mapped onto the closest transport and recovery events.
+class TraceRing {
+public:
+    TraceRing(int capacity = TRACE_RING_DEFAULT) {
+        m_capacity = capacity;
+        m_events = (TraceEvent*)malloc(capacity * sizeof(TraceEvent));
+        m_next = 0;
+    }
+
+    ~TraceRing() {
+        free(m_events);
+    }
+
+    void record(int64_t time, uint32_t connId, int type, int flags, int64_t a = 0, int64_t b = 0, int64_t c = 0) {
+        TraceEvent& ev = m_events[m_next++ % m_capacity];
+        ev.time = time;
+        ev.connId = connId;
+        ev.type = type;
+        ev.flags = flags;
+        ev.a = a;
+        ev.b = b;
+        ev.c = c;
+    }
+
+    // events recorded since the start, including any overwritten
+    uint64_t recorded() { return m_next; }
+
+    // Writes the events still in the ring as one qlog trace: every event of
+    // *connId, or of all connections if connId is NULL. vantage is "server"
+    // or "client".
+    void writeQlog(FILE* f, const uint32_t* connId, const char* vantage) {
+        uint64_t first = m_next > (uint64_t)m_capacity ? m_next - m_capacity : 0;
+        int64_t reference = 0;
+        for (uint64_t i = first; i < m_next && reference == 0; ++i) {
+            const TraceEvent& ev = m_events[i % m_capacity];
+            if (!connId || ev.connId == *connId)
+                reference = ev.time;
+        }
+
+        fprintf(f, "{\"qlog_version\": \"0.3\", \"qlog_format\": \"JSON\", \"title\": \"cs118-tcp\", \"traces\": [{"
+                   "\"vantage_point\": {\"type\": \"%s\"}, \"common_fields\": {", vantage);
+        if (connId)
+            fprintf(f, "\"group_id\": \"%08x\", ", *connId);
+        fprintf(f, "\"time_format\": \"relative\", \"reference_time\": %.3f}, \"events\": [", reference / 1e3);
+        bool firstEvent = true;
+        for (uint64_t i = first; i < m_next; ++i) {
+            const TraceEvent& ev = m_events[i % m_capacity];
+            if (connId && ev.connId != *connId)
+                continue;
+            fprintf(f, "%s\n  {\"time\": %.3f, ", firstEvent ? "" : ",", (ev.time - reference) / 1e3);
+            if (!connId)
+                fprintf(f, "\"group_id\": \"%08x\", ", ev.connId);
+            writeEvent(f, ev);
+            fprintf(f, "}");
+            firstEvent = false;
+        }
+        fprintf(f, "\n]}]}\n");
+    }
+
+private:
+    TraceEvent* m_events;
+    int m_capacity;
+    uint64_t m_next;
+
+    static void writeEvent(FILE* f, const TraceEvent& ev) {
+        static const char* states[] = { "slow_start", "congestion_avoidance", "recovery" };
+        switch (ev.type) {
+        case TRACE_CONNECTION_STARTED:
+            fprintf(f, "\"name\": \"transport:connection_started\", \"data\": {\"file_length\": %lld}", (long long)ev.a);
+            break;
+        case TRACE_CONNECTION_CLOSED:
+            fprintf(f, "\"name\": \"transport:connection_closed\", \"data\": {}");
+            break;
+        case TRACE_PACKET_SENT:
+        case TRACE_PACKET_RECEIVED:
+            fprintf(f, "\"name\": \"transport:packet_%s\", \"data\": {\"header\": {\"packet_type\": \"%s\", \"packet_number\": %lld}, "
+                       "\"raw\": {\"payload_length\": %lld}",
+                ev.type == TRACE_PACKET_SENT ? "sent" : "received",
+                (ev.flags & TRACE_FLAG_ACK) ? "ack" : (ev.flags & TRACE_FLAG_EOF) ? "eof" : "data",
+                (long long)ev.a, (long long)ev.b);
+            if (ev.flags & TRACE_FLAG_RETRANSMIT)
+                fprintf(f, ", \"trigger\": \"retransmit\"");
+            else if (ev.flags & TRACE_FLAG_REPAIRED)
+                fprintf(f, ", \"trigger\": \"fec_repaired\"");
+            fprintf(f, "}");
+            break;
+        case TRACE_PACKET_LOST:
+            fprintf(f, "\"name\": \"recovery:packet_lost\", \"data\": {\"header\": {\"packet_number\": %lld}, \"trigger\": \"%s\"}",
+                (long long)ev.a, ev.flags == TRACE_LOST_TIMEOUT ? "pto_expired" : "reordering_threshold");
+            break;
+        case TRACE_RTT_UPDATED:
+            fprintf(f, "\"name\": \"recovery:metrics_updated\", \"data\": {\"latest_rtt\": %.3f, \"smoothed_rtt\": %.3f, \"rtt_variance\": %.3f}",
+                ev.a / 1e3, ev.b / 1e3, ev.c / 1e3);
+            break;
+        case TRACE_CWND_UPDATED:
+            fprintf(f, "\"name\": \"recovery:metrics_updated\", \"data\": {\"congestion_window\": %lld, \"ssthresh\": %lld, \"bytes_in_flight\": %lld}",
+                (long long)ev.a, (long long)ev.b, (long long)ev.c);
+            break;
+        case TRACE_CONGESTION_STATE:
+            fprintf(f, "\"name\": \"recovery:congestion_state_updated\", \"data\": {\"new\": \"%s\"}",
+                ev.flags <= TRACE_STATE_RECOVERY ? states[ev.flags] : "unknown");
+            break;
+        default:
+            fprintf(f, "\"name\": \"unknown\", \"data\": {}");
+            break;
+        }
+    }
+
+    TraceRing(const TraceRing&);
+    TraceRing& operator=(const TraceRing&);
+};
+
+#endif
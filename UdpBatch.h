@@ -0,0 +1,346 @@
+#ifndef UDP_BATCH_H
+#define UDP_BATCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "Packet.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// packets queued before a send batch flushes itself
+#define SEND_BATCH_PACKETS 64
+// kernel limits on one GSO send
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_BYTES 60000
+// datagrams (or GRO trains) taken per recvmmsg
+#define RECV_BATCH_MESSAGES 32
+#define GRO_BUFFER_LEN 65536
+
+// Syscall counters for the batched send and receive paths.
+struct IoStats {
+    unsigned long sendCalls;
+    unsigned long sentPackets;
+    unsigned long sendDrops;
+    unsigned long recvCalls;
+    unsigned long recvPackets;
+};
+
+inline IoStats&
+io_stats() {
+    static IoStats stats;
+    return stats;
+}
+
+inline void
+print_io_stats(const char* label) {
+    IoStats& stats = io_stats();
+    printf("%s: sent %lu packets in %lu calls (%.1f per call, %lu dropped), received %lu packets in %lu calls (%.1f per call)\n",
+        label,
+        stats.sentPackets, stats.sendCalls, stats.sendCalls ? (double)stats.sentPackets / stats.sendCalls : 0.0, stats.sendDrops,
+        stats.recvPackets, stats.recvCalls, stats.recvCalls ? (double)stats.recvPackets / stats.recvCalls : 0.0);
+}
+
+// Asks for a socket receive buffer that can hold bytes of datagrams. The
+// kernel charges each datagram its buffer overhead too, so twice the
+// payload is asked for. Returns the payload the granted buffer holds, which
+// net.core.rmem_max may cap below bytes.
+inline int64_t
+udp_size_rcvbuf(int sockfd, int64_t bytes) {
+    int want = bytes * 2 < INT32_MAX ? (int)(bytes * 2) : INT32_MAX;
+    int got = 0;
+    socklen_t len = sizeof(got);
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &want, sizeof(want));
+    if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &got, &len) < 0)
+        return 0;
+    // getsockopt reports the doubled figure the kernel keeps internally
+    return got / 4;
+}
+
+// Collects outgoing datagrams back to back in one buffer and sends them with
+// a single sendmmsg. Where the kernel supports UDP GSO, runs of equal-sized
+// datagrams to the same peer go down as one UDP_SEGMENT message, so a whole
+// window costs a single trip through the stack. If the socket buffer is
+// full the rest of the batch is dropped, just as the network might.
+class SendBatch {
+public:
+    SendBatch(int sockfd) {
+        m_sockfd = sockfd;
+        m_buffer = (char*)malloc(SEND_BATCH_PACKETS * FRAME_LEN);
+        m_count = 0;
+        m_used = 0;
+        int segment;
+        socklen_t len = sizeof(segment);
+        m_gso = getsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &segment, &len) == 0;
+    }
+
+    ~SendBatch() {
+        free(m_buffer);
+    }
+
+    // Space for the next datagram, at least FRAME_LEN bytes. Only valid
+    // until the next commit() or flush().
+    char* next() {
+        if (m_count == SEND_BATCH_PACKETS)
+            flush();
+        return m_buffer + m_used;
+    }
+
+    // queues the len bytes written at next() for dest
+    void commit(int len, const struct sockaddr_in& dest) {
+        QueuedPacket& pkt = m_packets[m_count++];
+        pkt.offset = m_used;
+        pkt.len = len;
+        pkt.dest = dest;
+        m_used += len;
+    }
+
+    void flush() {
+        int from = 0;
+        while (from < m_count) {
+            int numMsgs = build(from);
+            int sent = 0;
+            bool retried = false;
+            while (sent < numMsgs) {
+                int n = sendmmsg(m_sockfd, m_msgs + sent, numMsgs - sent, 0);
+                io_stats().sendCalls++;
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    // An ICMP error for some earlier datagram (IP_RECVERR) is
+                    // reported by whichever call comes next, then cleared.
+                    if (!retried && (errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH || errno == EMSGSIZE)) {
+                        retried = true;
+                        continue;
+                    }
+                    if (m_gso && (errno == EIO || errno == EINVAL)) {
+                        // GSO refused (e.g. by the device); resend unsegmented
+                        m_gso = false;
+                        break;
+                    }
+                    // a full socket buffer or an oversized datagram: the batch is lost
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS && errno != EMSGSIZE &&
+                        errno != ECONNREFUSED && errno != EHOSTUNREACH && errno != ENETUNREACH) {
+                        perror("ERROR on sendmmsg");
+                        exit(1);
+                    }
+                    for (int i = sent; i < numMsgs; ++i)
+                        io_stats().sendDrops += m_msgSegments[i];
+                    sent = numMsgs;
+                    from = m_count;
+                    break;
+                }
+                for (int i = sent; i < sent + n; ++i)
+                    io_stats().sentPackets += m_msgSegments[i];
+                sent += n;
+            }
+            if (sent < numMsgs)
+                from = m_msgFirst[sent];
+            else
+                from = m_count;
+        }
+        m_count = 0;
+        m_used = 0;
+    }
+
+    bool gso() { return m_gso; }
+
+private:
+    struct QueuedPacket {
+        int offset;
+        int len;
+        struct sockaddr_in dest;
+    };
+
+    int m_sockfd;
+    bool m_gso;
+    char* m_buffer;
+    QueuedPacket m_packets[SEND_BATCH_PACKETS];
+    int m_count;
+    int m_used;
+
+    struct mmsghdr m_msgs[SEND_BATCH_PACKETS];
+    struct iovec m_iovs[SEND_BATCH_PACKETS];
+    char m_control[SEND_BATCH_PACKETS][CMSG_SPACE(sizeof(uint16_t))];
+    int m_msgFirst[SEND_BATCH_PACKETS];      // first queued packet in each message
+    int m_msgSegments[SEND_BATCH_PACKETS];   // queued packets in each message
+
+    static bool sameDest(const struct sockaddr_in& a, const struct sockaddr_in& b) {
+        return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+    }
+
+    // Turns the queued packets from index from onwards into messages.
+    // Returns the number of messages.
+    int build(int from) {
+        int numMsgs = 0;
+        int i = from;
+        while (i < m_count) {
+            QueuedPacket& first = m_packets[i];
+            int j = i + 1;
+            int bytes = first.len;
+            // a GSO run: same peer, same size, except that a shorter last one ends it
+            while (m_gso && j < m_count && j - i < GSO_MAX_SEGMENTS &&
+                   sameDest(m_packets[j].dest, first.dest) &&
+                   m_packets[j].len <= first.len && bytes + m_packets[j].len <= GSO_MAX_BYTES) {
+                bytes += m_packets[j].len;
+                j++;
+                if (m_packets[j - 1].len < first.len)
+                    break;
+            }
+
+            struct mmsghdr& msg = m_msgs[numMsgs];
+            memset(&msg, 0, sizeof(msg));
+            m_iovs[numMsgs].iov_base = m_buffer + first.offset;
+            m_iovs[numMsgs].iov_len = bytes;
+            msg.msg_hdr.msg_iov = &m_iovs[numMsgs];
+            msg.msg_hdr.msg_iovlen = 1;
+            msg.msg_hdr.msg_name = &first.dest;
+            msg.msg_hdr.msg_namelen = sizeof(first.dest);
+            if (j - i > 1) {
+                msg.msg_hdr.msg_control = m_control[numMsgs];
+                msg.msg_hdr.msg_controllen = sizeof(m_control[numMsgs]);
+                struct cmsghdr* cm = CMSG_FIRSTHDR(&msg.msg_hdr);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t segment = first.len;
+                memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+            }
+            m_msgFirst[numMsgs] = i;
+            m_msgSegments[numMsgs] = j - i;
+            numMsgs++;
+            i = j;
+        }
+        return numMsgs;
+    }
+
+    SendBatch(const SendBatch&);
+    SendBatch& operator=(const SendBatch&);
+};
+
+struct RecvSegment {
+    char* data;
+    int len;
+    struct sockaddr_in* from;
+};
+
+// Drains queued datagrams with recvmmsg. With GRO the kernel may hand over
+// a train of same-sized datagrams as one buffer; it is split back into
+// individual segments here.
+class RecvBatch {
+public:
+    RecvBatch(int sockfd, bool gro) {
+        m_sockfd = sockfd;
+        m_gro = false;
+        if (gro) {
+            int on = 1;
+            m_gro = setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+        }
+        m_bufferLen = m_gro ? GRO_BUFFER_LEN : FRAME_LEN;
+        m_buffer = (char*)malloc((size_t)RECV_BATCH_MESSAGES * m_bufferLen);
+        m_maxSegments = m_gro ? RECV_BATCH_MESSAGES * GSO_MAX_SEGMENTS : RECV_BATCH_MESSAGES;
+        m_segments = (RecvSegment*)malloc(m_maxSegments * sizeof(RecvSegment));
+        m_numSegments = 0;
+    }
+
+    ~RecvBatch() {
+        free(m_buffer);
+        free(m_segments);
+    }
+
+    // Receives whatever is queued, up to one batch. Returns the number of
+    // segments, 0 if nothing was waiting or an ICMP error was reported
+    // instead (see path_error_recv()), or -1 on error.
+    int recv() {
+        for (int i = 0; i < RECV_BATCH_MESSAGES; ++i) {
+            m_iovs[i].iov_base = m_buffer + (size_t)i * m_bufferLen;
+            m_iovs[i].iov_len = m_bufferLen;
+            memset(&m_msgs[i], 0, sizeof(m_msgs[i]));
+            m_msgs[i].msg_hdr.msg_iov = &m_iovs[i];
+            m_msgs[i].msg_hdr.msg_iovlen = 1;
+            m_msgs[i].msg_hdr.msg_name = &m_addrs[i];
+            m_msgs[i].msg_hdr.msg_namelen = sizeof(m_addrs[i]);
+            if (m_gro) {
+                m_msgs[i].msg_hdr.msg_control = m_control[i];
+                m_msgs[i].msg_hdr.msg_controllen = sizeof(m_control[i]);
+            }
+        }
+
+        m_numSegments = 0;
+        int n = recvmmsg(m_sockfd, m_msgs, RECV_BATCH_MESSAGES, 0, NULL);
+        io_stats().recvCalls++;
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EMSGSIZE ||
+                errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH)
+                return 0;
+            return -1;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            char* data = (char*)m_iovs[i].iov_base;
+            int len = m_msgs[i].msg_len;
+            int segment = len;
+            if (m_gro) {
+                for (struct cmsghdr* cm = CMSG_FIRSTHDR(&m_msgs[i].msg_hdr); cm; cm = CMSG_NXTHDR(&m_msgs[i].msg_hdr, cm)) {
+                    if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                        int size;
+                        memcpy(&size, CMSG_DATA(cm), sizeof(size));
+                        if (size > 0)
+                            segment = size;
+                    }
+                }
+            }
+            for (int off = 0; off < len && m_numSegments < m_maxSegments; off += segment) {
+                RecvSegment& seg = m_segments[m_numSegments++];
+                seg.data = data + off;
+                seg.len = len - off < segment ? len - off : segment;
+                seg.from = &m_addrs[i];
+            }
+            // an empty datagram is still a datagram
+            if (len == 0 && m_numSegments < m_maxSegments) {
+                RecvSegment& seg = m_segments[m_numSegments++];
+                seg.data = data;
+                seg.len = 0;
+                seg.from = &m_addrs[i];
+            }
+        }
+        io_stats().recvPackets += m_numSegments;
+        return m_numSegments;
+    }
+
+    RecvSegment& segment(int i) { return m_segments[i]; }
+    bool gro() { return m_gro; }
+
+private:
+    int m_sockfd;
+    bool m_gro;
+    char* m_buffer;
+    int m_bufferLen;
+    RecvSegment* m_segments;
+    int m_maxSegments;
+    int m_numSegments;
+
+    struct mmsghdr m_msgs[RECV_BATCH_MESSAGES];
+    struct iovec m_iovs[RECV_BATCH_MESSAGES];
+    struct sockaddr_in m_addrs[RECV_BATCH_MESSAGES];
+    char m_control[RECV_BATCH_MESSAGES][CMSG_SPACE(sizeof(int))];
+
+    RecvBatch(const RecvBatch&);
+    RecvBatch& operator=(const RecvBatch&);
+};
+
+#endif
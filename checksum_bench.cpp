@@ -0,0 +1,88 @@
+/* Microbenchmark for the packet checksums.
+Checks the CRC32C implementations against each other and the standard check
+value, then reports throughput in bytes/cycle for the legacy packet_hash and
+every CRC32C implementation this CPU supports.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <x86intrin.h>
+
+#include "Packet.h"
+
+#define BENCH_BYTES (64L * 1024 * 1024)
+
+volatile uint32_t sink;
+
+uint32_t
+legacy_hash(uint32_t crc, const char* data, size_t len) {
+    return packet_hash(crc, DATA_PACKET, data, len);
+}
+
+void
+bench(const char* name, crc32c_fn fn, const char* data, int len) {
+    long iterations = BENCH_BYTES / len;
+    uint32_t crc = 0;
+
+    // warm up caches and the crc32c tables
+    for (int i = 0; i < 16; ++i)
+        crc = fn(crc, data, len);
+
+    unsigned long long start = __rdtsc();
+    for (long i = 0; i < iterations; ++i)
+        crc = fn(crc, data, len);
+    unsigned long long cycles = __rdtsc() - start;
+    sink = crc;
+
+    printf("%-14s %6d bytes  %8.3f bytes/cycle\n", name, len, (double)(iterations * len) / cycles);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char* check = "123456789";
+    if (crc32c_sw(0, check, 9) != 0xE3069283) {
+        fprintf(stderr, "ERROR: slicing-by-8 crc32c check value mismatch\n");
+        exit(1);
+    }
+
+    int maxLen = 65536 + 8;
+    char* data = (char*)malloc(maxLen);
+    srand(1);
+    for (int i = 0; i < maxLen; ++i)
+        data[i] = rand();
+
+#ifdef CRC32C_HAVE_SSE42
+    bool haveHw = (crc32c_select() == crc32c_hw);
+    if (haveHw) {
+        // every length and alignment up to a few words, plus a large buffer
+        for (int offset = 0; offset < 8; ++offset) {
+            for (int len = 0; len < 100; ++len) {
+                if (crc32c_hw(7, data + offset, len) != crc32c_sw(7, data + offset, len)) {
+                    fprintf(stderr, "ERROR: crc32c mismatch at offset %d length %d\n", offset, len);
+                    exit(1);
+                }
+            }
+        }
+        if (crc32c_hw(0, data, 65536) != crc32c_sw(0, data, 65536)) {
+            fprintf(stderr, "ERROR: crc32c mismatch on 64 KB buffer\n");
+            exit(1);
+        }
+    }
+#endif
+
+    printf("crc32c dispatch: %s\n", crc32c_impl_name());
+
+    int lengths[] = { 64, DATA_LEN, 65536 };
+    for (int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+        bench("packet_hash", legacy_hash, data, lengths[i]);
+        bench("crc32c_sw", crc32c_sw, data, lengths[i]);
+#ifdef CRC32C_HAVE_SSE42
+        if (haveHw)
+            bench("crc32c_hw", crc32c_hw, data, lengths[i]);
+#endif
+    }
+
+    free(data);
+    return 0;
+}
@@ -18,141 +18,987 @@ process for each connection
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/fcntl.h>
+#include <sys/stat.h>
 #include <vector>
+#include <string>
+#include <time.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
 
 #include "Packet.h"
+#include "FileSink.h"
+#include "ReorderBuffer.h"
+#include "RttEstimator.h"
+#include "EventLoop.h"
+#include "UdpBatch.h"
+#include "DelayedAck.h"
+#include "Handshake.h"
+#include "PathMtu.h"
+#include "NetEmulator.h"
+#include "Log.h"
+#include "Trace.h"
+#include "Fec.h"
+#include "Checkpoint.h"
+#include "Compress.h"
 
 using namespace std;
 
+// downloads a batch (-b) keeps going at once, by default and at most
+#define BATCH_CONCURRENCY_DEFAULT 4
+#define MAX_BATCH_CONCURRENCY 64
+
+// where a download is
+#define DOWNLOAD_RUNNING 0      // requesting, or taking in data
+#define DOWNLOAD_CLOSING 1      // file written; waiting for the server's EOF ACK
+#define DOWNLOAD_DONE 2
+#define DOWNLOAD_FAILED 3
+
 void sigchld_handler(int s)
 {
     while(waitpid(-1, NULL, WNOHANG) > 0);
 }
 
+// set by SIGINT or SIGTERM while a checkpoint is being kept
+volatile sig_atomic_t interrupted = 0;
+
+void interrupt_handler(int s)
+{
+    interrupted = 1;
+}
+
 void error(char *msg)
 {
     perror(msg);
     exit(1);
 }
 
+// What the handshake settled. Wire sequence numbers are the server's ISN
+// plus a byte offset; everything below works in offsets. An old server
+// never answers with an ACCEPT and leaves these at their defaults.
+struct Connection {
+    uint32_t connId;
+    int64_t isn;            // ours, carried in every ACK's sequence number
+    int64_t serverIsn;
+    int wscale;             // applied to the window we advertise
+    int checksumType;
+    int fecBlock;           // data segments per FEC repair, 0 without FEC
+    int compress;           // COMPRESS_*, what the data stream is
+    int stripe;             // which part of the file this flow carries,
+    int stripes;            // of how many; 0 for the whole file
+    bool inPlace;           // writing part of an existing file, so don't truncate it
+    int64_t fileLength;     // the whole file as the server saw it, -1 if it didn't say
+    int64_t fileMtime;
+    bool accepted;
+};
+
+// What the command line asks of every download.
+struct DownloadConfig {
+    int64_t minRto;
+    int64_t maxRto;
+    int windowSegments;     // receive window, in segments
+    int mss;                // the largest segment our route to the server carries
+    int ackEvery;           // delayed ACK: every ackEvery segments or after ackDelay
+    int64_t ackDelay;
+    int checksumType;       // checksum to ask for; crc32c is always offered as a fallback
+    int fecBlock;           // FEC block to ask for, 0 for none
+    bool compress;
+    bool resume;            // keep a checkpoint, and pick up from one
+    int stripe;             // set in each -n flow
+    int stripes;
+    int64_t rangeOffset;    // part of the file to ask for; a length of 0 runs to the end
+    int64_t rangeLength;
+    const char* qlogDir;
+    bool quiet;             // a batch reports each file as it finishes instead
+};
+
+// One file on its way down: the handshake's outcome, where its bytes go,
+// and the timers and counters behind its ACKs. Downloads share the socket
+// and tell their packets apart by connection id.
+struct Download {
+    const DownloadConfig* config;
+    char* filename;
+    int state;              // DOWNLOAD_*
+    bool reported;
+    Connection conn;
+    // wire format spoken by the server; switched to binary once it answers in binary
+    int wireFormat;
+    // set when an old server skips the handshake and starts sending
+    bool legacyServer;
+    HandshakeOptions offer;
+    Packet* request;
+    CheckpointState resumeFrom;
+    bool resuming;
+    // set when -c asks to keep a checkpoint and resume from it
+    Checkpoint* checkpoint;
+    ReorderBuffer* reorderBuffer;
+    RttEstimator* rtt;
+    DelayedAck* delayedAck;
+    FileSink sink;
+    // set up once the server agrees to FEC
+    FecDecoder* fec;
+    // set once the server agrees to compress the stream
+    FrameDecoder* frames;
+    int64_t requestSentAt;
+    bool requestRetransmitted;
+    // last progress, or the last retransmission
+    int64_t t;
+    // when the first in-order data arrived, 0 until then
+    int64_t firstByteAt;
+    long outOfOrder;
+    int64_t expectedSeqNum;
+};
+
+// impairs incoming datagrams; off unless -e asks for it
+NetEmulator netem;
+
+// where -r appends the transfer summary, or NULL
+const char* reportPath = NULL;
+// set when -q asks for a trace
+TraceRing* traceRing = NULL;
+
+inline void
+trace(Download* d, int type, int flags, int64_t a = 0, int64_t b = 0, int64_t c = 0) {
+    if (traceRing)
+        traceRing->record(now_us(), d->conn.connId, type, flags, a, b, c);
+}
+
+// Progress a download reports on stdout, unless it is one of a batch.
+void
+note(Download* d, const char* format, ...) {
+    if (d->config->quiet)
+        return;
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
 void
-send_packet(Packet pkt, int sockfd, struct sockaddr_in destAddr) {
+send_packet(const Packet& pkt, int serverWireFormat, int sockfd, struct sockaddr_in destAddr) {
     if (pkt.isRequest()) {
         string request(pkt.getData(), pkt.getDataLen());
-        printf("Sending REQUEST with filename: %s\n", request.c_str());
-    }
-    else if (pkt.isACK()) {
-        printf("Sending ACK with ACKNUM: %d\n", pkt.getAckNum());
+        LOG("Sending REQUEST with filename: %s\n", request.c_str());
     }
     else if (pkt.isEOF_ACK()) {
-        printf("Sending EOF ACK\n");
+        LOG("Sending EOF ACK\n");
     }
 
-    int serializedLength;
-    char* buffer = pkt.serialize(&serializedLength);
+    // requests always go out in the legacy format so old servers can parse them
+    int wireFormat = pkt.isRequest() ? WIRE_LEGACY : serverWireFormat;
+    char buffer[FRAME_LEN];
+    int serializedLength = pkt.serialize(buffer, sizeof(buffer), wireFormat);
+    if (serializedLength < 0) {
+        error("ERROR: packet too large to serialize");
+    }
     int bytesSent = sendto(sockfd, (void*)buffer, serializedLength, 0, (struct sockaddr *)&destAddr, sizeof(destAddr));
-    free(buffer);
 
     if (bytesSent < 0) {
         error("ERROR on sending packet");
     }
 }
 
+// Sends a cumulative ACK, followed by SACK blocks for any early segments
+// we're holding. The header advertises how far past the ACK we can buffer.
+// Anything the delayed ACK policy was holding back is covered by it.
 void
-save_file_and_exit(vector<Packet> packets, char* filename, int sockfd, struct sockaddr_in destAddr) {
-    FILE* file = fopen(filename, "w");
-    if (!file) {
+send_ack(Download* d, SendBatch* out, struct sockaddr_in destAddr) {
+    SackBlock blocks[MAX_SACK_BLOCKS];
+    int numBlocks = d->reorderBuffer->sackBlocks(blocks, MAX_SACK_BLOCKS);
+
+    LOG("Sending ACK with ACKNUM: %lld", (long long)d->expectedSeqNum);
+    for (int i = 0; i < numBlocks; ++i) {
+        LOG(" SACK %lld-%lld", (long long)blocks[i].start, (long long)blocks[i].end);
+        blocks[i].start += d->conn.serverIsn;
+        blocks[i].end += d->conn.serverIsn;
+    }
+    LOG("\n");
+    char sack[MAX_SACK_BLOCKS * SACK_BLOCK_LEN];
+    int sackLen = sack_encode(sack, sizeof(sack), blocks, numBlocks);
+
+    int64_t window = d->reorderBuffer->window() >> d->conn.wscale;
+    if (window > WIRE_MAX_WINDOW)
+        window = WIRE_MAX_WINDOW;
+
+    char* buffer = out->next();
+    int serializedLength = packet_encode(buffer, FRAME_LEN, d->wireFormat, d->conn.accepted ? d->conn.isn : -1,
+                                         d->conn.serverIsn + d->expectedSeqNum, sack, sackLen, window, d->conn.connId,
+                                         d->conn.checksumType);
+    out->commit(serializedLength, destAddr);
+    d->delayedAck->onAckSent();
+    trace(d, TRACE_PACKET_SENT, TRACE_FLAG_ACK, d->expectedSeqNum, sackLen);
+}
+
+// Returns false if the file couldn't be opened or written.
+bool
+write_segment(Download* d, int64_t seqNum, const char* data, int dataLen) {
+    // opened on the first data segment so a failed request leaves no file
+    // behind; parallel flows share a file their parent already created
+    if (!d->sink.isOpen() && !d->sink.open(d->filename, !d->conn.inPlace)) {
+        perror("ERROR: could not open file for writing");
+        return false;
+    }
+    // a compressed stream is written a frame at a time, wherever each one goes
+    if (d->frames) {
+        if (!d->frames->write(&d->sink, data, dataLen)) {
+            fprintf(stderr, "ERROR: bad compressed frame or write failed\n");
+            return false;
+        }
+        return true;
+    }
+    if (!d->sink.write(seqNum, data, dataLen)) {
+        perror("ERROR: writing to file failed");
+        return false;
+    }
+    return true;
+}
+
+// Saves how far the in-order data has got, once enough has been written
+// since the last save. Only done when the server said which version of the
+// file it is sending, so a resume can tell whether it still applies.
+void
+save_checkpoint(Download* d, bool force) {
+    // compressed, the file is contiguous up to the end of the last whole frame
+    int64_t offset = d->frames ? d->frames->rawEnd() : d->sink.base() + d->expectedSeqNum;
+    if (!d->checkpoint || d->conn.fileLength < 0 || offset < 0 || !d->sink.isOpen() || (!force && !d->checkpoint->due(offset)))
+        return;
+    CheckpointState state;
+    state.offset = offset;
+    state.fileLength = d->conn.fileLength;
+    state.fileMtime = d->conn.fileMtime;
+    if (!d->sink.sync() || !d->checkpoint->save(state))
+        perror("checkpoint");
+}
+
+// Splits the download into numStreams flows, each in its own process with
+// its own socket, connection and congestion state, writing its stripe of
+// the file in place. Returns in each child with config->stripe set; the
+// parent waits for all of them and exits.
+void
+fork_streams(int numStreams, const char* filename, DownloadConfig* config) {
+    // a range is written into whatever the file already holds
+    bool inPlace = config->rangeOffset > 0 || config->rangeLength > 0;
+    int fd = open(filename, O_WRONLY | O_CREAT | (inPlace ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
         error("ERROR: could not open file for writing");
     }
+    close(fd);
+    int64_t start = now_us();
+    pid_t pids[MAX_STRIPES];
+    for (int i = 0; i < numStreams; ++i) {
+        fflush(stdout);
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            error("ERROR on fork");
+        }
+        if (pids[i] == 0) {
+            config->stripe = i;
+            config->stripes = numStreams;
+            return;
+        }
+    }
+    int failed = 0;
+    for (int i = 0; i < numStreams; ++i) {
+        int status;
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    }
+    printf("%d streams finished in %lld ms, %d failed\n", numStreams, (long long)(now_us() - start) / 1000, failed);
+    exit(failed ? 1 : 0);
+}
 
-    int fileLength = 0;
-    for (int i = 0; i < packets.size(); i++) {
-        fileLength += packets[i].getDataLen();
+// Creates the directories a file name passes through, like mkdir -p.
+void
+make_parent_dirs(const char* filename) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", filename);
+    for (char* p = path + 1; *p; ++p) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        mkdir(path, 0755);
+        *p = '/';
     }
+}
+
+// Reads the files a manifest names, one per line ("-" reads them from
+// stdin); blank lines and # comments are skipped.
+void
+read_manifest(const char* manifest, vector<string>* names) {
+    FILE* f = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (!f) {
+        error("ERROR opening manifest");
+    }
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0' && line[0] != '#')
+            names->push_back(line);
+    }
+    if (f != stdin)
+        fclose(f);
+}
 
-    char* buffer = (char*)malloc(fileLength);
-    int totalSize = 0;
-    for (int i = 0; i < packets.size(); ++i) {
-        for (int j = 0; j < packets[i].getDataLen(); ++j) {
-            buffer[totalSize + j] = packets[i].getData()[j];
+// Appends one JSON line summing up the transfer, for benchmarks. Times run
+// from when the request was first sent.
+void
+write_report(Download* d, int64_t bytes, int64_t firstByteUs, int64_t durationUs) {
+    FILE* f = fopen(reportPath, "a");
+    if (!f) {
+        perror("transfer report");
+        return;
+    }
+    fprintf(f, "{\"conn\": \"%08x\", \"bytes\": %lld, \"ttfbUs\": %lld, \"durationUs\": %lld, \"rttUs\": %lld, "
+               "\"segments\": %ld, \"acks\": %ld, \"outOfOrder\": %ld, \"fecRecovered\": %ld, \"rawBytes\": %lld, \"decompressUs\": %lld}\n",
+        d->conn.connId, (long long)bytes, (long long)firstByteUs, (long long)durationUs, (long long)d->rtt->lastRtt(),
+        d->delayedAck->segments(), d->delayedAck->acks(), d->outOfOrder, d->fec ? d->fec->recovered() : 0,
+        (long long)(d->frames ? d->frames->rawBytes() : bytes), (long long)(d->frames ? d->frames->cpuUs() : 0));
+    fclose(f);
+}
+
+// Writes the trace to dir/<conn>.qlog.
+void
+write_qlog(Download* d, const char* dir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%08x.qlog", dir, d->conn.connId);
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror("qlog");
+        return;
+    }
+    traceRing->writeQlog(f, &d->conn.connId, "client");
+    fclose(f);
+}
+
+// Sets up a download of filename and sends its request. Returns NULL if it
+// can't even be asked for.
+Download*
+download_start(const char* filename, const DownloadConfig& config, int sockfd, struct sockaddr_in destAddr) {
+    Download* d = new Download();
+    d->config = &config;
+    d->filename = strdup(filename);
+    d->state = DOWNLOAD_RUNNING;
+    d->reported = false;
+    d->wireFormat = WIRE_LEGACY;
+    d->legacyServer = false;
+    d->request = NULL;
+    d->requestSentAt = now_us();
+    d->t = d->requestSentAt;
+    d->resuming = false;
+    d->checkpoint = NULL;
+    d->reorderBuffer = new ReorderBuffer(config.windowSegments, config.mss);
+    d->rtt = new RttEstimator(TIMEOUT * 1000L, config.minRto, config.maxRto);
+    d->delayedAck = new DelayedAck(config.ackEvery, config.ackDelay);
+    d->fec = NULL;
+    d->frames = NULL;
+    d->requestRetransmitted = false;
+    d->firstByteAt = 0;
+    d->outOfOrder = 0;
+    d->expectedSeqNum = 0;
+
+    // handshake options ride after the file name's NUL, where old servers
+    // won't look
+    Connection& conn = d->conn;
+    conn.connId = handshake_conn_id();
+    conn.isn = handshake_isn();
+    conn.serverIsn = INITIAL_SEQ_NUM;
+    conn.wscale = 0;
+    conn.checksumType = CHECKSUM_CRC32C;
+    conn.fecBlock = 0;
+    conn.compress = COMPRESS_NONE;
+    conn.stripe = config.stripe;
+    conn.stripes = config.stripes;
+    conn.inPlace = config.stripes > 0 || config.rangeOffset > 0 || config.rangeLength > 0;
+    conn.fileLength = -1;
+    conn.fileMtime = 0;
+    conn.accepted = false;
+
+    int64_t rangeOffset = config.rangeOffset;
+    int64_t rangeLength = config.rangeLength;
+    if (config.resume) {
+        d->checkpoint = new Checkpoint();
+        if (!d->checkpoint->setPath(filename)) {
+            fprintf(stderr,"ERROR, file name too long\n");
+            d->state = DOWNLOAD_FAILED;
+            return d;
+        }
+        // pick up after the bytes an earlier run got onto the disk, provided
+        // the file is still as long as the checkpoint says it got
+        struct stat st;
+        if (d->checkpoint->load(&d->resumeFrom) && stat(filename, &st) == 0 && st.st_size >= d->resumeFrom.offset &&
+            d->resumeFrom.offset > rangeOffset && (rangeLength == 0 || d->resumeFrom.offset < rangeOffset + rangeLength)) {
+            if (rangeLength > 0)
+                rangeLength -= d->resumeFrom.offset - rangeOffset;
+            rangeOffset = d->resumeFrom.offset;
+            d->resuming = true;
+            conn.inPlace = true;
+            note(d, "Resuming %s at byte %lld\n", filename, (long long)rangeOffset);
         }
-        totalSize += packets[i].getDataLen();
     }
 
-    int bytesWritten = fwrite(buffer, sizeof(char), fileLength, file);
-    if (bytesWritten != fileLength) {
-        error("ERROR: writing to file failed");
+    HandshakeOptions& offer = d->offer;
+    handshake_options_init(&offer);
+    offer.connId = conn.connId;
+    offer.isn = conn.isn;
+    offer.mss = config.mss;
+    offer.wscale = window_scale_for(d->reorderBuffer->window());
+    offer.sack = true;
+    offer.checksums[offer.numChecksums++] = config.checksumType;
+    if (config.checksumType != CHECKSUM_CRC32C)
+        offer.checksums[offer.numChecksums++] = CHECKSUM_CRC32C;
+    offer.fecBlock = config.fecBlock;
+    offer.stripe = conn.stripe;
+    offer.stripes = conn.stripes;
+    offer.compress = config.compress ? COMPRESS_LZ4 : COMPRESS_NONE;
+    if (rangeOffset > 0 || rangeLength > 0) {
+        offer.range = true;
+        offer.rangeOffset = rangeOffset;
+        offer.rangeLength = rangeLength;
     }
 
-    free(buffer);
-    fclose(file);
+    int nameLen = strlen(filename) + 1;
+    // kept within the fixed segment size old servers expect
+    char request[DATA_LEN];
+    if (nameLen > (int)sizeof(request) - MAX_OPTIONS_LEN) {
+        fprintf(stderr,"ERROR, file name too long\n");
+        d->state = DOWNLOAD_FAILED;
+        return d;
+    }
+    memcpy(request, filename, nameLen);
+    int requestLen = nameLen + handshake_options_encode(request + nameLen, sizeof(request) - nameLen, &offer);
+    // the sequence number of a request carries our capability flags
+    d->request = new Packet(REQUEST_FLAG_BINARY | REQUEST_FLAG_SACK | REQUEST_FLAG_HANDSHAKE, REQUEST_PACKET, request, requestLen);
 
-    Packet ackPkt(-1, EOF_ACK, NULL, 0);
-    send_packet(ackPkt, sockfd, destAddr);
+    send_packet(*d->request, d->wireFormat, sockfd, destAddr);
 
-    struct timeval timeVal;
-    gettimeofday(&timeVal, NULL);
-    long t = timeVal.tv_usec/1000 + timeVal.tv_sec*1000;
-    char packetData[2048];
-    while (1) {
-        struct sockaddr_in servAddr;
-        socklen_t servLen = sizeof(servAddr);
-        int packetDataLength = recvfrom(sockfd, packetData, 2048, 0, (struct sockaddr *) &servAddr, &servLen);
+    // The request/first reply round trip is our only RTT sample; it is
+    // dropped if the request had to be retransmitted (Karn's rule).
+    d->requestSentAt = now_us();
+    d->t = d->requestSentAt;
+    return d;
+}
 
-        int r = (rand() % 100) + 1;
-        if (r <= PROBABILITY_PACKET_LOST * 100) {
-            continue;
+void
+download_destroy(Download* d) {
+    free(d->filename);
+    delete d->request;
+    delete d->checkpoint;
+    delete d->reorderBuffer;
+    delete d->rtt;
+    delete d->delayedAck;
+    delete d->fec;
+    delete d->frames;
+    delete d;
+}
+
+// when the download next needs its timer: a held-back ACK, or the
+// retransmission of whatever it is waiting on
+int64_t
+download_deadline(Download* d) {
+    int64_t deadline = d->t + d->rtt->rto();
+    if (d->state == DOWNLOAD_RUNNING && d->delayedAck->pending() && d->delayedAck->deadline() < deadline)
+        deadline = d->delayedAck->deadline();
+    return deadline;
+}
+
+void
+download_on_timer(Download* d, int64_t now, int sockfd, SendBatch* out, struct sockaddr_in destAddr) {
+    if (d->state == DOWNLOAD_CLOSING) {
+        if (now - d->t >= d->rtt->rto()) {
+            d->rtt->onTimeout();
+            Packet eofAckPkt(-1, EOF_ACK, NULL, 0, d->conn.connId);
+            LOG("TIMEOUT waiting for EOF ACK. RETRANSMISSION: ");
+            send_packet(eofAckPkt, d->wireFormat, sockfd, destAddr);
+            d->t = now;
         }
-        r = (rand() % 100) + 1;
-        if (r <= PROBABILITY_PACKET_CORRUPT * 100) {
-            continue;
+        return;
+    }
+    if (d->delayedAck->expired(now))
+        send_ack(d, out, destAddr);
+    if (now - d->t >= d->rtt->rto()) {
+        d->rtt->onTimeout();
+        LOG("TIMEOUT waiting for data, RTO backed off to %lld ms\n", (long long)d->rtt->rto() / 1000);
+        if (d->expectedSeqNum == 0 && !d->conn.accepted) {
+            d->requestRetransmitted = true;
+            LOG("RETRANSMISSION: ");
+            send_packet(*d->request, d->wireFormat, sockfd, destAddr);
         }
+        else {
+            LOG("RETRANSMISSION: ");
+            send_ack(d, out, destAddr);
+        }
+        d->t = now;
+    }
+}
+
+// The last of the file is in: reports on it, closes the file and tells the
+// server with an EOF ACK, which is repeated until the server's comes back.
+void
+download_finish(Download* d, int sockfd, struct sockaddr_in destAddr) {
+    if (d->frames && d->frames->midFrame()) {
+        fprintf(stderr, "ERROR: compressed stream ended partway through a frame\n");
+        d->state = DOWNLOAD_FAILED;
+        return;
+    }
+    note(d, "Sent %ld ACKs for %ld in-order segments\n", d->delayedAck->acks(), d->delayedAck->segments());
+    if (d->frames)
+        note(d, "Decompressed %lld bytes from %lld (%.2fx) in %lld us\n", (long long)d->frames->rawBytes(),
+            (long long)d->expectedSeqNum, d->expectedSeqNum > 0 ? (double)d->frames->rawBytes() / d->expectedSeqNum : 0.0,
+            (long long)d->frames->cpuUs());
+    if (d->fec)
+        note(d, "Rebuilt %ld segments from FEC\n", d->fec->recovered());
+    if (reportPath)
+        write_report(d, d->expectedSeqNum, d->firstByteAt - d->requestSentAt, now_us() - d->requestSentAt);
+    if (traceRing) {
+        trace(d, TRACE_CONNECTION_CLOSED, 0);
+        write_qlog(d, d->config->qlogDir);
+    }
+    if (!d->sink.close()) {
+        perror("ERROR: writing to file failed");
+        d->state = DOWNLOAD_FAILED;
+        return;
+    }
+
+    Packet ackPkt(-1, EOF_ACK, NULL, 0, d->conn.connId);
+    send_packet(ackPkt, d->wireFormat, sockfd, destAddr);
+    d->state = DOWNLOAD_CLOSING;
+    d->t = now_us();
+}
 
-        if (packetDataLength < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                error("ERROR on recvfrom");
+// Takes one packet from the server meant for d.
+void
+download_on_packet(Download* d, PacketView& pkt, int sockfd, SendBatch* out, struct sockaddr_in destAddr) {
+    Connection& conn = d->conn;
+    const DownloadConfig& config = *d->config;
+    if (d->state == DOWNLOAD_CLOSING) {
+        if (!pkt.isCorrupt() && pkt.isEOF_ACK() && pkt.getConnId() == conn.connId)
+            d->state = DOWNLOAD_DONE;
+        return;
+    }
+    // stale packets from an earlier connection, or the wrong format for this one
+    if (pkt.getWireFormat() == WIRE_BINARY ? d->legacyServer : conn.accepted)
+        return;
+    if (d->rtt->numSamples() == 0 && !d->requestRetransmitted && !pkt.isCorrupt()) {
+        d->rtt->sample(now_us() - d->requestSentAt);
+        note(d, "RTT sample %lld us, RTO %lld us\n", (long long)d->rtt->lastRtt(), (long long)d->rtt->rto());
+        trace(d, TRACE_RTT_UPDATED, 0, d->rtt->lastRtt(), d->rtt->srtt(), d->rtt->rttvar());
+    }
+    if (pkt.isNotFound() && !pkt.isCorrupt()) {
+        fprintf(stderr, "ERROR, %s not found on server\n", d->filename);
+        d->state = DOWNLOAD_FAILED;
+        return;
+    }
+    if (pkt.isAccept() && !pkt.isCorrupt()) {
+        HandshakeOptions opts;
+        if (d->legacyServer || !handshake_options_decode(pkt.getData(), pkt.getDataLen(), &opts) ||
+            opts.connId != conn.connId || opts.isn != conn.isn)
+            return;
+        if (!conn.accepted) {
+            conn.accepted = true;
+            conn.serverIsn = pkt.getSeqNum();
+            if (opts.mss > 0)
+                d->reorderBuffer->setSegmentLen(opts.mss);
+            if (opts.wscale >= 0)
+                conn.wscale = d->offer.wscale;
+            if (opts.numChecksums > 0 && (opts.checksums[0] == config.checksumType || opts.checksums[0] == CHECKSUM_CRC32C))
+                conn.checksumType = opts.checksums[0];
+            // a server that can't split files sends all of it to every flow
+            if (conn.stripes > 0 && !opts.range && conn.stripe > 0) {
+                note(d, "Server can't split the file, leaving it to the first stream\n");
+                d->state = DOWNLOAD_DONE;
+                return;
+            }
+            if (opts.fileInfo) {
+                conn.fileLength = opts.fileLength;
+                conn.fileMtime = opts.fileMtime;
+            }
+            // the bytes already here came from another version of the file
+            if (d->resuming && opts.range && (!opts.fileInfo || opts.fileLength != d->resumeFrom.fileLength ||
+                                              opts.fileMtime != d->resumeFrom.fileMtime)) {
+                fprintf(stderr, "ERROR, %s changed on the server since the checkpoint; run again to start over\n", d->filename);
+                d->checkpoint->remove();
+                d->state = DOWNLOAD_FAILED;
+                return;
+            }
+            // otherwise the server sends the whole file, which lands at offset 0;
+            // compressed frames carry their own offsets
+            if (opts.range) {
+                if (opts.compress == COMPRESS_NONE)
+                    d->sink.setBase(opts.rangeOffset);
+                if (conn.stripes > 0)
+                    note(d, "Stream %d of %d carries bytes %lld-%lld\n", conn.stripe, conn.stripes,
+                        (long long)opts.rangeOffset, (long long)(opts.rangeOffset + opts.rangeLength));
+                else
+                    note(d, "Server sends bytes %lld-%lld\n",
+                        (long long)opts.rangeOffset, (long long)(opts.rangeOffset + opts.rangeLength));
+            }
+            else if (d->offer.range) {
+                note(d, "Server can't send part of a file, fetching all of it\n");
             }
-            gettimeofday(&timeVal, NULL);
-            long now = timeVal.tv_usec/1000 + timeVal.tv_sec*1000;
-            // check for timeout, otherwise just go back and try recvfrom again
-            if (now - t > TIMEOUT) {
-                Packet eofAckPkt(-1, EOF_ACK, NULL, 0);
-                printf("TIMEOUT waiting for EOF ACK. RETRANSMISSION: ");
-                send_packet(eofAckPkt, sockfd, destAddr);
-                t = now;
+            if (opts.fecBlock > 0 && config.fecBlock > 0) {
+                conn.fecBlock = opts.fecBlock;
+                d->fec = new FecDecoder();
             }
+            if (opts.compress == COMPRESS_LZ4 && config.compress) {
+                conn.compress = COMPRESS_LZ4;
+                // FEC reads back up to a block of the stream
+                d->frames = new FrameDecoder(d->fec ? conn.fecBlock * d->offer.mss : 0);
+                if (opts.range)
+                    d->frames->clip(opts.rangeOffset, opts.rangeLength);
+            }
+            d->wireFormat = WIRE_BINARY;
+            note(d, "Connection %08x accepted, mss %d, window scale %d, checksum %s, fec %d, compression %s\n",
+                conn.connId, opts.mss, conn.wscale, checksum_name(conn.checksumType), conn.fecBlock,
+                conn.compress == COMPRESS_LZ4 ? "lz4" : "none");
+            trace(d, TRACE_CONNECTION_STARTED, 0);
+        }
+        else if (pkt.getSeqNum() != conn.serverIsn) {
+            return;
         }
-        else if (packetDataLength > 0) {
-            if (servAddr.sin_port == destAddr.sin_port && servAddr.sin_addr.s_addr == destAddr.sin_addr.s_addr) {
-                Packet pkt(packetData, packetDataLength);
-                if (!pkt.isCorrupt() && pkt.isEOF_ACK()) {
-                    exit(0);
+        // a repeated ACCEPT means our ACK was lost
+        d->t = now_us();
+        send_ack(d, out, destAddr);
+        return;
+    }
+    // set when this packet lets the in-order data move on
+    bool advanced = false;
+    bool eof = false;
+    if (pkt.isRepair()) {
+        if (!d->fec || pkt.getChecksumType() != conn.checksumType || pkt.isCorrupt())
+            return;
+        d->fec->add(pkt.getSeqNum() - conn.serverIsn, pkt.getWindow(), pkt.getData(), pkt.getDataLen());
+        int64_t seqNum;
+        int dataLen;
+        bool rebuilt = false;
+        char fecBuffer[MAX_DATA_LEN];
+        while (d->frames ? d->fec->recover(d->expectedSeqNum, *d->reorderBuffer, *d->frames, &seqNum, fecBuffer, &dataLen)
+                         : d->fec->recover(d->expectedSeqNum, *d->reorderBuffer, d->sink, &seqNum, fecBuffer, &dataLen)) {
+            LOG("Rebuilt segment at SEQ number %lld from FEC\n", (long long)seqNum);
+            trace(d, TRACE_PACKET_RECEIVED, TRACE_FLAG_REPAIRED, seqNum, dataLen);
+            rebuilt = true;
+            if (seqNum + dataLen <= d->expectedSeqNum)
+                continue;
+            if (seqNum <= d->expectedSeqNum) {
+                int skip = d->expectedSeqNum - seqNum;
+                if (!write_segment(d, d->expectedSeqNum, fecBuffer + skip, dataLen - skip)) {
+                    d->state = DOWNLOAD_FAILED;
+                    return;
                 }
+                d->expectedSeqNum += dataLen - skip;
+                advanced = true;
+            }
+            else {
+                d->reorderBuffer->insert(seqNum, fecBuffer, dataLen, false);
             }
         }
+        // let the sender know what no longer needs retransmitting
+        if (rebuilt && !advanced)
+            send_ack(d, out, destAddr);
+    }
+    else if (pkt.isData()) {
+        // binary data only flows once we've ACKed the ACCEPT, under the agreed checksum
+        if (pkt.getWireFormat() == WIRE_BINARY && (!conn.accepted || pkt.getChecksumType() != conn.checksumType))
+            return;
+        if (pkt.getWireFormat() == WIRE_LEGACY && !d->legacyServer && !pkt.isCorrupt()) {
+            note(d, "Server skipped the handshake, falling back to the legacy protocol\n");
+            if (conn.stripe > 0) {
+                note(d, "Server can't split the file, leaving it to the first stream\n");
+                d->state = DOWNLOAD_DONE;
+                return;
+            }
+            d->legacyServer = true;
+            conn.connId = 0;
+        }
+        int64_t seqNum = pkt.getSeqNum() - conn.serverIsn;
+        trace(d, TRACE_PACKET_RECEIVED, pkt.isEOF() ? TRACE_FLAG_EOF : 0, seqNum, pkt.getDataLen());
+        if (seqNum == d->expectedSeqNum && !pkt.isCorrupt()) {
+            LOG("Got DATA packet with SEQ number: %lld\n", (long long)seqNum);
+            if (!write_segment(d, d->expectedSeqNum, pkt.getData(), pkt.getDataLen())) {
+                d->state = DOWNLOAD_FAILED;
+                return;
+            }
+            d->expectedSeqNum += pkt.getDataLen();
+            eof = pkt.isEOF();
+            advanced = true;
+        }
+        else {
+            // Only binary packets are buffered: the legacy hash
+            // can't reliably detect a damaged sequence number.
+            if (seqNum > d->expectedSeqNum && !pkt.isCorrupt() && pkt.getWireFormat() == WIRE_BINARY) {
+                d->reorderBuffer->insert(seqNum, pkt.getData(), pkt.getDataLen(), pkt.isEOF());
+            }
+            LOG("Got out of order packet. Resending ACK with ACKNUM %lld\n", (long long)d->expectedSeqNum);
+            d->outOfOrder++;
+            send_ack(d, out, destAddr);
+        }
+    }
+
+    if (advanced) {
+        if (d->firstByteAt == 0)
+            d->firstByteAt = now_us();
+
+        // the segment may have filled a hole; flush what was buffered behind it
+        const char* data;
+        int dataLen;
+        bool filledHole = false;
+        while (!eof && d->reorderBuffer->pop(d->expectedSeqNum, &data, &dataLen, &eof)) {
+            LOG("Writing buffered data at SEQ number: %lld\n", (long long)d->expectedSeqNum);
+            if (!write_segment(d, d->expectedSeqNum, data, dataLen)) {
+                d->state = DOWNLOAD_FAILED;
+                return;
+            }
+            d->expectedSeqNum += dataLen;
+            filledHole = true;
+        }
+        bool ackNow = d->delayedAck->onSegment(now_us());
+        if (eof && d->checkpoint)
+            d->checkpoint->remove();
+        else
+            save_checkpoint(d, false);
+        if (eof) {
+            download_finish(d, sockfd, destAddr);
+            return;
+        }
+        d->rtt->onProgress();
+        d->t = now_us();
+        // the sender is recovering from loss while holes remain; don't keep it waiting
+        if (ackNow || filledHole || !pkt.isData() || d->reorderBuffer->size() > 0)
+            send_ack(d, out, destAddr);
     }
 }
 
+// Finds the download a packet belongs to, or NULL. A legacy server doesn't
+// carry connection ids, so its packets can only go to a lone download.
+Download*
+find_download(vector<Download*>& downloads, PacketView& pkt) {
+    if (pkt.getWireFormat() == WIRE_BINARY) {
+        for (size_t i = 0; i < downloads.size(); ++i) {
+            if (downloads[i]->conn.connId == pkt.getConnId() && !downloads[i]->legacyServer)
+                return downloads[i];
+        }
+        return NULL;
+    }
+    if (downloads.size() == 1)
+        return downloads[0];
+    if (!pkt.isCorrupt()) {
+        fprintf(stderr, "ERROR, the server skipped the handshake and can't tell downloads apart; use -j 1\n");
+        exit(1);
+    }
+    return NULL;
+}
+
 int main(int argc, char *argv[])
 {
     srand(time(0));
     int sockfd, portno;
-    struct sockaddr_in recvAddr, servAddr;
-    socklen_t servLen = sizeof(servAddr);
+    struct sockaddr_in recvAddr;
     struct sigaction sa;          // for signal SIGCHLD
 
-    if (argc < 4) {
+    // RTO bounds in milliseconds
+    long minRtoMs = RTO_MIN_DEFAULT / 1000;
+    long maxRtoMs = RTO_MAX_DEFAULT / 1000;
+    // receive window, in segments
+    int windowSegments = REORDER_SLOTS;
+    // delayed ACK: every ackEvery segments or after ackDelayMs
+    int ackEvery = ACK_EVERY_DEFAULT;
+    long ackDelayMs = ACK_DELAY_DEFAULT / 1000;
+    // checksum to ask for; crc32c is always offered as a fallback
+    int checksumType = CHECKSUM_CRC32C;
+    // cap on the segment size we offer; the route's MTU caps it too
+    int maxSegment = MAX_DATA_LEN;
+    NetEmulatorConfig netemConfig;
+    net_emulator_config_init(&netemConfig);
+    const char* qlogDir = NULL;
+    // FEC block to ask for, 0 for none
+    int fecBlock = 0;
+    // parallel flows to split the file across
+    int numStreams = 1;
+    // part of the file to ask for; a length of 0 runs to the end
+    int64_t rangeOffset = 0;
+    int64_t rangeLength = 0;
+    bool resume = false;
+    bool compress = false;
+    // file listing the files to fetch, and how many to fetch at once
+    const char* manifest = NULL;
+    int concurrency = BATCH_CONCURRENCY_DEFAULT;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:M:w:a:d:k:s:e:r:q:f:n:o:l:czb:j:v")) != -1) {
+        switch (opt) {
+        case 'm':
+            minRtoMs = atol(optarg);
+            break;
+        case 'M':
+            maxRtoMs = atol(optarg);
+            break;
+        case 'w':
+            windowSegments = atoi(optarg);
+            if (windowSegments < 1) {
+                fprintf(stderr,"ERROR, window must be at least one segment\n");
+                exit(1);
+            }
+            break;
+        case 'a':
+            ackEvery = atoi(optarg);
+            break;
+        case 'd':
+            ackDelayMs = atol(optarg);
+            break;
+        case 'k':
+            if (strcmp(optarg, checksum_name(CHECKSUM_CRC32C)) == 0)
+                checksumType = CHECKSUM_CRC32C;
+            else if (strcmp(optarg, checksum_name(CHECKSUM_NONE)) == 0)
+                checksumType = CHECKSUM_NONE;
+            else {
+                fprintf(stderr,"ERROR, unknown checksum %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            maxSegment = atoi(optarg);
+            if (maxSegment < PMTU_BASE_MSS || maxSegment > MAX_DATA_LEN) {
+                fprintf(stderr,"ERROR, segment size must be between %d and %d\n", PMTU_BASE_MSS, MAX_DATA_LEN);
+                exit(1);
+            }
+            break;
+        case 'e':
+            if (!net_emulator_config_parse(&netemConfig, optarg)) {
+                fprintf(stderr,"ERROR, bad impairment spec %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            reportPath = optarg;
+            break;
+        case 'q':
+            qlogDir = optarg;
+            break;
+        case 'f':
+            fecBlock = atoi(optarg);
+            if (fecBlock < 0 || fecBlock > FEC_MAX_BLOCK) {
+                fprintf(stderr,"ERROR, FEC block must be between 1 and %d segments\n", FEC_MAX_BLOCK);
+                exit(1);
+            }
+            break;
+        case 'n':
+            numStreams = atoi(optarg);
+            if (numStreams < 1 || numStreams > MAX_STRIPES) {
+                fprintf(stderr,"ERROR, streams must be between 1 and %d\n", MAX_STRIPES);
+                exit(1);
+            }
+            break;
+        case 'o':
+            rangeOffset = atoll(optarg);
+            if (rangeOffset < 0) {
+                fprintf(stderr,"ERROR, offset can't be negative\n");
+                exit(1);
+            }
+            break;
+        case 'l':
+            rangeLength = atoll(optarg);
+            if (rangeLength < 1) {
+                fprintf(stderr,"ERROR, length must be at least one byte\n");
+                exit(1);
+            }
+            break;
+        case 'c':
+            resume = true;
+            break;
+        case 'z':
+            compress = true;
+            break;
+        case 'b':
+            manifest = optarg;
+            break;
+        case 'j':
+            concurrency = atoi(optarg);
+            if (concurrency < 1 || concurrency > MAX_BATCH_CONCURRENCY) {
+                fprintf(stderr,"ERROR, concurrency must be between 1 and %d\n", MAX_BATCH_CONCURRENCY);
+                exit(1);
+            }
+            break;
+        case 'v':
+            verbose_logging() = true;
+            break;
+        default:
+            fprintf(stderr,"usage: %s [-m min_rto_ms] [-M max_rto_ms] [-w window_segments] [-a ack_every] [-d ack_delay_ms] [-k crc32c|none] [-s max_segment] [-e impairment] [-r report_file] [-q qlog_dir] [-f fec_block] [-n streams] [-o offset] [-l length] [-c] [-z] [-b manifest] [-j concurrency] [-v] hostname port [filename]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (argc - optind < (manifest ? 2 : 3)) {
         fprintf(stderr,"ERROR, usage incorrect\n");
         exit(1);
     }
+    if (manifest && (numStreams > 1 || rangeOffset > 0 || rangeLength > 0)) {
+        fprintf(stderr,"ERROR, -b can't be combined with -n, -o or -l\n");
+        exit(1);
+    }
+
+    // server info, resolved once however many processes go on to use it
+    int serverPort = atoi(argv[optind + 1]);
+    char* serverName = argv[optind];
+
+    // resolve hostname using DNS
+    hostent *server = gethostbyname(serverName);
+
+    if (!server) {
+        error("gethostbyname failed");
+    }
+
+    char* serverIpAddress = inet_ntoa( (struct in_addr) *((struct in_addr *) server->h_addr));
+    printf("IP for hostname %s: %s\n", serverName, serverIpAddress);
+
+    // fill in server (sender) details
+    struct sockaddr_in destAddr;
+    destAddr.sin_family = AF_INET;
+    destAddr.sin_port = htons(serverPort);
+    destAddr.sin_addr.s_addr = inet_addr(serverIpAddress);
+
+    // one file from the command line, or a batch of them
+    vector<string> names;
+    if (manifest)
+        read_manifest(manifest, &names);
+    else
+        names.push_back(argv[optind + 2]);
+    if (!manifest)
+        concurrency = 1;
+
+    DownloadConfig config;
+    config.minRto = minRtoMs * 1000;
+    config.maxRto = maxRtoMs * 1000;
+    config.windowSegments = windowSegments;
+    config.ackEvery = ackEvery;
+    config.ackDelay = ackDelayMs * 1000;
+    config.checksumType = checksumType;
+    config.fecBlock = fecBlock;
+    config.compress = compress;
+    config.resume = resume;
+    config.stripe = 0;
+    config.stripes = 0;
+    config.rangeOffset = rangeOffset;
+    config.rangeLength = rangeLength;
+    config.qlogDir = qlogDir;
+    config.quiet = manifest != NULL;
+    // one checkpoint follows one flow's contiguous progress
+    if (resume && numStreams > 1) {
+        fprintf(stderr,"ERROR, -c can't be combined with -n\n");
+        exit(1);
+    }
+    if (numStreams > 1)
+        fork_streams(numStreams, names[0].c_str(), &config);
+    // each stream impairs its own flow from its own seed
+    netemConfig.seed += config.stripe;
+    netem.configure(netemConfig);
+    if (qlogDir)
+        traceRing = new TraceRing();
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
         error("ERROR opening socket");
     }
     fcntl(sockfd, F_SETFL, O_NONBLOCK);
     bzero((char *) &recvAddr, sizeof(recvAddr));
-    portno = 48120;
+    // any free port; connection ids keep downloads sharing it apart
+    portno = 0;
     recvAddr.sin_family = AF_INET;
     recvAddr.sin_addr.s_addr = INADDR_ANY;
     recvAddr.sin_port = htons(portno);
@@ -171,97 +1017,159 @@ int main(int argc, char *argv[])
     }
     /*********************************/
 
-    // server info
-    char* filename = argv[3];
-    int serverPort = atoi(argv[2]);
-    char* serverName = argv[1];
-
-    // resolve hostname using DNS
-    hostent *server = gethostbyname(serverName);
-
-    if (!server) {
-        error("gethostbyname failed");
+    // save progress on the way out rather than losing what came since the last checkpoint
+    if (resume) {
+        sa.sa_handler = interrupt_handler;
+        sa.sa_flags = 0;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
     }
 
-    char* serverIpAddress = inet_ntoa( (struct in_addr) *((struct in_addr *) server->h_addr));
-    Packet requestPacket(-1, REQUEST_PACKET, filename, strlen(filename)+1);
-
-    printf("IP for hostname %s: %s\n", serverName, serverIpAddress);
-
-    // fill in server (sender) details
-    struct sockaddr_in destAddr;
-    destAddr.sin_family = AF_INET;
-    destAddr.sin_port = htons(serverPort);
-    destAddr.sin_addr.s_addr = inet_addr(serverIpAddress);
-
-    send_packet(requestPacket, sockfd, destAddr);
+    // offer the largest segment our route to the server can carry; the
+    // reorder buffers' slots are sized to match
+    int mtu = route_mtu(destAddr);
+    config.mss = mtu > 0 ? mss_for_mtu(mtu) : DATA_LEN;
+    if (config.mss > maxSegment)
+        config.mss = maxSegment;
+    // a window's worth of segments arriving in one burst for every download
+    // must fit in the socket, or the kernel drops the tail of every burst
+    int64_t window = (int64_t)(windowSegments + 1) * config.mss * concurrency;
+    int64_t rcvbuf = udp_size_rcvbuf(sockfd, window);
+    if (rcvbuf < window)
+        fprintf(stderr, "WARNING: socket receive buffer holds %lld of the %lld bytes the windows need; raise net.core.rmem_max\n",
+            (long long)rcvbuf, (long long)window);
 
-    struct timeval timeVal;
-    gettimeofday(&timeVal, NULL);
-    unsigned long t = timeVal.tv_usec/1000 + timeVal.tv_sec*1000;
-
-    char packetData[2048];
-    int packetDataLength;
-    int expectedSeqNum = 0;
-    vector<Packet> packets;
+    SendBatch out(sockfd);
+    RecvBatch in(sockfd, true);
+    EventLoop loop;
+    if (!loop.open() || !loop.add(sockfd)) {
+        error("ERROR creating event loop");
+    }
 
+    // Downloads under way, and those still waiting on the server's EOF ACK;
+    // only the first kind count against the concurrency.
+    vector<Download*> downloads;
+    int64_t start = now_us();
+    size_t next = 0;
+    int running = 0;
+    int failed = 0;
+    int64_t bytes = 0;
     while (1) {
-        packetDataLength = recvfrom(sockfd, packetData, 2048, 0, (struct sockaddr *) &servAddr, &servLen);
-
-
-        if (packetDataLength < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                error("ERROR on recvfrom");
-            }
-            gettimeofday(&timeVal, NULL);
-            long now = timeVal.tv_usec/1000 + timeVal.tv_sec*1000;
-            if (now - t > TIMEOUT) {
-                printf("TIMEOUT waiting for data\n");
-                if (expectedSeqNum == 0) {
-                    printf("RETRANSMISSION: ");
-                    send_packet(requestPacket, sockfd, destAddr);
+        // A file is done with once it's written, though the EOF ACK may
+        // still be going back and forth. An old server's packets carry no
+        // connection id, so nothing else starts until its EOF ACK is in.
+        bool legacy = false;
+        for (size_t i = 0; i < downloads.size();) {
+            Download* d = downloads[i];
+            if (!d->reported && d->state != DOWNLOAD_RUNNING) {
+                d->reported = true;
+                running--;
+                long long ms = (now_us() - d->requestSentAt) / 1000;
+                struct stat st;
+                if (d->state != DOWNLOAD_FAILED && stat(d->filename, &st) == 0) {
+                    bytes += st.st_size;
+                    if (manifest)
+                        printf("Fetched %s, %lld bytes in %lld ms\n", d->filename, (long long)st.st_size, ms);
                 }
                 else {
-                    Packet ackPkt(-1, expectedSeqNum, NULL, 0);
-                    printf("RETRANSMISSION: ");
-                    send_packet(ackPkt, sockfd, destAddr);
+                    failed++;
+                    if (manifest)
+                        printf("FAILED %s after %lld ms\n", d->filename, ms);
                 }
-                t = now;
+                fflush(stdout);
+            }
+            if (d->state == DOWNLOAD_DONE || d->state == DOWNLOAD_FAILED) {
+                download_destroy(d);
+                downloads.erase(downloads.begin() + i);
+            }
+            else {
+                legacy = legacy || d->legacyServer;
+                ++i;
             }
         }
-        else if (packetDataLength > 0) {
-            if (servAddr.sin_port == destAddr.sin_port && servAddr.sin_addr.s_addr == destAddr.sin_addr.s_addr) {
-                Packet pkt(packetData, packetDataLength);
-                // simulate corruption and packet loss
-                int r = (rand() % 100) + 1;
-                if (r <= PROBABILITY_PACKET_LOST * 100) {
-                    continue;
-                }
-                r = (rand() % 100) + 1;
-                if (r <= PROBABILITY_PACKET_CORRUPT * 100) {
-                    pkt.setSeqNum(pkt.getSeqNum() + 1);
+
+        // set when a download fails before it can send its request
+        bool settled = false;
+        for (; running < concurrency && next < names.size() && !legacy; ++next) {
+            if (manifest)
+                make_parent_dirs(names[next].c_str());
+            Download* d = download_start(names[next].c_str(), config, sockfd, destAddr);
+            downloads.push_back(d);
+            running++;
+            settled = settled || d->state != DOWNLOAD_RUNNING;
+        }
+        if (downloads.empty())
+            break;
+        if (settled)
+            continue;
+
+        // wake for whichever is due first: a held-back ACK, a retransmission
+        // timer or a datagram the emulator delayed
+        int64_t deadline = 0;
+        for (size_t i = 0; i < downloads.size(); ++i) {
+            int64_t at = download_deadline(downloads[i]);
+            if (deadline == 0 || at < deadline)
+                deadline = at;
+        }
+        int64_t due = netem.deadline();
+        if (due && (deadline == 0 || due < deadline))
+            deadline = due;
+        if (!loop.setDeadline(deadline)) {
+            error("ERROR arming timer");
+        }
+        int events = loop.wait();
+        if (events < 0) {
+            error("ERROR on epoll_wait");
+        }
+        if (interrupted) {
+            for (size_t i = 0; i < downloads.size(); ++i) {
+                if (downloads[i]->state == DOWNLOAD_RUNNING)
+                    save_checkpoint(downloads[i], true);
+            }
+            exit(1);
+        }
+
+        if (events & EVENT_TIMER) {
+            int64_t now = now_us();
+            for (size_t i = 0; i < downloads.size(); ++i)
+                download_on_timer(downloads[i], now, sockfd, &out, destAddr);
+            out.flush();
+        }
+        bool readable = (events & EVENT_READABLE) != 0;
+        due = netem.deadline();
+        if (readable || (due && due <= now_us())) {
+            // drain the socket a batch at a time, passing it through the emulator
+            // and flushing our ACKs after each batch
+            int numSegments;
+            do {
+                numSegments = readable ? in.recv() : 0;
+                if (numSegments < 0) {
+                    error("ERROR on recvmmsg");
                 }
-                if (pkt.isData()) {
-                    if (pkt.getSeqNum() == expectedSeqNum && !pkt.isCorrupt()) {
-                        printf("Got DATA packet with SEQ number: %d\n", pkt.getSeqNum());
-                        packets.push_back(pkt);
-                        if (pkt.isEOF()) {
-                            save_file_and_exit(packets, filename, sockfd, destAddr);
-                        }
-                        expectedSeqNum += pkt.getDataLen();
-                        Packet ackPkt(-1, expectedSeqNum, NULL, 0);
-                        gettimeofday(&timeVal, NULL);
-                        t = timeVal.tv_usec/1000 + timeVal.tv_sec*1000;
-                        send_packet(ackPkt, sockfd, destAddr);
-                    }
-                    else {
-                        Packet ackPkt(-1, expectedSeqNum, NULL, 0);
-                        printf("Got out of order packet. Resending ACK with ACKNUM %d\n", ackPkt.getAckNum());
-                        send_packet(ackPkt, sockfd, destAddr);
-                    }
+                int numReady = netem.pass(in, numSegments, now_us());
+                for (int i = 0; i < numReady; ++i) {
+                    RecvSegment& seg = netem.segment(i);
+                    struct sockaddr_in& servAddr = *seg.from;
+                    if (seg.len == 0 || servAddr.sin_port != destAddr.sin_port || servAddr.sin_addr.s_addr != destAddr.sin_addr.s_addr)
+                        continue;
+                    PacketView pkt;
+                    pkt.parse(seg.data, seg.len);
+                    Download* d = find_download(downloads, pkt);
+                    if (d && d->state != DOWNLOAD_DONE && d->state != DOWNLOAD_FAILED)
+                        download_on_packet(d, pkt, sockfd, &out, destAddr);
                 }
-            }
+                out.flush();
+            } while (numSegments > 0);
         }
+
     }
-    return 0; /* we never get here */
-}
\ No newline at end of file
+    if (manifest)
+        printf("%d files, %lld bytes finished in %lld ms, %d failed\n", (int)names.size(), (long long)bytes,
+            (long long)(now_us() - start) / 1000, failed);
+    if (failed)
+        exit(1);
+    print_alloc_stats("Transfer complete");
+    print_io_stats("Socket I/O");
+    netem.printStats("Impairment");
+    return 0;
+}
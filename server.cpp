@@ -1,7 +1,7 @@
 /* A simple server in the internet domain using TCP
 The port number is passed as an argument 
-This version runs forever, forking off a separate 
-process for each connection
+This version runs forever, optionally forking off one
+worker process per core that share the port via SO_REUSEPORT
 */
 #include <stdio.h>
 #include <sys/types.h>   // definitions of a number of data types used in socket.h and netinet/in.h
@@ -16,252 +16,1312 @@ process for each connection
 #include <iostream>
 #include <sys/fcntl.h>
 #include <errno.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <limits.h>
+#include <arpa/inet.h>
 
 #include "Packet.h"
+#include "FileSource.h"
+#include "Sack.h"
+#include "RttEstimator.h"
+#include "CongestionControl.h"
+#include "EventLoop.h"
+#include "ConnectionTable.h"
+#include "TimerHeap.h"
+#include "UdpBatch.h"
+#include "Handshake.h"
+#include "PathMtu.h"
+#include "NetEmulator.h"
+#include "Log.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Pacer.h"
+#include "Fec.h"
+#include "FileCache.h"
 
 using namespace std;
 
-int eofPosition = -1;
-
-void sigchld_handler(int s)
-{
-    while(waitpid(-1, NULL, WNOHANG) > 0);
-}
-
 void error(char *msg)
 {
     perror(msg);
     exit(1);
 }
 
-char*
-file_to_str(FILE* file, int* len) {
+#define MAX_WORKERS 256
+
+void
+pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        perror("sched_setaffinity");
+}
+
+// duplicate ACKs that trigger a fast retransmit
+#define DUP_ACK_THRESHOLD 3
+// give up on a client after this many back-to-back retransmission timeouts
+#define CONN_MAX_BACKOFF 10
+
+#define TRANSFER_HANDSHAKE 0     // ACCEPT sent, waiting for the client's ACK
+#define TRANSFER_ESTABLISHED 1
+
+// State of one transfer, keyed by the client's address and connection id in
+// the connection table. Sequence numbers here are byte offsets into the
+// file; isn is added on the way out and taken off on the way in.
+struct Transfer {
+    ConnKey key;
+    struct sockaddr_in cliAddr;
+    int wireFormat;
+    bool sack;
+    FileSource file;
+
+    // negotiated in the handshake; peers without one get ISN 0 and defaults
+    int state;
+    int64_t isn;
+    int64_t clientIsn;
+    int mss;                    // largest segment agreed on; pmtu has the current size
+    int wscale;                 // shift applied to the client's advertised window
+    int checksumType;
+    HandshakeOptions accepted;  // options echoed in the ACCEPT
+
+    int64_t windowStart;        // oldest unacknowledged byte
+    int64_t nextSeq;            // next byte to send
+    int64_t highSent;           // highest byte ever sent, for spotting retransmissions
+    bool eofSent;               // nextSeq has reached the end of the file
+    int rwnd;                   // receiver's advertised window
+
+    // fast retransmit / recovery
+    int dupAcks;
+    bool inRecovery;
+    bool rtoRecovery;           // the holes being refilled came from a timeout, so cwnd is slow starting
+    int64_t recover;            // highSent when recovery started
+    int64_t rexmitNext;         // SACK recovery: next hole byte to retransmit
+    SackScoreboard scoreboard;
+
+    PathMtu pmtu;
 
-    fseek(file, 0L, SEEK_END);
-    *len = ftell(file);
-    fseek(file, 0L, SEEK_SET);
+    // pacing: the transfer's own bucket, and its place in the global one's queue
+    bool paced;                 // pace at a rate derived from cwnd / srtt
+    int64_t paceCap;            // per-connection cap in bytes/s, 0 for none
+    TokenBucket pace;
+    int64_t paceAt;             // when the own bucket lets the next segment go, 0 if not waiting
+    int paceBudget;             // bytes left in this turn at the global bucket
+    Transfer* paceNext;
+    Transfer* pacePrev;
 
-    char* fileContents = (char*)malloc(*len+1);
-    bzero(fileContents, *len+1);
+    FecEncoder* fec;            // NULL unless the client asked for FEC
 
-    fread(fileContents, 1, *len, file); 
+    RttEstimator* rtt;
+    CongestionControl* cc;
+    int64_t t;                  // when the retransmission timer was last restarted
 
-    return fileContents;
+    int64_t startedAt;
+    ConnStats stats;
+
+    // the file changed under its mapping; dropped at the next timer turn
+    bool fileLost;
+    int faultsSeen;             // fileFaults when the file was last checked
+
+    // position in the server's timer heap
+    int64_t deadline;
+    int heapIndex;
+};
+
+// server-wide settings every new transfer starts from
+struct ServerConfig {
+    const char* ccName;
+    int64_t minRto;
+    int64_t maxRto;
+    NetEmulatorConfig netem;
+    const char* reportPath;     // appended to after every transfer, or NULL
+    const char* statsPath;      // UNIX socket serving live stats, or NULL
+    const char* qlogDir;        // a qlog file per finished transfer, or NULL
+    int workerIndex;
+    bool pacing;
+    int64_t connRate;           // per-connection cap in bytes/s, 0 for none
+    int64_t globalRate;         // this worker's share of the global cap, 0 for none
+    int fecMinBlock;            // fewest segments per FEC repair we'll send, 0 to refuse FEC
+    int64_t cacheBudget;        // bytes of idle file mappings each worker keeps, 0 for none
+    bool compression;           // whether to compress the stream for receivers that ask
+};
+
+// What this worker has seen, over transfers that are gone as well as live
+// ones. Workers are separate processes, so each has its own copy.
+struct WorkerStats {
+    ConnStats finished;         // merged from every transfer when it is destroyed
+    unsigned long completed;
+    unsigned long abandoned;
+    unsigned long notFound;
+    int64_t startedAt;
+};
+
+WorkerStats workerStats;
+// set when -q asks for a trace
+TraceRing* traceRing = NULL;
+
+// the worker's share of the global rate cap, and the transfers waiting on it
+TokenBucket globalBucket;
+PaceQueue<Transfer> paceQueue;
+
+// mappings of the files this worker serves, shared between transfers
+FileCache* fileCache = NULL;
+// what compressing chunks of them has cost and saved
+CompressStats compressStats;
+// SIGBUS faults on those mappings so far, see on_bus_error()
+volatile sig_atomic_t fileFaults = 0;
+long pageSize;
+
+inline void
+trace(Transfer* tr, int type, int flags, int64_t a = 0, int64_t b = 0, int64_t c = 0) {
+    if (traceRing)
+        traceRing->record(now_us(), tr->key.connId, type, flags, a, b, c);
 }
 
-bool
-send_pkt_with_seq_num(int seqNum, char* fileContents, int fileLength, int sockfd, struct sockaddr_in cliAddr, int windowEnd) {
-    if (seqNum + DATA_LEN > fileLength && fileLength <= windowEnd) {
-        eofPosition = fileLength;
-        Packet pkt(seqNum, EOF_PACKET, fileContents + seqNum, fileLength - seqNum);
-        printf("Sending data packet with SEQUENCE NUMBER: %d\n", pkt.getSeqNum());
-        int serializedLength;
-        char* buffer = pkt.serialize(&serializedLength);
-        int err = sendto(sockfd, (void*)buffer, serializedLength, 0, (struct sockaddr *) &cliAddr, sizeof(cliAddr));
-        free(buffer);
-        if (err < 0) {
-            error("ERROR on send_pkt_with_seq_num");
+Transfer*
+create_transfer(const ConnKey& key, const struct sockaddr_in& cliAddr, const ServerConfig& config) {
+    Transfer* tr = new Transfer;
+    tr->key = key;
+    tr->cliAddr = cliAddr;
+    tr->wireFormat = WIRE_LEGACY;
+    tr->sack = false;
+    tr->state = TRANSFER_ESTABLISHED;
+    tr->isn = INITIAL_SEQ_NUM;
+    tr->clientIsn = INITIAL_SEQ_NUM;
+    tr->mss = DATA_LEN;
+    tr->wscale = 0;
+    tr->checksumType = CHECKSUM_CRC32C;
+    handshake_options_init(&tr->accepted);
+    tr->windowStart = 0;
+    tr->nextSeq = 0;
+    tr->highSent = 0;
+    tr->eofSent = false;
+    tr->rwnd = DEFAULT_RWND;
+    tr->dupAcks = 0;
+    tr->inRecovery = false;
+    tr->rtoRecovery = false;
+    tr->recover = 0;
+    tr->rexmitNext = 0;
+    tr->pmtu.reset(DATA_LEN);
+    tr->paced = config.pacing;
+    tr->paceCap = config.connRate;
+    tr->paceAt = 0;
+    tr->paceBudget = 0;
+    tr->paceNext = NULL;
+    tr->pacePrev = NULL;
+    tr->fec = NULL;
+    tr->rtt = new RttEstimator(TIMEOUT * 1000L, config.minRto, config.maxRto);
+    tr->cc = congestion_control_create(config.ccName, DATA_LEN);
+    tr->t = now_us();
+    tr->startedAt = tr->t;
+    conn_stats_init(&tr->stats);
+    tr->fileLost = false;
+    tr->faultsSeen = fileFaults;
+    tr->deadline = 0;
+    tr->heapIndex = -1;
+    return tr;
+}
+
+void
+destroy_transfer(Transfer* tr) {
+    paceQueue.remove(tr);
+    conn_stats_merge(&workerStats.finished, tr->stats);
+    delete tr->fec;
+    delete tr->rtt;
+    delete tr->cc;
+    delete tr;
+}
+
+// Settles the options the client offered: the smaller MSS, its window
+// scale, SACK, the first checksum both sides know, FEC no denser than we
+// allow, and the range and stripe of the file it wants. Fills in what the
+// ACCEPT will echo back.
+void
+negotiate(Transfer* tr, const HandshakeOptions& offer, const ServerConfig& config) {
+    tr->state = TRANSFER_HANDSHAKE;
+    tr->clientIsn = offer.isn;
+    tr->isn = handshake_isn();
+    // start from the largest segment both ends' routes allow
+    int localMtu = route_mtu(tr->cliAddr);
+    tr->mss = localMtu > 0 ? mss_for_mtu(localMtu) : DATA_LEN;
+    if (offer.mss > 0 && offer.mss < tr->mss)
+        tr->mss = offer.mss;
+    tr->pmtu.reset(tr->mss);
+    if (offer.wscale >= 0)
+        tr->wscale = offer.wscale;
+    tr->sack = tr->sack && offer.sack;
+    for (int i = 0; i < offer.numChecksums; ++i) {
+        if (offer.checksums[i] == CHECKSUM_CRC32C || offer.checksums[i] == CHECKSUM_NONE) {
+            tr->checksumType = offer.checksums[i];
+            break;
         }
-        return false;
     }
-    else {
-        int pktLength;
-        if (seqNum + DATA_LEN > windowEnd)
-            pktLength = windowEnd - seqNum;
+
+    HandshakeOptions& opts = tr->accepted;
+    opts.connId = tr->key.connId;
+    opts.isn = tr->clientIsn;
+    opts.mss = tr->mss;
+    opts.wscale = offer.wscale;
+    opts.sack = tr->sack;
+    opts.numChecksums = 1;
+    opts.checksums[0] = tr->checksumType;
+    if (offer.fecBlock > 0 && config.fecMinBlock > 0) {
+        int block = offer.fecBlock > config.fecMinBlock ? offer.fecBlock : config.fecMinBlock;
+        if (block > FEC_MAX_BLOCK)
+            block = FEC_MAX_BLOCK;
+        tr->fec = new FecEncoder(block);
+        opts.fecBlock = block;
+    }
+    // the range asked for, clamped to the file, then if this is one of
+    // several parallel flows, stripe i of n of that
+    int64_t start = 0;
+    int64_t length = tr->file.length();
+    if (offer.range) {
+        start = offer.rangeOffset < length ? offer.rangeOffset : length;
+        if (offer.rangeLength > 0 && offer.rangeLength < length - start)
+            length = offer.rangeLength;
         else
-            pktLength = DATA_LEN;
-        Packet pkt(seqNum, DATA_PACKET, fileContents + seqNum, pktLength);
-        printf("Sending data packet with SEQUENCE number: %d\n", pkt.getSeqNum());
-        int serializedLength;
-        char* buffer = pkt.serialize(&serializedLength);
-        int err = sendto(sockfd, (void*)buffer, serializedLength, 0, (struct sockaddr *) &cliAddr, sizeof(cliAddr));
-        free(buffer);
-        if (err < 0) {
-            error("ERROR on send_pkt_with_seq_num");
+            length -= start;
+    }
+    if (offer.stripes > 0) {
+        int64_t stripeLength = length / offer.stripes;
+        start += stripeLength * offer.stripe;
+        length = offer.stripe == offer.stripes - 1 ? length - stripeLength * offer.stripe : stripeLength;
+        opts.stripe = offer.stripe;
+        opts.stripes = offer.stripes;
+    }
+    if (offer.range || offer.stripes > 0) {
+        tr->file.setRange(start, length);
+        opts.range = true;
+        opts.rangeOffset = start;
+        opts.rangeLength = length;
+    }
+    opts.fileInfo = true;
+    opts.fileLength = tr->file.fileLength();
+    opts.fileMtime = tr->file.mtime();
+    // compressed after the range is settled, so only its chunks are
+    if (offer.compress == COMPRESS_LZ4 && config.compression && tr->file.compress(&compressStats))
+        opts.compress = COMPRESS_LZ4;
+
+    if (tr->mss != DATA_LEN) {
+        CongestionControl* cc = congestion_control_create(tr->cc->name(), tr->mss);
+        delete tr->cc;
+        tr->cc = cc;
+    }
+}
+
+// The ACCEPT is timed as if it were the byte just before offset 0, so the
+// ACK that completes the handshake gives the first RTT sample.
+void
+send_accept(Transfer* tr, SendBatch* out, bool retransmit) {
+    char opts[MAX_OPTIONS_LEN];
+    int optsLen = handshake_options_encode(opts, sizeof(opts), &tr->accepted);
+    if (retransmit)
+        LOG("RETRANSMISSION: ");
+    LOG("Sending ACCEPT for connection %08x, mss %d, checksum %s, fec %d\n",
+        tr->key.connId, tr->mss, checksum_name(tr->checksumType), tr->accepted.fecBlock);
+
+    char* buffer = out->next();
+    out->commit(packet_encode(buffer, FRAME_LEN, WIRE_BINARY, tr->isn, ACCEPT_PACKET, opts, optsLen, 0, tr->key.connId), tr->cliAddr);
+    tr->rtt->onSend(-1, 0, now_us(), retransmit);
+}
+
+void
+set_mss(Transfer* tr, const char* why) {
+    tr->cc->setMss(tr->pmtu.mss());
+    printf("%s, segment size now %d (ceiling %d)\n", why, tr->pmtu.mss(), tr->pmtu.ceiling());
+}
+
+// Duplicate ACKs that signal a loss. With FEC the rest of the block and
+// its repair may still rebuild the segment, so give them time to arrive.
+int
+dup_ack_threshold(Transfer* tr) {
+    if (tr->fec && tr->fec->blockSegments() + 1 > DUP_ACK_THRESHOLD)
+        return tr->fec->blockSegments() + 1;
+    return DUP_ACK_THRESHOLD;
+}
+
+// Where the bytes a SACK recovery presumes lost end. After a timeout that
+// is everything not SACKed; in fast recovery only the holes below the
+// highest SACKed byte (RFC 6675), since what lies above it may still be on
+// its way.
+int64_t
+lost_limit(Transfer* tr) {
+    if (tr->rtoRecovery)
+        return tr->recover;
+    int64_t highest = tr->scoreboard.highest();
+    return highest < tr->recover ? highest : tr->recover;
+}
+
+// bytes the sender believes are still in the network
+int64_t
+bytes_in_flight(Transfer* tr) {
+    int64_t flight = tr->nextSeq - tr->windowStart;
+    if (tr->sack) {
+        flight -= tr->scoreboard.sackedBytes(tr->windowStart, tr->nextSeq);
+        // holes not yet retransmitted in this recovery are presumed lost
+        int64_t limit = lost_limit(tr);
+        if (tr->inRecovery && tr->rexmitNext < limit) {
+            int64_t lost = limit - tr->rexmitNext;
+            lost -= tr->scoreboard.sackedBytes(tr->rexmitNext, limit);
+            flight -= lost;
         }
     }
+    return flight;
+}
+
+// A file truncated while mapped raises SIGBUS on reads of the pages it
+// lost. Rather than take the worker and every transfer in it down, the
+// handler maps zeros over the page so the read can finish, and counts the
+// fault so file_lost() catches the zeros before they are sent.
+//
+// mmap isn't on POSIX's async-signal-safe list. On Linux it is a bare
+// system call, though: glibc's wrapper takes no locks and never touches
+// the allocator, so whatever the interrupted code was doing, nothing the
+// handler uses can be half updated. The server is Linux only anyway
+// (epoll, timerfd, sendmmsg).
+void
+on_bus_error(int sig, siginfo_t* info, void* ctx) {
+    char* page = (char*)((uintptr_t)info->si_addr & ~(uintptr_t)(pageSize - 1));
+    if (info->si_code != BUS_ADRERR ||
+        mmap(page, pageSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        // not a file fault we can paper over: fault again, and die of it
+        signal(SIGBUS, SIG_DFL);
+        return;
+    }
+    fileFaults++;
+}
+
+// Whether the transfer's file has changed under it. Only checked after a
+// fault, here or in another transfer: a cached mapping is shared, and once
+// patched its pages read as zeros without faulting again.
+bool
+file_lost(Transfer* tr) {
+    if (!tr->fileLost && tr->faultsSeen != fileFaults) {
+        tr->faultsSeen = fileFaults;
+        tr->fileLost = tr->file.changed();
+    }
+    return tr->fileLost;
+}
+
+// Sends [seqNum, seqNum + len) of the file, or of its compressed frames;
+// the segment that reaches the end goes out as the EOF packet.
+void
+send_pkt_with_seq_num(Transfer* tr, int64_t seqNum, int len, SendBatch* out) {
+    if (file_lost(tr))
+        return;
+    bool retransmit = seqNum < tr->highSent;
+    int ackNum = (seqNum + len >= tr->file.length()) ? EOF_PACKET : DATA_PACKET;
+    if (retransmit)
+        LOG("RETRANSMISSION: ");
+    LOG("Sending data packet with SEQUENCE number: %lld\n", (long long)seqNum);
+
+    // encode straight from the mapped file into the send batch, which is
+    // where a truncated file faults
+    const char* data = tr->file.read(seqNum, len);
+    char* buffer = out->next();
+    int serializedLength = data ? packet_encode(buffer, FRAME_LEN, tr->wireFormat, tr->isn + seqNum, ackNum, data, len,
+                                                0, tr->key.connId, tr->checksumType) : 0;
+    if (!data || file_lost(tr)) {
+        tr->fileLost = true;
+        return;
+    }
+    out->commit(serializedLength, tr->cliAddr);
+    int64_t now = now_us();
+    tr->rtt->onSend(seqNum, seqNum + len, now, retransmit);
+    // retransmissions outside fill_window() go out regardless and leave a debt
+    tr->pace.consume(len, now);
+    globalBucket.consume(len, now);
+    tr->paceBudget -= len;
+    if (seqNum + len > tr->highSent)
+        tr->highSent = seqNum + len;
+    tr->stats.segmentsSent++;
+    tr->stats.bytesSent += len;
+    if (retransmit)
+        tr->stats.retransmits++;
+    trace(tr, TRACE_PACKET_SENT, (retransmit ? TRACE_FLAG_RETRANSMIT : 0) | (ackNum == EOF_PACKET ? TRACE_FLAG_EOF : 0), seqNum, len);
+}
+
+// Sends the parity of the open FEC block and starts a new one.
+void
+send_repair(Transfer* tr, SendBatch* out) {
+    FecEncoder* fec = tr->fec;
+    LOG("Sending REPAIR for %d segments from SEQUENCE number: %lld\n", fec->count(), (long long)fec->start());
+    char* buffer = out->next();
+    out->commit(packet_encode(buffer, FRAME_LEN, WIRE_BINARY, tr->isn + fec->start(), REPAIR_PACKET, fec->parity(), fec->len(),
+                              fec->count(), tr->key.connId, tr->checksumType), tr->cliAddr);
+    int64_t now = now_us();
+    tr->pace.consume(fec->len(), now);
+    globalBucket.consume(fec->len(), now);
+    tr->paceBudget -= fec->len();
+    tr->stats.repairsSent++;
+    fec->reset();
+}
+
+// Folds a new data segment into the open FEC block, sending the repair
+// once the block is full. The EOF segment and path MTU probes are left
+// out: the receiver has to see the EOF itself, and a probe may not fit.
+void
+fec_protect(Transfer* tr, int64_t seqNum, int len, bool probe, SendBatch* out) {
+    FecEncoder* fec = tr->fec;
+    bool eof = seqNum + len >= tr->file.length();
+    if (fec->pending() && (eof || probe || !fec->fits(seqNum, len)))
+        send_repair(tr, out);
+    if (eof || probe)
+        return;
+    fec->add(seqNum, tr->file.read(seqNum, len), len);
+    if (fec->full())
+        send_repair(tr, out);
+}
+
+// Refreshes the transfer's pacing rate from its window and RTT, capped by
+// the per-connection limit.
+void
+update_pacing_rate(Transfer* tr, int64_t now) {
+    int64_t rate = tr->paced ? pacing_rate(tr->cc->cwnd(), tr->cc->ssthresh(), tr->rtt->srtt()) : 0;
+    if (tr->paceCap > 0 && (rate == 0 || rate > tr->paceCap))
+        rate = tr->paceCap;
+    tr->pace.setRate(rate, pacing_burst(rate, tr->pmtu.mss()), now);
+}
+
+// Whether len more bytes may go out now. If not, the transfer either gets
+// a paceAt for its own bucket or joins the round-robin queue for the
+// global one.
+bool
+pace_admit(Transfer* tr, int len, int64_t now) {
+    update_pacing_rate(tr, now);
+    if (!tr->pace.available(len, now)) {
+        tr->paceAt = tr->pace.readyAt(len, now);
+        tr->stats.paceWaits++;
+        return false;
+    }
+    if (globalBucket.unlimited())
+        return true;
+    // while others wait their turn, only the transfer being served may send
+    bool waiting = !paceQueue.empty() && tr->paceBudget <= 0;
+    if (waiting || !globalBucket.available(len, now)) {
+        paceQueue.push(tr);
+        tr->stats.paceWaits++;
+        return false;
+    }
     return true;
 }
 
-int main(int argc, char *argv[])
-{
-    srand(time(0));
-    int sockfd, newsockfd, portno, pid;
-    socklen_t clilen;
-    struct sockaddr_in serv_addr, cliAddr;
-    struct sigaction sa;          // for signal SIGCHLD
+// Sends as much as the congestion and receive windows and the pacer allow:
+// first any holes SACK recovery still has to fill, then new data. cwnd
+// bounds the bytes in the network; rwnd bounds how far past the cumulative
+// ACK we go, since the receiver buffers from there whatever SACK says.
+void
+fill_window(Transfer* tr, SendBatch* out) {
+    int window = tr->cc->cwnd();
+    int64_t now = now_us();
+    tr->paceAt = 0;
 
-    if (argc < 2) {
-        fprintf(stderr,"ERROR, no port provided\n");
-        exit(1);
+    if (tr->sack && tr->inRecovery) {
+        int64_t holeStart, holeEnd;
+        while (bytes_in_flight(tr) < window &&
+               tr->scoreboard.nextHole(tr->rexmitNext, lost_limit(tr), &holeStart, &holeEnd)) {
+            int len = holeEnd - holeStart < tr->pmtu.mss() ? holeEnd - holeStart : tr->pmtu.mss();
+            if (!pace_admit(tr, len, now))
+                return;
+            tr->rexmitNext = holeStart + len;
+            send_pkt_with_seq_num(tr, holeStart, len, out);
+        }
     }
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    fcntl(sockfd, F_SETFL, O_NONBLOCK);
-    if (sockfd < 0) {
-        error("ERROR opening socket");
+
+    while (!tr->eofSent) {
+        // a compressed stream is built a segment ahead, which settles its
+        // length before the end is near enough to matter
+        tr->file.prepare(tr->nextSeq + MAX_DATA_LEN);
+        int64_t fileLength = tr->file.length();
+        int len = fileLength - tr->nextSeq < tr->pmtu.mss() ? fileLength - tr->nextSeq : tr->pmtu.mss();
+        // a path MTU probe is a full segment of the size being tried
+        int probe = tr->inRecovery ? 0 : tr->pmtu.nextProbe();
+        if (probe > 0 && fileLength - tr->nextSeq >= probe)
+            len = probe;
+        else
+            probe = 0;
+        int64_t flight = bytes_in_flight(tr);
+        // always allow one segment so a tiny window can't stall the transfer
+        if (flight > 0 && flight + len > window)
+            break;
+        if (tr->nextSeq > tr->windowStart && tr->nextSeq + len - tr->windowStart > tr->rwnd)
+            break;
+        if (!pace_admit(tr, len, now))
+            break;
+        if (probe > 0) {
+            LOG("Probing path MTU with a %d byte segment\n", probe);
+            tr->pmtu.onProbeSent(tr->nextSeq, probe);
+        }
+        // only first transmissions are protected, not go-back-N resends
+        bool fresh = tr->nextSeq >= tr->highSent;
+        send_pkt_with_seq_num(tr, tr->nextSeq, len, out);
+        if (tr->fileLost)
+            return;
+        if (tr->fec && fresh)
+            fec_protect(tr, tr->nextSeq, len, probe > 0, out);
+        tr->nextSeq += len;
+        if (tr->nextSeq >= fileLength)
+            tr->eofSent = true;
     }
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    portno = atoi(argv[1]);
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(portno);
+}
 
-    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        error("ERROR on binding");
+void
+on_timeout(Transfer* tr, SendBatch* out, int64_t now) {
+    tr->rtt->onTimeout();
+    if (tr->state == TRANSFER_ESTABLISHED && tr->pmtu.onTimeout())
+        set_mss(tr, "Repeated timeouts, suspecting a path MTU black hole");
+    if (tr->state == TRANSFER_HANDSHAKE) {
+        LOG("TIMEOUT on handshake, RTO backed off to %lld ms\n", (long long)tr->rtt->rto() / 1000);
+        send_accept(tr, out, true);
+        tr->t = now;
+        return;
     }
+    tr->cc->onTimeout(bytes_in_flight(tr), now);
+    tr->dupAcks = 0;
+    tr->recover = tr->highSent;
+    tr->stats.timeouts++;
+    LOG("TIMEOUT on ACK, RTO backed off to %lld ms, cwnd %d\n", (long long)tr->rtt->rto() / 1000, tr->cc->cwnd());
+    trace(tr, TRACE_PACKET_LOST, TRACE_LOST_TIMEOUT, tr->windowStart);
+    trace(tr, TRACE_CONGESTION_STATE, TRACE_STATE_SLOW_START);
+    trace(tr, TRACE_CWND_UPDATED, 0, tr->cc->cwnd(), tr->cc->ssthresh(), bytes_in_flight(tr));
 
-    clilen = sizeof(cliAddr);
+    if (tr->sack) {
+        // every hole is presumed lost; refill them under the collapsed window
+        tr->inRecovery = true;
+        tr->rtoRecovery = true;
+        tr->rexmitNext = tr->windowStart;
+    }
+    else {
+        // go back N
+        tr->inRecovery = false;
+        tr->rtoRecovery = false;
+        tr->nextSeq = tr->windowStart;
+        tr->eofSent = false;
+    }
+    tr->t = now;
+    fill_window(tr, out);
+}
 
-    /****** Kill Zombie Processes ******/
-    sa.sa_handler = sigchld_handler; // reap all dead processes
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        perror("sigaction");
-        exit(1);
+void
+on_rtt_sample(Transfer* tr) {
+    LOG("RTT sample %lld us, SRTT %lld us, RTTVAR %lld us, RTO %lld us\n",
+        (long long)tr->rtt->lastRtt(), (long long)tr->rtt->srtt(), (long long)tr->rtt->rttvar(), (long long)tr->rtt->rto());
+    tr->stats.rtt.record(tr->rtt->lastRtt());
+    trace(tr, TRACE_RTT_UPDATED, 0, tr->rtt->lastRtt(), tr->rtt->srtt(), tr->rtt->rttvar());
+}
+
+void
+on_ack(Transfer* tr, const PacketView& ack, SendBatch* out) {
+    // anything outside what we could have sent belongs to someone else
+    int64_t ackNum = ack.getAckNum() - tr->isn;
+    if (ackNum < 0 || ackNum > tr->highSent)
+        return;
+    if (tr->state == TRANSFER_HANDSHAKE && ack.getSeqNum() != tr->clientIsn)
+        return;
+    tr->stats.acks++;
+    trace(tr, TRACE_PACKET_RECEIVED, TRACE_FLAG_ACK, ackNum, ack.getDataLen());
+    if (ack.getWireFormat() == WIRE_BINARY) {
+        int64_t rwnd = (int64_t)ack.getWindow() << tr->wscale;
+        tr->rwnd = rwnd < MAX_CWND ? rwnd : MAX_CWND;
+    }
+    if (tr->sack) {
+        SackBlock blocks[MAX_SACK_BLOCKS];
+        int numBlocks = sack_decode(ack.getData(), ack.getDataLen(), blocks, MAX_SACK_BLOCKS);
+        for (int i = 0; i < numBlocks; ++i) {
+            tr->scoreboard.add(blocks[i].start - tr->isn, blocks[i].end - tr->isn);
+        }
+        tr->scoreboard.advance(ackNum);
+    }
+    if (tr->pmtu.probing()) {
+        int64_t probeLen = tr->pmtu.probeEnd() - tr->pmtu.probeSeq();
+        if (ackNum >= tr->pmtu.probeEnd() ||
+            (tr->sack && tr->scoreboard.sackedBytes(tr->pmtu.probeSeq(), tr->pmtu.probeEnd()) == probeLen)) {
+            tr->pmtu.onProbeAcked();
+            set_mss(tr, "Path MTU probe acknowledged");
+        }
     }
-    /*********************************/
-    char* fileContents;
-    int fileLength;
-    int windowStart = 0;
-    int currentClientPort = -1;
-    unsigned long currentClientIp = -1;
 
-    struct timeval timeVal;
-    long t;
-    while (1) {
-        char packetData[2048];
-        int packetDataLength = recvfrom(sockfd, packetData, 2048, 0, (struct sockaddr *) &cliAddr, &clilen);
+    int64_t now = now_us();
+    if (tr->state == TRANSFER_HANDSHAKE) {
+        printf("Connection %08x established\n", tr->key.connId);
+        tr->state = TRANSFER_ESTABLISHED;
+        if (tr->rtt->onAck(0, now))
+            on_rtt_sample(tr);
+        tr->rtt->onProgress();
+        tr->t = now;
+        fill_window(tr, out);
+        return;
+    }
+
+    if (ackNum > tr->windowStart) {
+        LOG("Received ACK packet with ACK number %lld\n", (long long)ackNum);
+        int bytesAcked = ackNum - tr->windowStart;
+        tr->windowStart = ackNum;
+        if (tr->nextSeq < ackNum)
+            tr->nextSeq = ackNum;
+        if (tr->rexmitNext < ackNum)
+            tr->rexmitNext = ackNum;
+        tr->dupAcks = 0;
+        tr->pmtu.onProgress();
 
+        tr->stats.bytesAcked += bytesAcked;
+        if (tr->rtt->onAck(ackNum, now))
+            on_rtt_sample(tr);
+        tr->rtt->onProgress();
 
-        if (packetDataLength < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                error("ERROR on recvfrom");
+        if (tr->inRecovery && ackNum >= tr->recover) {
+            tr->inRecovery = false;
+            // after a timeout cwnd is already slow starting from one segment
+            if (tr->rtoRecovery)
+                tr->cc->onAck(bytesAcked, now, tr->rtt->srtt());
+            else
+                tr->cc->exitRecovery();
+            tr->rtoRecovery = false;
+            trace(tr, TRACE_CONGESTION_STATE, tr->cc->cwnd() < tr->cc->ssthresh() ? TRACE_STATE_SLOW_START : TRACE_STATE_AVOIDANCE);
+        }
+        else if (tr->inRecovery) {
+            tr->cc->onAck(bytesAcked, now, tr->rtt->srtt());
+            // NewReno partial ACK: the next hole starts right at the new ACK
+            if (!tr->sack) {
+                int len = tr->highSent - ackNum < tr->pmtu.mss() ? tr->highSent - ackNum : tr->pmtu.mss();
+                send_pkt_with_seq_num(tr, ackNum, len, out);
             }
+        }
+        else {
+            tr->cc->onAck(bytesAcked, now, tr->rtt->srtt());
+        }
+        tr->t = now;
+        LOG("Window Start: %lld, cwnd %d, ssthresh %d, rwnd %d\n", (long long)tr->windowStart, tr->cc->cwnd(), tr->cc->ssthresh(), tr->rwnd);
+        tr->stats.cwnd.record(tr->cc->cwnd());
+        fill_window(tr, out);
+        trace(tr, TRACE_CWND_UPDATED, 0, tr->cc->cwnd(), tr->cc->ssthresh(), bytes_in_flight(tr));
+    }
+    else if (ackNum == tr->windowStart && tr->windowStart < tr->highSent) {
+        tr->dupAcks++;
+        tr->stats.dupAcks++;
+        if (!tr->inRecovery && tr->dupAcks == dup_ack_threshold(tr) && tr->windowStart >= tr->recover) {
+            // fast retransmit
+            LOG("%d duplicate ACKs for %lld, fast retransmit\n", tr->dupAcks, (long long)ackNum);
+            tr->stats.fastRetransmits++;
+            trace(tr, TRACE_PACKET_LOST, TRACE_LOST_DUP_ACKS, ackNum);
+            tr->cc->enterRecovery(bytes_in_flight(tr), now, tr->sack);
+            trace(tr, TRACE_CONGESTION_STATE, TRACE_STATE_RECOVERY);
+            // the missing segment is the probe: too big, or just unlucky
+            if (tr->pmtu.probing() && tr->pmtu.probeSeq() == ackNum)
+                tr->pmtu.onProbeLost();
+            tr->inRecovery = true;
+            tr->recover = tr->highSent;
+            tr->rexmitNext = tr->windowStart;
+            if (!tr->sack) {
+                int len = tr->highSent - ackNum < tr->pmtu.mss() ? tr->highSent - ackNum : tr->pmtu.mss();
+                send_pkt_with_seq_num(tr, ackNum, len, out);
+            }
+            tr->t = now;
+        }
+        else if (tr->inRecovery) {
+            tr->cc->onDupAck();
+        }
+        fill_window(tr, out);
+    }
+}
+
+// Appends one JSON line summing up a finished transfer, for benchmarks.
+void
+write_report(Transfer* tr, const char* path) {
+    FILE* f = fopen(path, "a");
+    if (!f) {
+        perror("transfer report");
+        return;
+    }
+    fprintf(f, "{\"conn\": \"%08x\", \"bytes\": %lld, \"rawBytes\": %lld, \"durationUs\": %lld, \"segments\": %lu, \"retransmits\": %lu, "
+               "\"repairs\": %lu, \"srttUs\": %lld, \"cwnd\": %d, \"mss\": %d}\n",
+        tr->key.connId, (long long)tr->file.length(), (long long)tr->file.rawLength(), (long long)(now_us() - tr->startedAt),
+        tr->stats.segmentsSent, tr->stats.retransmits,
+        tr->stats.repairsSent, (long long)tr->rtt->srtt(), tr->cc->cwnd(), tr->pmtu.mss());
+    fclose(f);
+}
+
+// The transfer's timer fires at its retransmission deadline, or earlier to
+// release segments the pacer held back.
+void
+schedule_transfer(TimerHeap<Transfer>& timers, Transfer* tr) {
+    int64_t deadline = tr->t + tr->rtt->rto();
+    if (tr->paceAt > 0 && tr->paceAt < deadline)
+        deadline = tr->paceAt;
+    // a transfer whose file changed goes at the next turn of the timers
+    if (tr->fileLost)
+        deadline = now_us();
+    timers.schedule(tr, deadline);
+}
 
-            gettimeofday(&timeVal, NULL);
-            long now = timeVal.tv_usec/1000 + timeVal.tv_sec*1000;
+// Gives every transfer waiting on the global bucket a turn of up to a
+// quantum, in order, for as long as the bucket has tokens; those that
+// still have more to send go to the back of the queue.
+void
+serve_pace_queue(TimerHeap<Transfer>& timers, SendBatch* out) {
+    int64_t now = now_us();
+    for (int n = paceQueue.size(); n > 0 && !paceQueue.empty(); --n) {
+        Transfer* tr = paceQueue.front();
+        if (!globalBucket.available(tr->pmtu.mss(), now))
+            break;
+        paceQueue.pop();
+        tr->paceBudget = PACE_QUANTUM_SEGMENTS * tr->pmtu.mss();
+        fill_window(tr, out);
+        tr->paceBudget = 0;
+        schedule_transfer(timers, tr);
+    }
+}
 
-            if (currentClientPort != -1 && now - t > TIMEOUT) {
-                printf("TIMEOUT on ACK\n");
-                int stop;
-                if (eofPosition != -1)
-                    stop = eofPosition;
-                else
-                    stop = windowStart + WINDOW_SIZE;
+// Writes the trace ring's events for one transfer to dir/<conn>-<port>.qlog.
+void
+write_qlog(Transfer* tr, const char* dir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%08x-%d.qlog", dir, tr->key.connId, tr->key.port);
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror("qlog");
+        return;
+    }
+    traceRing->writeQlog(f, &tr->key.connId, "server");
+    fclose(f);
+}
 
-                t = now;
+// state threaded through ConnectionTable::forEach while writing stats
+struct StatsWriter {
+    FILE* f;
+    bool first;
+    ConnStats totals;
+};
 
-                for (int i = windowStart; i < stop; i+=DATA_LEN) {
-                    printf("RETRANSMISSION: ");
-                    if (!send_pkt_with_seq_num(i, fileContents, fileLength, sockfd, cliAddr, stop)) 
-                        break;
-                }
-           
-            }
-            continue;
+void
+write_transfer_stats(Transfer* tr, void* arg) {
+    StatsWriter* w = (StatsWriter*)arg;
+    struct in_addr ip;
+    ip.s_addr = tr->key.ip;
+    fprintf(w->f, "%s\n    {\"conn\": \"%08x\", \"ip\": \"%s\", \"port\": %d, \"state\": \"%s\", \"bytes\": %lld, \"acked\": %lld, "
+                  "\"cwnd\": %d, \"ssthresh\": %d, \"rwnd\": %d, \"inFlight\": %lld, \"srttUs\": %lld, \"rtoUs\": %lld, \"mss\": %d, ",
+        w->first ? "" : ",", tr->key.connId, inet_ntoa(ip), tr->key.port,
+        tr->state == TRANSFER_HANDSHAKE ? "handshake" : tr->inRecovery ? "recovery" : "established",
+        (long long)tr->file.length(), (long long)tr->windowStart, tr->cc->cwnd(), tr->cc->ssthresh(), tr->rwnd,
+        (long long)bytes_in_flight(tr), (long long)tr->rtt->srtt(), (long long)tr->rtt->rto(), tr->pmtu.mss());
+    conn_stats_write_json(w->f, tr->stats);
+    fprintf(w->f, "}");
+    conn_stats_merge(&w->totals, tr->stats);
+    w->first = false;
+}
+
+// The reply to a stats client: worker totals over finished and live
+// transfers, socket I/O, then every live transfer.
+void
+write_stats(FILE* f, ConnectionTable<Transfer>& connections, const ServerConfig& config) {
+    StatsWriter w;
+    w.f = f;
+    w.first = true;
+    w.totals = workerStats.finished;
+    IoStats& io = io_stats();
+    fprintf(f, "{\"worker\": %d, \"pid\": %d, \"uptimeUs\": %lld, \"active\": %d, \"completed\": %lu, \"abandoned\": %lu, \"notFound\": %lu,\n",
+        config.workerIndex, getpid(), (long long)(now_us() - workerStats.startedAt), connections.size(),
+        workerStats.completed, workerStats.abandoned, workerStats.notFound);
+    fprintf(f, "  \"io\": {\"sendCalls\": %lu, \"sentPackets\": %lu, \"sendDrops\": %lu, \"recvCalls\": %lu, \"recvPackets\": %lu},\n",
+        io.sendCalls, io.sentPackets, io.sendDrops, io.recvCalls, io.recvPackets);
+    fprintf(f, "  \"fileCache\": ");
+    fileCache->writeJson(f);
+    fprintf(f, ",\n  \"compression\": ");
+    compress_stats_write_json(f, compressStats);
+    fprintf(f, ",\n");
+    if (traceRing)
+        fprintf(f, "  \"traceEvents\": %llu,\n", (unsigned long long)traceRing->recorded());
+    fprintf(f, "  \"connections\": [");
+    connections.forEach(write_transfer_stats, &w);
+    fprintf(f, "\n  ],\n  \"totals\": {");
+    conn_stats_write_json(f, w.totals);
+    fprintf(f, "}\n}\n");
+}
+
+// Moves the stats clients along and answers those whose command is in:
+// "qlog" gets the whole trace ring, anything else the stats.
+void
+serve_stats(StatsSocket* sock, ConnectionTable<Transfer>& connections, const ServerConfig& config) {
+    char cmd[STATS_COMMAND_LEN];
+    FILE* f;
+    sock->service(now_us());
+    while ((f = sock->nextRequest(cmd, sizeof(cmd)))) {
+        if (strcmp(cmd, "qlog") == 0) {
+            if (traceRing)
+                traceRing->writeQlog(f, NULL, "server");
+            else
+                fprintf(f, "{\"error\": \"tracing is off, start the server with -q\"}\n");
+        }
+        else {
+            write_stats(f, connections, config);
         }
+        sock->reply(f, now_us());
+    }
+}
 
-        Packet rcvdPacket(packetData, packetDataLength);
+// an ICMP "fragmentation needed" report for one destination
+struct PathReport {
+    in_addr_t ip;
+    int mtu;
+};
 
-        // simulate corruption and packet loss
-        int r = (rand() % 100) + 1;
-        if (r <= PROBABILITY_PACKET_LOST * 100) {
-            continue;
+void
+on_path_report(Transfer* tr, void* arg) {
+    PathReport* report = (PathReport*)arg;
+    if (tr->cliAddr.sin_addr.s_addr == report->ip && tr->pmtu.onIcmp(report->mtu))
+        set_mss(tr, "ICMP fragmentation needed");
+}
+
+// Serves every transfer whose datagrams arrive on sockfd; never returns.
+void
+run_worker(int sockfd, const ServerConfig& config) {
+    SendBatch out(sockfd);
+    RecvBatch in(sockfd, false);
+    NetEmulator netem;
+    netem.configure(config.netem);
+    workerStats.startedAt = now_us();
+    if (config.qlogDir)
+        traceRing = new TraceRing();
+    globalBucket.setRate(config.globalRate, pacing_burst(config.globalRate, DATA_LEN), now_us());
+    fileCache = new FileCache(config.cacheBudget);
+    pageSize = sysconf(_SC_PAGESIZE);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_bus_error;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGBUS, &sa, NULL);
+    ConnectionTable<Transfer> connections;
+    TimerHeap<Transfer> timers;
+
+    char pathBuf[PATH_MAX];
+
+    EventLoop loop;
+    if (!loop.open() || !loop.add(sockfd)) {
+        error("ERROR creating event loop");
+    }
+
+    // one stats socket per worker: path, or path.N with several workers
+    StatsSocket statsSocket;
+    if (config.statsPath) {
+        char path[PATH_MAX];
+        if (config.workerIndex >= 0)
+            snprintf(path, sizeof(path), "%s.%d", config.statsPath, config.workerIndex);
+        else
+            snprintf(path, sizeof(path), "%s", config.statsPath);
+        if (!statsSocket.open(path, &loop)) {
+            error("ERROR opening stats socket");
         }
-        r = (rand() % 100) + 1;
-        if (r <= PROBABILITY_PACKET_CORRUPT * 100) {
-            rcvdPacket.setAckNum(rcvdPacket.getAckNum() + 1);
+    }
+
+    while (1) {
+        // sleep until a datagram arrives, the earliest retransmission or
+        // pacing timer expires, the global bucket can serve the next waiting
+        // transfer, or the emulator has a delayed datagram due
+        Transfer* next = timers.top();
+        int64_t deadline = next ? next->deadline : 0;
+        int64_t due = netem.deadline();
+        if (due && (!deadline || due < deadline))
+            deadline = due;
+        if (!paceQueue.empty()) {
+            due = globalBucket.readyAt(paceQueue.front()->pmtu.mss(), now_us());
+            if (!deadline || due < deadline)
+                deadline = due;
+        }
+        int64_t statsDue = statsSocket.deadline();
+        if (statsDue && (!deadline || statsDue < deadline))
+            deadline = statsDue;
+        if (!loop.setDeadline(deadline)) {
+            error("ERROR arming timer");
+        }
+        int events = loop.wait();
+        if (events < 0) {
+            error("ERROR on epoll_wait");
+        }
+
+        // a stats client that went quiet times out on the timer
+        if ((events & EVENT_CONTROL) || (statsDue && statsDue <= now_us())) {
+            serve_stats(&statsSocket, connections, config);
         }
 
-        if (rcvdPacket.isCorrupt()) {
-            printf("corrupt\n");
+        if (events & EVENT_TIMER) {
+            int64_t now = now_us();
+            while ((next = timers.top()) && next->deadline <= now) {
+                if (next->fileLost) {
+                    printf("File of client %d changed or became unreadable, dropping its transfer\n", next->key.port);
+                    workerStats.abandoned++;
+                    trace(next, TRACE_CONNECTION_CLOSED, 0);
+                    timers.cancel(next);
+                    connections.erase(next->key);
+                    destroy_transfer(next);
+                    continue;
+                }
+                // the pacer releasing held segments, not a timeout
+                if (next->t + next->rtt->rto() > now) {
+                    fill_window(next, &out);
+                    schedule_transfer(timers, next);
+                    continue;
+                }
+                if (next->rtt->backoff() >= CONN_MAX_BACKOFF) {
+                    printf("Client %d gave up, dropping its transfer\n", next->key.port);
+                    workerStats.abandoned++;
+                    trace(next, TRACE_CONNECTION_CLOSED, 0);
+                    timers.cancel(next);
+                    connections.erase(next->key);
+                    destroy_transfer(next);
+                    continue;
+                }
+                on_timeout(next, &out, now);
+                schedule_transfer(timers, next);
+            }
+            serve_pace_queue(timers, &out);
+            out.flush();
+        }
+        bool readable = (events & EVENT_READABLE) != 0;
+        due = netem.deadline();
+        if (!readable && !(due && due <= now_us()))
             continue;
+
+        // ICMP reports apply to every transfer headed for that host
+        struct sockaddr_in errAddr;
+        PathReport report;
+        while (path_error_recv(sockfd, &errAddr, &report.mtu)) {
+            if (report.mtu > 0) {
+                report.ip = errAddr.sin_addr.s_addr;
+                connections.forEach(on_path_report, &report);
+            }
         }
 
-        // potentially need to handle receiving a request packet in the middle of handling a request
-        if (rcvdPacket.isRequest() && currentClientPort == -1) {
-            string filePath(rcvdPacket.getData(), rcvdPacket.getDataLen());
-            printf("File Path: %s\n", filePath.c_str());
-            FILE* file = fopen(filePath.c_str(), "rb");
-            if (!file) {
-                // FILE NOT FOUND
-                Packet responsePacket(0, NOT_FOUND_PACKET, NULL, 0);
-                int serializedLength;
-                char* buffer = responsePacket.serialize(&serializedLength);
-                int err = sendto(sockfd, (void*)buffer, serializedLength, 0, (struct sockaddr *) &cliAddr, clilen);
-                if (err < 0)
-                    error("ERROR on FNF sendto");
-                free(buffer);
-                continue;
+        // drain the socket a batch at a time, passing it through the emulator
+        // and flushing our replies after each batch
+        int numSegments;
+        do {
+            numSegments = readable ? in.recv() : 0;
+            if (numSegments < 0) {
+                error("ERROR on recvmmsg");
             }
+            int numReady = netem.pass(in, numSegments, now_us());
+            for (int i = 0; i < numReady; ++i) {
+                RecvSegment& seg = netem.segment(i);
+                struct sockaddr_in& cliAddr = *seg.from;
+                PacketView rcvdPacket;
+                rcvdPacket.parse(seg.data, seg.len);
+
+                if (rcvdPacket.isCorrupt()) {
+                    LOG("corrupt\n");
+                    continue;
+                }
+
+                ConnKey key;
+                key.ip = cliAddr.sin_addr.s_addr;
+                key.port = ntohs(cliAddr.sin_port);
+                key.connId = rcvdPacket.getConnId();
 
-            currentClientPort = htons(cliAddr.sin_port);
-            currentClientIp = cliAddr.sin_addr.s_addr;
+                // The file name runs up to its NUL; handshake options follow it.
+                // New receivers advertise their capabilities in the request's
+                // sequence number.
+                int requestFlags = -1;
+                HandshakeOptions offer;
+                bool handshake = false;
+                const char* filePath = NULL;
+                if (rcvdPacket.isRequest()) {
+                    requestFlags = rcvdPacket.getSeqNum() >= 0 ? (int)rcvdPacket.getSeqNum() : 0;
+                    int nameLen = strnlen(rcvdPacket.getData(), rcvdPacket.getDataLen());
+                    if ((requestFlags & REQUEST_FLAG_HANDSHAKE) && (requestFlags & REQUEST_FLAG_BINARY) && nameLen < rcvdPacket.getDataLen()) {
+                        handshake = handshake_options_decode(rcvdPacket.getData() + nameLen + 1, rcvdPacket.getDataLen() - nameLen - 1, &offer);
+                        if (handshake)
+                            key.connId = offer.connId;
+                    }
+                    filePath = pathBuf;
+                    memcpy(pathBuf, rcvdPacket.getData(), nameLen < PATH_MAX ? nameLen : PATH_MAX - 1);
+                    pathBuf[nameLen < PATH_MAX ? nameLen : PATH_MAX - 1] = '\0';
+                }
+                Transfer* tr = connections.find(key);
 
-            fileContents = file_to_str(file, &fileLength);
-            fclose(file);
+                // a repeated request re-sends the ACCEPT, if that's where we are;
+                // otherwise it is ignored
+                if (rcvdPacket.isRequest() && tr) {
+                    if (tr->state == TRANSFER_HANDSHAKE)
+                        send_accept(tr, &out, true);
+                }
+                else if (rcvdPacket.isRequest()) {
+                    printf("File Path: %s\n", filePath);
 
-            printf("File Length: %d\n", fileLength);
+                    int wireFormat = (requestFlags & REQUEST_FLAG_BINARY) ? WIRE_BINARY : WIRE_LEGACY;
+                    tr = create_transfer(key, cliAddr, config);
+                    // offsets come off the wire as u64; one past 2^63 is no place in any file
+                    bool badRange = handshake && offer.range && (offer.rangeOffset < 0 || offer.rangeLength < 0);
+                    if (badRange || !tr->file.open(filePath, fileCache)) {
+                        // FILE NOT FOUND
+                        workerStats.notFound++;
+                        destroy_transfer(tr);
+                        char* buffer = out.next();
+                        out.commit(packet_encode(buffer, FRAME_LEN, wireFormat, 0, NOT_FOUND_PACKET, NULL, 0, 0, key.connId), cliAddr);
+                        continue;
+                    }
+                    tr->wireFormat = wireFormat;
+                    tr->sack = (requestFlags & REQUEST_FLAG_SACK) != 0;
+                    connections.insert(key, tr);
 
-            gettimeofday(&timeVal, NULL);
-            t = timeVal.tv_usec/1000 + timeVal.tv_sec*1000;
+                    printf("File Length: %lld, %d active transfers\n", (long long)tr->file.length(), connections.size());
+                    trace(tr, TRACE_CONNECTION_STARTED, 0, tr->file.length());
 
-            for (int i = 0; i < WINDOW_SIZE; i+=DATA_LEN) {
-                if (!send_pkt_with_seq_num(i, fileContents, fileLength, sockfd, cliAddr, windowStart + WINDOW_SIZE)) {
-                    break;
+                    if (handshake) {
+                        negotiate(tr, offer, config);
+                        send_accept(tr, &out, false);
+                    }
+                    else {
+                        fill_window(tr, &out);
+                    }
+                    schedule_transfer(timers, tr);
+                }
+                else if (rcvdPacket.isEOF_ACK()) {
+                    // first EOF ACK from receiver -> the transfer is done
+                    printf("Source port: %d\nSource Address: %d\n", key.port, key.ip);
+                    if (tr) {
+                        print_alloc_stats("Transfer complete");
+                        print_io_stats("Socket I/O");
+                        netem.printStats("Impairment");
+                        printf("SRTT %lld us, RTTVAR %lld us, RTO %lld us over %ld samples\n",
+                            (long long)tr->rtt->srtt(), (long long)tr->rtt->rttvar(), (long long)tr->rtt->rto(), tr->rtt->numSamples());
+                        printf("Final cwnd %d, ssthresh %d, segment size %d of %d\n", tr->cc->cwnd(), tr->cc->ssthresh(), tr->pmtu.mss(), tr->mss);
+                        printf("Sent %lu segments, %lu retransmitted, %lu timeouts, %lu fast retransmits\n",
+                            tr->stats.segmentsSent, tr->stats.retransmits, tr->stats.timeouts, tr->stats.fastRetransmits);
+                        workerStats.completed++;
+                        trace(tr, TRACE_CONNECTION_CLOSED, 0);
+                        if (config.reportPath)
+                            write_report(tr, config.reportPath);
+                        if (config.qlogDir)
+                            write_qlog(tr, config.qlogDir);
+                        timers.cancel(tr);
+                        connections.erase(key);
+                        destroy_transfer(tr);
+                    }
+
+                    LOG("RETRANSMISSION: Sending EOF_ACK\n");
+                    char* ackbuf = out.next();
+                    out.commit(packet_encode(ackbuf, FRAME_LEN, rcvdPacket.getWireFormat(), -1, EOF_ACK, NULL, 0, 0, key.connId), cliAddr);
+                }
+                else if (rcvdPacket.isACK() && tr) {
+                    // binary ACKs must use the checksum we agreed on
+                    if (rcvdPacket.getWireFormat() == WIRE_BINARY && rcvdPacket.getChecksumType() != tr->checksumType)
+                        continue;
+                    on_ack(tr, rcvdPacket, &out);
+                    schedule_transfer(timers, tr);
                 }
             }
-        }
-        else if (rcvdPacket.isEOF_ACK()) {
-            // first EOF ACK from receiver -> reset some state variables
-            printf("Source port: %d\nSource Address: %d\nCurrent Client Port: %d\nCurrent Client Ip: %d\n",
-                htons(cliAddr.sin_port),
-                cliAddr.sin_addr.s_addr,
-                currentClientPort,
-                currentClientIp);
-            if (htons(cliAddr.sin_port) == currentClientPort && cliAddr.sin_addr.s_addr == currentClientIp) {
-                free(fileContents);
-                fileLength = 0;
-                windowStart = 0;
-                currentClientPort = -1;
-                currentClientIp = -1;
-                eofPosition = -1;
-            }
+            out.flush();
+        } while (numSegments > 0);
+    } /* end of while */
+}
+
+// Opens the non-blocking listening socket. Workers sharing a port each get
+// their own SO_REUSEPORT socket and the kernel hashes flows across them.
+int
+open_socket(int portno, bool reusePort) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        error("ERROR opening socket");
+    }
+    fcntl(sockfd, F_SETFL, O_NONBLOCK);
+    if (reusePort) {
+        int on = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+            error("ERROR setting SO_REUSEPORT");
+    }
+    if (!path_mtu_enable(sockfd))
+        perror("path MTU discovery");
 
-            Packet pkt(-1, EOF_ACK, NULL, 0);
-            printf("RETRANSMISSION: Sending EOF_ACK\n");
-            int serializedLength;
-            char* ackbuf = pkt.serialize(&serializedLength);
-            int bytesSent = sendto(sockfd, (void*)ackbuf, serializedLength, 0, (struct sockaddr *)&cliAddr, clilen);
-            free(ackbuf);
+    struct sockaddr_in serv_addr;
+    bzero((char *) &serv_addr, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(portno);
+
+    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        error("ERROR on binding");
+    }
+    return sockfd;
+}
 
-            if (bytesSent < 0) {
-                error("ERROR on sending ack");
+// Parses a comma separated cpu list like "0,2,4". Returns the count.
+int
+parse_cpu_list(char* list, int* cpus, int maxCpus) {
+    int numCpus = 0;
+    for (char* tok = strtok(list, ","); tok && numCpus < maxCpus; tok = strtok(NULL, ",")) {
+        cpus[numCpus++] = atoi(tok);
+    }
+    return numCpus;
+}
+
+int main(int argc, char *argv[])
+{
+    int portno;
+
+    // RTO bounds in milliseconds
+    long minRtoMs = RTO_MIN_DEFAULT / 1000;
+    long maxRtoMs = RTO_MAX_DEFAULT / 1000;
+    const char* ccName = "cubic";
+    // worker processes; 0 means one per online core
+    int numWorkers = 1;
+    int cpus[MAX_WORKERS];
+    int numCpus = 0;
+    NetEmulatorConfig netem;
+    net_emulator_config_init(&netem);
+    const char* reportPath = NULL;
+    const char* statsPath = NULL;
+    const char* qlogDir = NULL;
+    // rate caps in bytes per second, 0 for none
+    bool pacing = true;
+    int64_t connRate = 0;
+    int64_t globalRate = 0;
+    int fecMinBlock = FEC_MIN_BLOCK_DEFAULT;
+    int64_t cacheBudget = FILE_CACHE_BUDGET_DEFAULT;
+    bool compression = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:M:c:w:a:e:r:u:q:p:g:Nf:C:Zv")) != -1) {
+        switch (opt) {
+        case 'm':
+            minRtoMs = atol(optarg);
+            break;
+        case 'M':
+            maxRtoMs = atol(optarg);
+            break;
+        case 'c':
+            ccName = optarg;
+            break;
+        case 'w':
+            numWorkers = atoi(optarg);
+            break;
+        case 'a':
+            numCpus = parse_cpu_list(optarg, cpus, MAX_WORKERS);
+            break;
+        case 'e':
+            if (!net_emulator_config_parse(&netem, optarg)) {
+                fprintf(stderr,"ERROR, bad impairment spec %s\n", optarg);
+                exit(1);
             }
+            break;
+        case 'r':
+            reportPath = optarg;
+            break;
+        case 'u':
+            statsPath = optarg;
+            break;
+        case 'q':
+            qlogDir = optarg;
+            break;
+        case 'p':
+            connRate = (int64_t)(atof(optarg) * 1e6 / 8);
+            break;
+        case 'g':
+            globalRate = (int64_t)(atof(optarg) * 1e6 / 8);
+            break;
+        case 'N':
+            pacing = false;
+            break;
+        case 'f':
+            fecMinBlock = atoi(optarg);
+            break;
+        case 'C':
+            cacheBudget = atoll(optarg) * 1024 * 1024;
+            break;
+        case 'Z':
+            compression = false;
+            break;
+        case 'v':
+            verbose_logging() = true;
+            break;
+        default:
+            fprintf(stderr,"usage: %s [-m min_rto_ms] [-M max_rto_ms] [-c reno|cubic] [-w workers] [-a cpu,cpu,...] [-e impairment] [-r report_file] [-u stats_socket] [-q qlog_dir] [-p conn_mbit] [-g global_mbit] [-N] [-f fec_min_block] [-C cache_mb] [-Z] [-v] port\n", argv[0]);
+            exit(1);
         }
-        else if (rcvdPacket.isACK()) {
-            int ackNum = rcvdPacket.getAckNum();
-            if (ackNum > windowStart) {
-                printf("Received ACK packet with ACK number %d\n", rcvdPacket.getAckNum());
-                int stop;
-                if (eofPosition != -1)
-                    stop = eofPosition;
-                else
-                    stop = ackNum + WINDOW_SIZE;
-
-                gettimeofday(&timeVal, NULL);
-                t = timeVal.tv_usec/1000 + timeVal.tv_sec*1000;
-
-                for (int i = windowStart + WINDOW_SIZE; i < stop; i+=DATA_LEN) {
-                    if (!send_pkt_with_seq_num(i, fileContents, fileLength, sockfd, cliAddr, stop))
-                        break;
-                }
-                windowStart = ackNum;
-                printf("Window Start: %d\n", windowStart);
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr,"ERROR, no port provided\n");
+        exit(1);
+    }
+    CongestionControl* probe = congestion_control_create(ccName, DATA_LEN);
+    if (!probe) {
+        fprintf(stderr,"ERROR, unknown congestion control %s\n", ccName);
+        exit(1);
+    }
+    printf("Congestion control: %s\n", probe->name());
+    delete probe;
+
+    ServerConfig config;
+    config.ccName = ccName;
+    config.minRto = minRtoMs * 1000;
+    config.maxRto = maxRtoMs * 1000;
+    config.netem = netem;
+    config.reportPath = reportPath;
+    config.statsPath = statsPath;
+    config.qlogDir = qlogDir;
+    config.workerIndex = -1;
+    config.fecMinBlock = fecMinBlock;
+    config.cacheBudget = cacheBudget;
+    config.compression = compression;
+    config.pacing = pacing;
+    config.connRate = connRate;
+
+    portno = atoi(argv[optind]);
+    if (numWorkers <= 0)
+        numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numWorkers > MAX_WORKERS)
+        numWorkers = MAX_WORKERS;
+    // each worker paces its share of the global cap
+    config.globalRate = globalRate / numWorkers;
+
+    if (numWorkers == 1) {
+        srand(time(0));
+        if (numCpus > 0)
+            pin_to_cpu(cpus[0]);
+        run_worker(open_socket(portno, false), config);
+    }
+
+    // bind every socket up front so the reuseport group is complete before
+    // any worker starts receiving
+    int sockets[MAX_WORKERS];
+    for (int i = 0; i < numWorkers; ++i) {
+        sockets[i] = open_socket(portno, true);
+    }
+    pid_t pids[MAX_WORKERS];
+    for (int i = 0; i < numWorkers; ++i) {
+        // don't let the children inherit buffered output
+        fflush(stdout);
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            error("ERROR on fork");
+        }
+        if (pids[i] == 0) {
+            // workers share nothing: each owns its socket, connections and pools
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            for (int j = 0; j < numWorkers; ++j) {
+                if (j != i)
+                    close(sockets[j]);
             }
+            srand(time(0) ^ getpid());
+            if (numCpus > 0)
+                pin_to_cpu(cpus[i % numCpus]);
+            // each worker impairs its own flows from its own seed
+            config.netem.seed += i;
+            config.workerIndex = i;
+            run_worker(sockets[i], config);
         }
+        printf("Started worker %d (pid %d)\n", i, pids[i]);
+    }
+    fflush(stdout);
 
-    } /* end of while */
-    return 0; /* we never get here */
-}
\ No newline at end of file
+    // a worker only exits on a fatal error; take the rest down with it
+    int status;
+    pid_t pid = wait(&status);
+    fprintf(stderr, "ERROR, worker %d exited\n", pid);
+    for (int i = 0; i < numWorkers; ++i) {
+        if (pids[i] != pid)
+            kill(pids[i], SIGTERM);
+    }
+    while (wait(NULL) > 0);
+    return 1;
+}
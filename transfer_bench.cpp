@@ -0,0 +1,350 @@
+/* Loopback benchmark for the server and receiver.
+Runs one transfer for every combination of file size, loss rate, RTT and
+receive window, with loss and delay applied by each side's impairment layer,
+and prints one JSON record per transfer: goodput, time to first byte,
+retransmission ratio, CPU per GB on each side and peak RSS.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_VALUES 16
+#define BENCH_PORT_DEFAULT 47100
+// a transfer still running after this long is killed and reported as failed
+#define BENCH_TIMEOUT_SEC 120
+// how long the server gets to bind before the first request
+#define SERVER_START_US (200 * 1000)
+
+void error(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+int64_t
+wall_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Parses a comma separated list of numbers; sizes may end in K or M.
+int
+parse_list(char* list, double* values, int maxValues) {
+    int numValues = 0;
+    for (char* tok = strtok(list, ","); tok && numValues < maxValues; tok = strtok(NULL, ",")) {
+        char* end;
+        double value = strtod(tok, &end);
+        if (*end == 'K' || *end == 'k')
+            value *= 1024;
+        else if (*end == 'M' || *end == 'm')
+            value *= 1024 * 1024;
+        values[numValues++] = value;
+    }
+    return numValues;
+}
+
+// Forks cmd in dir with its output thrown away.
+pid_t
+spawn(const char* dir, char* const argv[]) {
+    pid_t pid = fork();
+    if (pid < 0)
+        error("ERROR on fork");
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 1);
+        dup2(devnull, 2);
+        if (chdir(dir) < 0)
+            _exit(127);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+// CPU time of a running process, in microseconds; schedstat counts in
+// nanoseconds where /proc/<pid>/stat only has clock ticks
+int64_t
+proc_cpu_us(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/schedstat", pid);
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return 0;
+    unsigned long long ns = 0;
+    if (fscanf(f, "%llu", &ns) != 1)
+        ns = 0;
+    fclose(f);
+    return (int64_t)(ns / 1000);
+}
+
+// high water mark of a running process's resident set, in KB
+long
+proc_peak_rss_kb(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return 0;
+    char line[256];
+    long kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+
+// Reads the last line a server or receiver -r report got. Returns false if
+// the file is empty.
+bool
+read_report(const char* path, char* line, int lineLen) {
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return false;
+    bool found = false;
+    while (fgets(line, lineLen, f))
+        found = true;
+    fclose(f);
+    return found;
+}
+
+double
+report_value(const char* line, const char* key) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    const char* p = strstr(line, pattern);
+    return p ? strtod(p + strlen(pattern), NULL) : 0;
+}
+
+void
+truncate_file(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (f)
+        fclose(f);
+}
+
+void
+write_test_file(const char* path, long size) {
+    FILE* f = fopen(path, "w");
+    if (!f)
+        error("ERROR creating test file");
+    // pseudo-random so nothing along the way gets an easy ride
+    uint64_t x = size + 1;
+    char buf[4096];
+    for (long done = 0; done < size; done += sizeof(buf)) {
+        for (int i = 0; i < (int)sizeof(buf); i += 8) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            memcpy(buf + i, &x, 8);
+        }
+        long len = size - done < (long)sizeof(buf) ? size - done : sizeof(buf);
+        fwrite(buf, 1, len, f);
+    }
+    fclose(f);
+}
+
+bool
+files_equal(const char* a, const char* b) {
+    FILE* fa = fopen(a, "r");
+    FILE* fb = fopen(b, "r");
+    bool equal = fa && fb;
+    char bufA[65536], bufB[65536];
+    while (equal) {
+        size_t lenA = fread(bufA, 1, sizeof(bufA), fa);
+        size_t lenB = fread(bufB, 1, sizeof(bufB), fb);
+        if (lenA != lenB || memcmp(bufA, bufB, lenA) != 0)
+            equal = false;
+        if (lenA == 0)
+            break;
+    }
+    if (fa)
+        fclose(fa);
+    if (fb)
+        fclose(fb);
+    return equal;
+}
+
+// Impairment spec for one side: the loss rate, and half the RTT as delay.
+void
+impairment_spec(char* buf, int bufLen, double loss, double rttMs, int seed) {
+    snprintf(buf, bufLen, "loss=%g,delay=%g,seed=%d", loss, rttMs / 2, seed);
+}
+
+int
+main(int argc, char *argv[])
+{
+    double sizes[MAX_VALUES] = { 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+    int numSizes = 3;
+    double losses[MAX_VALUES] = { 0, 0.01, 0.05 };
+    int numLosses = 3;
+    double rtts[MAX_VALUES] = { 0, 20 };
+    int numRtts = 2;
+    double windows[MAX_VALUES] = { 64, 256 };
+    int numWindows = 2;
+    int repeat = 1;
+    int port = BENCH_PORT_DEFAULT;
+    const char* serverBin = "./server";
+    const char* receiverBin = "./receiver";
+    int opt;
+    while ((opt = getopt(argc, argv, "s:l:t:w:n:p:S:R:")) != -1) {
+        switch (opt) {
+        case 's':
+            numSizes = parse_list(optarg, sizes, MAX_VALUES);
+            break;
+        case 'l':
+            numLosses = parse_list(optarg, losses, MAX_VALUES);
+            break;
+        case 't':
+            numRtts = parse_list(optarg, rtts, MAX_VALUES);
+            break;
+        case 'w':
+            numWindows = parse_list(optarg, windows, MAX_VALUES);
+            break;
+        case 'n':
+            repeat = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'S':
+            serverBin = optarg;
+            break;
+        case 'R':
+            receiverBin = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s sizes] [-l loss_rates] [-t rtts_ms] [-w windows] [-n repeat] [-p port] [-S server] [-R receiver]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    char server[PATH_MAX], receiver[PATH_MAX];
+    if (!realpath(serverBin, server) || !realpath(receiverBin, receiver)) {
+        error("ERROR finding server and receiver binaries");
+    }
+
+    char dir[] = "/tmp/transfer_bench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        error("ERROR creating scratch directory");
+    }
+    char srvDir[PATH_MAX], rcvDir[PATH_MAX], srvReport[PATH_MAX], rcvReport[PATH_MAX];
+    snprintf(srvDir, sizeof(srvDir), "%s/srv", dir);
+    snprintf(rcvDir, sizeof(rcvDir), "%s/rcv", dir);
+    snprintf(srvReport, sizeof(srvReport), "%s/server.report", dir);
+    snprintf(rcvReport, sizeof(rcvReport), "%s/receiver.report", dir);
+    mkdir(srvDir, 0755);
+    mkdir(rcvDir, 0755);
+    for (int i = 0; i < numSizes; ++i) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%ld.bin", srvDir, (long)sizes[i]);
+        write_test_file(path, (long)sizes[i]);
+    }
+
+    printf("[\n");
+    bool first = true;
+    int failures = 0;
+    // one server per network condition, since its impairment is fixed at startup
+    for (int l = 0; l < numLosses; ++l) {
+        for (int r = 0; r < numRtts; ++r) {
+            char portArg[16], srvSpec[128];
+            snprintf(portArg, sizeof(portArg), "%d", port);
+            impairment_spec(srvSpec, sizeof(srvSpec), losses[l], rtts[r], 1);
+            char* srvArgv[] = { server, (char*)"-e", srvSpec, (char*)"-r", srvReport, portArg, NULL };
+            pid_t srvPid = spawn(srvDir, srvArgv);
+            usleep(SERVER_START_US);
+
+            for (int s = 0; s < numSizes; ++s) {
+                for (int w = 0; w < numWindows; ++w) {
+                    for (int n = 0; n < repeat; ++n) {
+                        char name[64], srcPath[PATH_MAX], dstPath[PATH_MAX], windowArg[16], rcvSpec[128];
+                        snprintf(name, sizeof(name), "%ld.bin", (long)sizes[s]);
+                        snprintf(srcPath, sizeof(srcPath), "%s/%s", srvDir, name);
+                        snprintf(dstPath, sizeof(dstPath), "%s/%s", rcvDir, name);
+                        snprintf(windowArg, sizeof(windowArg), "%d", (int)windows[w]);
+                        impairment_spec(rcvSpec, sizeof(rcvSpec), losses[l], rtts[r], 2 + n);
+                        unlink(dstPath);
+                        truncate_file(srvReport);
+                        truncate_file(rcvReport);
+
+                        char* rcvArgv[] = { receiver, (char*)"-w", windowArg, (char*)"-e", rcvSpec, (char*)"-r", rcvReport,
+                                            (char*)"localhost", portArg, name, NULL };
+                        int64_t srvCpuBefore = proc_cpu_us(srvPid);
+                        int64_t start = wall_us();
+                        pid_t rcvPid = spawn(rcvDir, rcvArgv);
+
+                        int status = 0;
+                        struct rusage usage;
+                        memset(&usage, 0, sizeof(usage));
+                        bool timedOut = false;
+                        while (wait4(rcvPid, &status, WNOHANG, &usage) == 0) {
+                            if (wall_us() - start > BENCH_TIMEOUT_SEC * 1000000L) {
+                                kill(rcvPid, SIGKILL);
+                                wait4(rcvPid, &status, 0, &usage);
+                                timedOut = true;
+                                break;
+                            }
+                            usleep(1000);
+                        }
+                        int64_t wall = wall_us() - start;
+                        int64_t srvCpu = proc_cpu_us(srvPid) - srvCpuBefore;
+                        int64_t rcvCpu = (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+                                         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+
+                        char srvLine[512], rcvLine[512];
+                        bool ok = !timedOut && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+                                  files_equal(srcPath, dstPath) &&
+                                  read_report(srvReport, srvLine, sizeof(srvLine)) &&
+                                  read_report(rcvReport, rcvLine, sizeof(rcvLine));
+                        if (!ok) {
+                            failures++;
+                            srvLine[0] = '\0';
+                            rcvLine[0] = '\0';
+                        }
+
+                        double bytes = sizes[s];
+                        double duration = report_value(rcvLine, "durationUs");
+                        double segments = report_value(srvLine, "segments");
+                        double gb = bytes > 0 ? bytes / 1e9 : 1;
+                        printf("%s  {\"size\": %ld, \"loss\": %g, \"rttMs\": %g, \"window\": %d, \"run\": %d, \"ok\": %s, "
+                               "\"wallMs\": %.3f, \"goodputMbps\": %.3f, \"ttfbMs\": %.3f, \"retransmitRatio\": %.4f, "
+                               "\"segments\": %.0f, \"retransmits\": %.0f, \"mss\": %.0f, "
+                               "\"serverCpuSecPerGB\": %.3f, \"receiverCpuSecPerGB\": %.3f, "
+                               "\"serverPeakRssKB\": %ld, \"receiverPeakRssKB\": %ld}",
+                            first ? "" : ",\n", (long)bytes, losses[l], rtts[r], (int)windows[w], n, ok ? "true" : "false",
+                            wall / 1e3, duration > 0 ? bytes * 8 / duration : 0, report_value(rcvLine, "ttfbUs") / 1e3,
+                            segments > 0 ? report_value(srvLine, "retransmits") / segments : 0,
+                            segments, report_value(srvLine, "retransmits"), report_value(srvLine, "mss"),
+                            srvCpu / 1e6 / gb, rcvCpu / 1e6 / gb, proc_peak_rss_kb(srvPid), usage.ru_maxrss);
+                        fflush(stdout);
+                        first = false;
+                    }
+                }
+            }
+            kill(srvPid, SIGTERM);
+            waitpid(srvPid, NULL, 0);
+            port++;
+        }
+    }
+    printf("\n]\n");
+
+    char cmd[PATH_MAX + 16];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0)
+        fprintf(stderr, "could not remove %s\n", dir);
+    if (failures > 0)
+        fprintf(stderr, "%d transfers failed\n", failures);
+    return failures > 0 ? 1 : 0;
+}